@@ -51,14 +51,31 @@
 #define UTIL_WEIGHT .60
 
 /*
- * Alignment requirement in bytes (either 4 or 8)
+ * Alignment requirement in bytes: 8 on ILP32, 16 on LP64 like the
+ * system malloc
  */
-#define ALIGNMENT 8
+#define ALIGNMENT (2 * __SIZEOF_POINTER__)
 
 /*
- * Maximum heap size in bytes
+ * Maximum heap size in bytes, reserved up front but committed only as
+ * the heap grows
  */
-#define MAX_HEAP (100*(1<<20))  /* 20 MB */
+#ifdef __LP64__
+#define MAX_HEAP (16UL << 30)           /* 16 GB */
+#else
+#define MAX_HEAP (100*(1<<20))  /* 100 MB */
+#endif
+
+/*
+ * Pages backing the heap: 0 for normal pages, 1 for transparent huge
+ * pages (madvise MADV_HUGEPAGE), 2 for MAP_HUGETLB pages taken from the
+ * reserved pool, with normal pages where the pool runs dry. Override
+ * with -DHEAP_PAGES=n
+ */
+#ifndef HEAP_PAGES
+#define HEAP_PAGES 0
+#endif
+#define HUGE_PAGE_SIZE (2UL << 20)      /* 2 MB */
 
 /*****************************************************************************
  * Set exactly one of these USE_xxx constants to "1" to select a timing method
@@ -3,6 +3,7 @@
  *            allows us to interleave calls from the student's malloc package 
  *            with the system's malloc package in libc.
  */
+#define _GNU_SOURCE  /* mremap */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
@@ -15,23 +16,72 @@
 #include "config.h"
 
 /* private variables */
+static char *mem_reserve;    /* start of the reserved address range */
 static char *mem_start_brk;  /* points to first byte of heap */
 static char *mem_brk;        /* points to last byte of heap */
+static char *mem_commit_brk; /* end of the accessible part of the heap */
 static char *mem_max_addr;   /* largest legal heap address */ 
 
+/* the heap is committed in steps of this many bytes */
+#define COMMIT_SIZE (HEAP_PAGES ? HUGE_PAGE_SIZE : 64 * 1024)
+
+#if HEAP_PAGES == 2
+/* commit steps backed by MAP_HUGETLB pages, one bit per step, the others
+   fell back to normal pages */
+static unsigned char mem_hugetlb[(MAX_HEAP / HUGE_PAGE_SIZE + 7) / 8];
+
+static int mem_is_hugetlb(char *addr)
+{
+    size_t step = (size_t)(addr - mem_start_brk) / HUGE_PAGE_SIZE;
+    return mem_hugetlb[step / 8] >> (step % 8) & 1;
+}
+#endif
+
+/* regions mapped outside the heap by mem_map */
+typedef struct mem_region {
+    char *start;
+    size_t size;
+    struct mem_region *next;
+} mem_region_t;
+
+static mem_region_t *mem_regions; /* live mapped regions */
+static size_t mem_mapped;         /* bytes in live mapped regions */
+static size_t mem_peak;           /* largest heap plus mapped bytes */
+
+/* account for a change of the heap or of the mapped bytes */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - mem_start_brk) + mem_mapped;
+    if (size > mem_peak)
+	mem_peak = size;
+}
+
 /* 
  * mem_init - initialize the memory system model
  */
 void mem_init(void)
 {
-    /* allocate the storage we will use to model the available VM */
-    if ((mem_start_brk = (char *)malloc(MAX_HEAP)) == NULL) {
-	fprintf(stderr, "mem_init_vm: malloc error\n");
+    /* reserve the address space we will use to model the available VM,
+       it stays inaccessible until mem_sbrk commits it. The heap starts
+       on a huge page boundary so huge pages can back it */
+    mem_reserve = mmap(NULL, MAX_HEAP + HUGE_PAGE_SIZE, PROT_NONE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (mem_reserve == MAP_FAILED) {
+	fprintf(stderr, "mem_init_vm: mmap error\n");
 	exit(1);
     }
+    mem_start_brk = (char *)(((uintptr_t)mem_reserve + HUGE_PAGE_SIZE - 1) &
+                             ~(HUGE_PAGE_SIZE - 1));
+#if HEAP_PAGES == 1
+    madvise(mem_start_brk, MAX_HEAP, MADV_HUGEPAGE);
+#endif
 
     mem_max_addr = mem_start_brk + MAX_HEAP;  /* max legal heap address */
     mem_brk = mem_start_brk;                  /* heap is empty initially */
+    mem_commit_brk = mem_start_brk;           /* and none of it is committed */
+#if HEAP_PAGES == 2
+    memset(mem_hugetlb, 0, sizeof(mem_hugetlb));
+#endif
 }
 
 /* 
@@ -39,7 +89,44 @@ void mem_init(void)
  */
 void mem_deinit(void)
 {
-    free(mem_start_brk);
+    munmap(mem_reserve, MAX_HEAP + HUGE_PAGE_SIZE);
+}
+
+/*
+ * mem_commit - make the heap accessible up to at least end, returns 0,
+ *    or -1 if the pages cannot be had
+ */
+static int mem_commit(char *end)
+{
+    uintptr_t offset = end - mem_start_brk;
+    char *new_commit = mem_start_brk +
+	((offset + COMMIT_SIZE - 1) & ~(uintptr_t)(COMMIT_SIZE - 1));
+    size_t size;
+
+    if (new_commit > mem_max_addr)
+	new_commit = mem_max_addr;
+    size = new_commit - mem_commit_brk;
+#if HEAP_PAGES == 2
+    /* a failed MAP_FIXED mmap may leave the range unmapped, so fall back
+       by mapping normal pages over it */
+    if (mmap(mem_commit_brk, size, PROT_READ | PROT_WRITE,
+	     MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_HUGETLB,
+	     -1, 0) != MAP_FAILED) {
+	size_t step;
+	for (step = (size_t)(mem_commit_brk - mem_start_brk) / HUGE_PAGE_SIZE;
+	     step < (size_t)(new_commit - mem_start_brk) / HUGE_PAGE_SIZE;
+	     step++)
+	    mem_hugetlb[step / 8] |= 1 << (step % 8);
+    } else if (mmap(mem_commit_brk, size, PROT_READ | PROT_WRITE,
+		    MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED | MAP_NORESERVE,
+		    -1, 0) == MAP_FAILED)
+	return -1;
+#else
+    if (mprotect(mem_commit_brk, size, PROT_READ | PROT_WRITE) != 0)
+	return -1;
+#endif
+    mem_commit_brk = new_commit;
+    return 0;
 }
 
 /*
@@ -48,26 +135,166 @@ void mem_deinit(void)
 void mem_reset_brk()
 {
     mem_brk = mem_start_brk;
+    mem_peak = 0;
+    update_peak();
 }
 
 /* 
  * mem_sbrk - simple model of the sbrk function. Extends the heap 
- *    by incr bytes and returns the start address of the new area. In
- *    this model, the heap cannot be shrunk.
+ *    by incr bytes and returns the start address of the new area. A
+ *    negative incr shrinks the heap and gives back the pages it leaves.
  */
-void *mem_sbrk(int incr) 
+void *mem_sbrk(intptr_t incr) 
 {
     char *old_brk = mem_brk;
 
-    if ( (incr < 0) || ((mem_brk + incr) > mem_max_addr)) {
+    if (incr < 0 && -incr > mem_brk - mem_start_brk) {
+	errno = EINVAL;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Shrunk below the heap start...\n");
+	return (void *)-1;
+    }
+    if (incr > mem_max_addr - mem_brk) {
 	errno = ENOMEM;
 	fprintf(stderr, "ERROR: mem_sbrk failed. Ran out of memory...\n");
 	return (void *)-1;
     }
+    if (mem_brk + incr > mem_commit_brk && mem_commit(mem_brk + incr) != 0) {
+	errno = ENOMEM;
+	fprintf(stderr, "ERROR: mem_sbrk failed. Could not commit memory...\n");
+	return (void *)-1;
+    }
     mem_brk += incr;
+    if (incr < 0)
+	mem_release(mem_brk, (size_t)-incr);
+    update_peak();
     return (void *)old_brk;
 }
 
+/* give back the whole pages of page bytes in [start, end), returns 0, or
+   -1 if madvise refuses them */
+static int mem_release_pages(char *start, char *end, uintptr_t page)
+{
+    uintptr_t lo = ((uintptr_t)start + page - 1) & ~(page - 1);
+    uintptr_t hi = (uintptr_t)end & ~(page - 1);
+
+    if (lo < hi && madvise((void *)lo, hi - lo, MADV_DONTNEED) != 0) {
+	fprintf(stderr, "ERROR: mem_release failed. madvise: %s\n",
+		strerror(errno));
+	return -1;
+    }
+    return 0;
+}
+
+/*
+ * mem_release - model of madvise(MADV_DONTNEED): gives back the whole
+ *    pages in [start, start + size), which read as zeros once touched again.
+ *    A heap page backed by MAP_HUGETLB is only given back whole. Returns
+ *    0, or -1 if the pages could not be given back.
+ */
+int mem_release(void *start, size_t size)
+{
+    char *lo = start, *hi = lo + size;
+#if HEAP_PAGES == 2
+    /* cut the range at the huge page boundaries, each piece is given back
+       by the pages backing it */
+    while (lo < hi) {
+	char *next = mem_start_brk + ((size_t)(lo - mem_start_brk) /
+				      HUGE_PAGE_SIZE + 1) * HUGE_PAGE_SIZE;
+	if (next > hi)
+	    next = hi;
+	if (mem_release_pages(lo, next, mem_is_hugetlb(lo) ?
+			      HUGE_PAGE_SIZE : mem_pagesize()) != 0)
+	    return -1;
+	lo = next;
+    }
+    return 0;
+#else
+    return mem_release_pages(lo, hi, mem_pagesize());
+#endif
+}
+
+/*
+ * mem_map - model of mmap for blocks kept out of the heap. Maps size
+ *    bytes of zeroed pages and returns their start, NULL on failure.
+ */
+void *mem_map(size_t size)
+{
+    mem_region_t *region = malloc(sizeof(mem_region_t));
+    char *start = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (region == NULL || start == MAP_FAILED) {
+	free(region);
+	if (start != MAP_FAILED)
+	    munmap(start, size);
+	errno = ENOMEM;
+	return NULL;
+    }
+    region->start = start;
+    region->size = size;
+    region->next = mem_regions;
+    mem_regions = region;
+    mem_mapped += size;
+    update_peak();
+    return start;
+}
+
+/* find the link to the region starting at start */
+static mem_region_t **find_region(void *start)
+{
+    mem_region_t **pp = &mem_regions;
+    while (*pp != NULL && (*pp)->start != start)
+	pp = &(*pp)->next;
+    assert(*pp != NULL);
+    return pp;
+}
+
+/*
+ * mem_remap - model of mremap: resizes the region at start, moving its
+ *    pages without copying them if it cannot grow in place. Returns its
+ *    new start, NULL on failure with the region left as it was.
+ */
+void *mem_remap(void *start, size_t old_size, size_t new_size)
+{
+    mem_region_t *region = *find_region(start);
+    char *new_start = mremap(start, old_size, new_size, MREMAP_MAYMOVE);
+    if (new_start == MAP_FAILED) {
+	errno = ENOMEM;
+	return NULL;
+    }
+    region->start = new_start;
+    region->size = new_size;
+    mem_mapped = mem_mapped - old_size + new_size;
+    update_peak();
+    return new_start;
+}
+
+/*
+ * mem_unmap - model of munmap, releases the region at start
+ */
+void mem_unmap(void *start, size_t size)
+{
+    mem_region_t **pp = find_region(start);
+    mem_region_t *region = *pp;
+    *pp = region->next;
+    free(region);
+    munmap(start, size);
+    mem_mapped -= size;
+}
+
+/*
+ * mem_in_map - whether [lo, hi] lies in a mapped region
+ */
+int mem_in_map(void *lo, void *hi)
+{
+    mem_region_t *region;
+    for (region = mem_regions; region != NULL; region = region->next) {
+	if ((char *)lo >= region->start &&
+	    (char *)hi < region->start + region->size)
+	    return 1;
+    }
+    return 0;
+}
+
 /*
  * mem_heap_lo - return address of the first heap byte
  */
@@ -92,6 +319,15 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - mem_start_brk);
 }
 
+/*
+ * mem_peaksize() - returns the largest heap plus mapped size since the
+ *    last mem_reset_brk
+ */
+size_t mem_peaksize()
+{
+    return mem_peak;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -1,11 +1,18 @@
+#include <stdint.h>
 #include <unistd.h>
 
 void mem_init(void);               
 void mem_deinit(void);
-void *mem_sbrk(int incr);
+void *mem_sbrk(intptr_t incr);
+int mem_release(void *start, size_t size);
+void *mem_map(size_t size);
+void *mem_remap(void *start, size_t old_size, size_t new_size);
+void mem_unmap(void *start, size_t size);
+int mem_in_map(void *lo, void *hi);
 void mem_reset_brk(void); 
 void *mem_heap_lo(void);
 void *mem_heap_hi(void);
 size_t mem_heapsize(void);
+size_t mem_peaksize(void);
 size_t mem_pagesize(void);
 
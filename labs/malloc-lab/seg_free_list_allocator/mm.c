@@ -1,7 +1,7 @@
 /*
 This version used the segregated free list
 Implementation Details
-0. Possible Maximum allocate size: (1 << 31) - 1 Bytes
+0. Possible Maximum allocate size: as large as a mapping can be, see 14.
 1. Free Block Organization: use segregated free list
 2. Coalescing: use immediate coalescing with boundary tags
 3. Placement:
@@ -9,36 +9,103 @@ Implementation Details
    - best fit
 4. Splitting: Splitting only if the size of the reminder would equal or exceed the minimum block size
 5. Heap Structure
-   [ free_list_arr | index_arr | [ 1 word padding | block 0 | block 1 | ... ]
+   [ free_list_arr | [ 1 word padding | block 0 | block 1 | ... ]
+   - a word is as wide as a pointer: 4 bytes on ILP32, 8 bytes on LP64
+     (make ARCH=-m64), where payloads are 16 byte aligned
 6. Block Structure:
    - allocated block: [1 word Header | ... payload ... | optional padding ]
    - free block: [ 1 word header] | 1 word prev_pointer | 1 word next_pointer | .... | 1 word footer ]
-7. Minimum block size: 16 bytes
+7. Minimum block size: 4 words, 16 bytes on ILP32, 32 bytes on LP64
 8. Header Structure:
-   - [31 - 3] bit for size
-   - [2] not used
+   - [word - 3] bit for size
+   - [2] mmapped      : the block is a huge block, a mapping of its own
    - [1] prev_alloc   : indicate whether or not previous block is allocated
    - [0] alloc        : indicate whether or not current block is allocated
 9. Size classes: power of 2
    - [16 ~ 31]
    - [32 ~ 63]
    - ...
-   - [2^31 ~ (2^32)-1]
+   - [2^31 ~ ...]
    - total: 28 classes
+   - the class of a size is its highest set bit, found with count-leading-zeros
+   - a bitmap marks the non-empty classes, the first non-empty class at or above
+     an index is found with count-trailing-zeros
 10. How to order free block in each list ?
    - choice 1 ordering by address
    - choice 2 LIFO
+   - classes from TREE_CLASS up (1024 bytes and more) are not lists but treaps
+     keyed by (size, address), with the hash of the address as priority; the
+     prev and next pointers of a free block hold its left and right children,
+     the word after them its parent
 11. Analysis
-   - malloc is linear to the size of one size class, worse case O(N)
-   - free is linear to the size of one size class, if choose ordering by address, otherwise constant time
+   - malloc is linear to the size of one size class, worse case O(N),
+     empty classes are skipped in O(1), best fit in a tree class is O(log N)
+   - free is linear to the size of one size class, if choose ordering by address, otherwise constant time,
+     O(log N) in a tree class
+12. Multi-threaded mode (MULTI_THREAD 1, or compile with -DMULTI_THREAD=1)
+   - the segregated lists, the slabs and the heap are shared and guarded by one lock
+   - each thread caches free small objects, one bin per slab class
+   - malloc and free of a small object hit the cache without taking the lock
+   - an empty bin is filled with TCACHE_FILL objects, a full bin flushes half
+     of its objects back to their slabs, both under the lock
+   - a thread flushes its cache when it exits, mm_init drops every cache
+   - make also builds mtdriver against mm.c with MULTI_THREAD 1 and runs it
+     (make mtcheck): threads malloc, realloc, free and hand blocks to each
+     other, and check every block keeps its fill byte while it is live
+13. Small objects: requests of up to SLAB_MAX_SIZE bytes
+   - served from slabs of SLAB_AREA bytes aligned to SLAB_SIZE, of one object size each
+   - slab classes: every multiple of ALIGNMENT up to SLAB_MAX_SIZE
+   - slab: [ slab header | object 0 | object 1 | ... ], no per-object header
+   - free objects are linked through their first word, objects never used yet
+     are taken from the end of the used part
+   - a slab lives inside an allocated block of the segregated lists, a bitmap of
+     the heap pages tells whether a pointer lies in a slab
+   - a slab with free objects is on the partial list of its class, a slab
+     emptied by free is given back to the segregated lists unless it is the
+     last one of its class
+14. Huge blocks: requests of MMAP_THRESHOLD bytes or more
+   - each one is a mapping of its own from mem_map, outside the heap
+   - huge block: [ list links | mapped size | 1 word header | ... payload ... ]
+   - free unmaps it at once, realloc resizes it with mem_remap, which moves
+     pages instead of copying them
+   - realloc keeps a block where it is, a heap block grown past MMAP_THRESHOLD
+     stays in the heap, where it can grow in place at the end
+   - mm_init unmaps the huge blocks left from before
+15. Giving memory back
+   - a free leaving a free block of TRIM_THRESHOLD bytes or more at the end of
+     the heap shrinks the heap with a negative mem_sbrk, its header becomes the
+     new heap-end padding
+   - a free leaving a free block of RELEASE_THRESHOLD bytes or more elsewhere
+     gives back its pages with mem_release (madvise MADV_DONTNEED), except the
+     ones holding its header, links and footer
+   - a free neighbor of that size was given back already, only the rest of the
+     merged block is released
+   - both thresholds are high, the pages given back are faulted in again when
+     they are used, which costs more than keeping them for heaps that are
+     emptied and refilled
+16. Realloc of a heap block, cheapest first
+   - absorb the free blocks behind it, no copy
+   - at the end of the heap, grow the heap by only the bytes still missing,
+     counting a free block in front of it
+   - merge with the free block in front of it and memmove the payload down
+   - move to a fit from the segregated lists, or to a new block at the end of
+     the heap
+   - moves copy with mm_memcpy: AVX2 or SSE2 vectors as the CPU allows, picked
+     at mm_init, streaming stores from MEMCPY_NT_SIZE bytes, copies under 32
+     bytes done with a few moves from both ends
 */
 #include <stdio.h>
 #include <stdlib.h>
 #include <assert.h>
 #include <stdint.h>
+#include <string.h>
 #include <unistd.h>
 #include "mm.h"
 #include "memlib.h"
+#include "config.h"
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 team_t team = {
     /* Team name */
@@ -58,14 +125,32 @@ team_t team = {
 #define FIRST_FIT           0
 #define HEAP_CHECK          0
 #define LOG_TO_STDERR       0
+#ifndef MULTI_THREAD
+#define MULTI_THREAD        0
+#endif
 
 #define NUM_STACK_TRACE     (20)
-#define ALIGNMENT           (8)
-#define MIN_BK_SIZE         (16)
-#define WSIZE               (4)
-#define DSIZE               (8)
-#define CHUNKSIZE           (176)
-#define REALLOC_CHUNKSIZE   (304)
+#define WSIZE               (__SIZEOF_POINTER__)
+#define DSIZE               (2 * WSIZE)
+#define MIN_BK_SIZE         (2 * DSIZE)  // header, prev, next and footer
+#define CHUNKSIZE           (11 * MIN_BK_SIZE)
+#define REALLOC_CHUNKSIZE   (19 * MIN_BK_SIZE)
+#define SLAB_SIZE           (4096) // alignment of a slab, a power of 2
+// bytes of a slab, it leaves room for the header of the block holding the
+// next slab, so slabs made one after another fill consecutive pages
+#define SLAB_AREA           (SLAB_SIZE - MIN_BK_SIZE)
+#define SLAB_MAX_SIZE       (512)  // largest request served from slabs
+#define SLAB_CLASSES        (SLAB_MAX_SIZE / ALIGNMENT)
+#define TCACHE_FILL         (8)    // objects moved into an empty bin at once
+#define TCACHE_LIMIT        (32)   // objects a bin holds before it is flushed
+#define MMAP_THRESHOLD      (128 * 1024)  // smallest request given a mapping
+#define TRIM_THRESHOLD      (4096 * 1024) // free bytes at the heap end given back
+#define RELEASE_THRESHOLD   (4096 * 1024) // smallest free block whose pages are given back
+#define MEMCPY_NT_SIZE      (1024 * 1024) // copies this large bypass the cache
+
+#if MULTI_THREAD
+#include <pthread.h>
+#endif
 
 static void* heap_head = NULL; // points to heap start
 static void* heap_tail = NULL; // points to heap end, one byte after Epilogue header
@@ -73,17 +158,26 @@ static void* heap_tail = NULL; // points to heap end, one byte after Epilogue he
 #include "mm_helper.h"
 
 const static int LEVEL = 28;
-static size_t *free_list_arr = NULL;
-static size_t *index_arr = NULL;
+const static int TREE_CLASS = 6;  // first class kept as a size tree
+static void **free_list_arr = NULL;
+static uint32_t class_bitmap = 0;  // bit i set iff free_list_arr[i] is not empty
 
+int init_heap(void);
+void *malloc_block(size_t asize);
+void free_block(void *ptr);
+void *realloc_block(void *ptr, size_t size);
 void *extend_heap(size_t size, int type);
 void *realloc_extend_heap(size_t size);
 void *coalesce(void *hdrp);
+void trim_heap(void *hdrp);
+void release_pages(void *hdrp, char *lo, char *hi);
 void *find_fit(size_t asize);
 void *place_and_split(void *hdrp, size_t asize);
 void *realloc_place_and_split(void *hdrp, size_t asize);
 void *backward_collect(void *hdrp, size_t target_size);
+void *forward_collect(void *hdrp, size_t num);
 void mm_memcpy(void *dst, void *src, size_t num);
+void select_memcpy(void);
 
 // helper functions
 int find_index(size_t size);
@@ -91,7 +185,129 @@ void init_free_block(void *hdrp, size_t bk_size);
 void insert_into_size_class(void *hdrp, int index);
 void delete_from_size_class(void *hdrp, int index);
 int is_in_size_class(void *hdrp, int index);
+void *tree_insert(void *root, void *node);
+void *tree_delete(void *root, void *node);
+void *tree_merge(void *left, void *right);
+void *tree_best_fit(void *root, size_t asize);
+void *tree_next(void *root, void *node);
 void print_list(void *hdrp);
+
+// header of a slab, at the start of its SLAB_SIZE aligned page
+typedef struct Slab {
+  struct Slab *prev;          // partial list of its class
+  struct Slab *next;
+  void *free_list;            // free objects, linked through their first word
+  void *block;                // payload of the block holding the slab
+  uint16_t obj_size;
+  uint16_t cls;
+  uint16_t nfree;             // free objects, unused ones included
+  uint16_t unused;            // offset of the first object never used
+} Slab;
+
+#define SLAB_HEADER_SIZE    ((sizeof(Slab) + ALIGNMENT - 1) & ~(ALIGNMENT - 1))
+
+static Slab *slab_partial[SLAB_CLASSES];  // slabs with free objects, per class
+static uint8_t slab_map[MAX_HEAP / SLAB_SIZE / 8 + 2];  // bit per heap page
+static char *slab_map_base = NULL;  // address of the page of bit 0
+static size_t slab_map_used = 0;    // bytes of slab_map ever written
+
+void *slab_malloc(int cls);
+void slab_free(void *ptr);
+Slab *new_slab(int cls);
+char *slab_window(void *hdrp, size_t bk_size);
+void *place_slab(void *hdrp, char *page);
+void link_slab(Slab *slab);
+void unlink_slab(Slab *slab);
+
+// header of a huge block, at the start of its mapping, the payload follows
+typedef struct Huge {
+  struct Huge *prev;          // list of the live huge blocks
+  struct Huge *next;
+  size_t size;                // bytes mapped, a multiple of the page size
+  word_t header;              // MMAPPED | CURR_ALLOC, the word before the payload
+} Huge;
+
+static Huge *huge_list = NULL;
+
+void *huge_malloc(size_t size);
+void huge_free(void *ptr);
+void *huge_realloc(void *ptr, size_t size);
+void link_huge(Huge *huge);
+void unlink_huge(Huge *huge);
+
+inline static Huge *huge_of(void *ptr) {
+  return (Huge*)ptr - 1;
+}
+
+// whether the allocated block of ptr, not a slab object, is a huge block
+inline static int is_huge(void *ptr) {
+  return get_mmapped(get_hdrp(ptr)) != 0;
+}
+
+inline static int slab_class(size_t size) {
+  return (size - 1) / ALIGNMENT;
+}
+
+inline static Slab *slab_of(void *ptr) {
+  return (Slab*)((uintptr_t)ptr & ~(uintptr_t)(SLAB_SIZE - 1));
+}
+
+// whether ptr lies in a slab, safe without the heap lock for a live object
+// the payload of the block after a slab may start in the slab's page, past
+// its SLAB_AREA
+inline static int is_slab_object(void *ptr) {
+  size_t page = ((char*)ptr - slab_map_base) / SLAB_SIZE;
+  return page / 8 < sizeof(slab_map) &&
+    ((uintptr_t)ptr & (SLAB_SIZE - 1)) < SLAB_AREA &&
+    ((__atomic_load_n(&slab_map[page / 8], __ATOMIC_RELAXED) >> (page % 8)) & 1);
+}
+
+inline static void mark_slab_page(Slab *slab, int on) {
+  size_t page = ((char*)slab - slab_map_base) / SLAB_SIZE;
+  if (on) {
+    __atomic_fetch_or(&slab_map[page / 8], 1 << (page % 8), __ATOMIC_RELAXED);
+    if (page / 8 + 1 > slab_map_used) {
+      slab_map_used = page / 8 + 1;
+    }
+  } else {
+    __atomic_fetch_and(&slab_map[page / 8], ~(1 << (page % 8)), __ATOMIC_RELAXED);
+  }
+}
+
+#if MULTI_THREAD
+// a thread's cache of free small objects, linked through their first word
+typedef struct {
+  void *bins[SLAB_CLASSES];   // bins[i] holds objects of slab class i
+  int counts[SLAB_CLASSES];
+  unsigned generation;        // heap_generation the blocks belong to
+  int registered;             // the exit destructor knows about this cache
+} ThreadCache;
+
+static pthread_mutex_t heap_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_once = PTHREAD_ONCE_INIT;
+static __thread ThreadCache tcache;
+static volatile unsigned heap_generation = 0;  // bumped by mm_init
+
+void *tcache_malloc(int cls);
+void tcache_free(void *ptr);
+void tcache_flush(ThreadCache *cache, int bin, int keep);
+void tcache_attach(void);
+void tcache_exit(void *cache);
+void tcache_make_key(void);
+
+inline static void lock_heap(void) {
+  pthread_mutex_lock(&heap_lock);
+}
+
+inline static void unlock_heap(void) {
+  pthread_mutex_unlock(&heap_lock);
+}
+#else
+inline static void lock_heap(void) {}
+inline static void unlock_heap(void) {}
+#endif
+
 /*
  * mm_init - initialize the malloc package.
  */
@@ -103,19 +319,37 @@ int mm_init(void) {
   heap_tail = NULL;
   alloc_list = NULL;
 #endif
-  if (!(free_list_arr = mem_sbrk(LEVEL * WSIZE))) {
-    return NULL;
+  select_memcpy();
+  lock_heap();
+  int ret = init_heap();
+#if MULTI_THREAD
+  ++heap_generation; // blocks cached by any thread belonged to the old heap
+#endif
+  unlock_heap();
+  return ret;
+}
+
+int init_heap(void) {
+  while (huge_list) { // left from before the last mm_init
+    huge_free(huge_list + 1);
   }
 
-  if (!(index_arr = mem_sbrk(LEVEL * WSIZE))) {
-    return NULL;
+  if ((free_list_arr = mem_sbrk(LEVEL * WSIZE)) == (void*)(-1)) {
+    return -1;
   }
 
   int i = 0;
   for (; i < LEVEL; ++i) {
-    *(index_arr + i) = 1 << (i + 4);
     *(free_list_arr + i) = NULL;
   }
+  class_bitmap = 0;
+
+  for (i = 0; i < SLAB_CLASSES; ++i) {
+    slab_partial[i] = NULL;
+  }
+  memset(slab_map, 0, slab_map_used);
+  slab_map_used = 0;
+  slab_map_base = (char*)((uintptr_t)mem_heap_lo() & ~(uintptr_t)(SLAB_SIZE - 1));
 
   // 1 WSIZE for heap-start padding
   // 1 WSIZE for heap-end padding
@@ -130,7 +364,7 @@ int mm_init(void) {
 
 
 #if HEAP_CHECK
-  assert(heap_size() == (2 * LEVEL) * WSIZE + 2 * WSIZE);
+  assert(heap_size() == LEVEL * WSIZE + 2 * WSIZE);
 #endif
   return extend_heap(CHUNKSIZE, 0) == NULL ? -1 : 0;
 }
@@ -142,7 +376,39 @@ void *mm_malloc(size_t size) {
   if (!size) return NULL;
 
   void *ret = NULL;
+  if (size <= SLAB_MAX_SIZE) {
+#if MULTI_THREAD
+    ret = tcache_malloc(slab_class(size));
+#else
+    ret = slab_malloc(slab_class(size));
+#endif
+    return ret;
+  }
+
+  if (size >= MMAP_THRESHOLD) {
+    lock_heap();
+    ret = huge_malloc(size);
+    unlock_heap();
+    return ret;
+  }
+
   size_t asize = align_with_min_bk_size(size + WSIZE);
+  lock_heap();
+  ret = malloc_block(asize);
+  unlock_heap();
+
+#if HEAP_CHECK
+  add_to_alloc_list(ret, size, asize);
+#endif
+
+  return ret;
+}
+
+// allocate a block of asize bytes from the segregated lists or a new chunk,
+// called with the heap lock held
+// return the payload pointer, NULL if the heap cannot grow
+void *malloc_block(size_t asize) {
+  void *ret = NULL;
   void *head = find_fit(asize);
   if (head) {
 
@@ -163,14 +429,10 @@ void *mm_malloc(size_t size) {
     } else {
       head = extend_heap(asize, 0);
     }
+    if (!head) return NULL;
     head = place_and_split(head, asize);
     ret = (char*)head + WSIZE;
   }
-
-#if HEAP_CHECK
-  add_to_alloc_list(ret, size, asize);
-#endif
-
   return ret;
 }
 
@@ -178,15 +440,67 @@ void *mm_malloc(size_t size) {
  * mm_free - Freeing a block does nothing.
  */
 void mm_free(void *ptr) {
+  if (is_slab_object(ptr)) {
+#if MULTI_THREAD
+    tcache_free(ptr);
+#else
+    slab_free(ptr);
+#endif
+    return;
+  }
+  lock_heap();
+  if (is_huge(ptr)) {
+    huge_free(ptr);
+    unlock_heap();
+    return;
+  }
 #if HEAP_CHECK
   assert(ptr);
   delete_from_alloc_list(ptr);
 #endif
-  void *head = (char*)ptr - WSIZE;
+  free_block(ptr);
+  unlock_heap();
+}
+
+// put a block back on the segregated lists, called with the heap lock held
+void free_block(void *ptr) {
+  char *head = (char*)ptr - WSIZE;
   size_t size = get_size(head);
+  // free neighbors this large had their pages given back already
+  int prev_released = !get_prev_alloc(head) &&
+    get_size(head - WSIZE) >= RELEASE_THRESHOLD;
+  int next_released = !get_alloc(head + size) &&
+    get_size(head + size) >= RELEASE_THRESHOLD;
   init_free_block(head, size);
   insert_into_size_class(head, find_index(size));
-  coalesce(head);
+  char *hdrp = coalesce(head);
+  size_t bk_size = get_size(hdrp);
+  if (hdrp + bk_size == (char*)heap_tail - WSIZE && bk_size >= TRIM_THRESHOLD) {
+    trim_heap(hdrp);
+  } else if (bk_size >= RELEASE_THRESHOLD) {
+    release_pages(hdrp, prev_released ? head : hdrp,
+                  next_released ? head + size : hdrp + bk_size);
+  }
+}
+
+// give the free block at the end of the heap back to memlib, its header
+// becomes the new heap-end padding
+void trim_heap(void *hdrp) {
+  size_t size = get_size(hdrp);
+  delete_from_size_class(hdrp, find_index(size));
+  write_word(hdrp, pack(0, get_prev_alloc(hdrp) | CURR_ALLOC));
+  mem_sbrk(-(intptr_t)size);
+  heap_tail = (char*)heap_tail - size;
+}
+
+// give back the pages of free block hdrp in [lo, hi), except the ones
+// holding its header, links and footer
+void release_pages(void *hdrp, char *lo, char *hi) {
+  char *start = (char*)hdrp + DSIZE + DSIZE; // header, prev, next and parent
+  char *end = (char*)hdrp + get_size(hdrp) - WSIZE;
+  if (lo < start) lo = start;
+  if (hi > end) hi = end;
+  if (lo < hi) mem_release(lo, hi - lo);
 }
 
 /*
@@ -202,6 +516,28 @@ void *mm_realloc(void *ptr, size_t size) {
     return NULL;
   }
 
+  if (is_slab_object(ptr)) {
+    // the object size of a live slab does not change, no lock needed
+    size_t obj_size = slab_of(ptr)->obj_size;
+    if (size <= obj_size) {
+      return ptr;
+    }
+    void *new_ptr = mm_malloc(size);
+    if (!new_ptr) return NULL;
+    mm_memcpy(new_ptr, ptr, obj_size);
+    mm_free(ptr);
+    return new_ptr;
+  }
+
+  lock_heap();
+  void *ret = is_huge(ptr) ? huge_realloc(ptr, size) : realloc_block(ptr, size);
+  unlock_heap();
+  return ret;
+}
+
+// resize the block of ptr, in place when possible,
+// called with the heap lock held
+void *realloc_block(void *ptr, size_t size) {
   void *hdrp = get_hdrp(ptr);
   size_t old_size = get_size(hdrp);
   size_t ori_size = old_size;
@@ -209,6 +545,11 @@ void *mm_realloc(void *ptr, size_t size) {
   // if possible, we won't move the data, collect space in place
   hdrp = backward_collect(hdrp, target_size);
   old_size = get_size(hdrp);
+  if (old_size < target_size && !get_prev_alloc(hdrp) &&
+      get_size((char*)hdrp - WSIZE) + old_size >= target_size) {
+    hdrp = forward_collect(hdrp, ori_size - WSIZE);
+    old_size = get_size(hdrp);
+  }
   if (target_size <= old_size) {
 #if HEAP_CHECK
     delete_from_alloc_list(ptr);
@@ -226,7 +567,7 @@ void *mm_realloc(void *ptr, size_t size) {
       set_prev_alloc_bit((char*)hdrp + old_size);
     }
 #if HEAP_CHECK
-    add_to_alloc_list(ptr, size, target_size);
+    add_to_alloc_list((char*)hdrp + WSIZE, size, target_size);
 #endif
     return (char*)hdrp + WSIZE;
   }
@@ -236,7 +577,10 @@ void *mm_realloc(void *ptr, size_t size) {
   if (new_hdrp) {
     new_hdrp = place_and_split(new_hdrp, target_size);
     mm_memcpy((char*)new_hdrp + WSIZE, ptr, ori_size - WSIZE);
-    mm_free(ptr);
+#if HEAP_CHECK
+    delete_from_alloc_list(ptr);
+#endif
+    free_block(ptr);
 #if HEAP_CHECK
     add_to_alloc_list((char*)new_hdrp + WSIZE, size, target_size);
 #endif
@@ -248,32 +592,45 @@ void *mm_realloc(void *ptr, size_t size) {
   if (!new_hdrp) return NULL;
   new_hdrp = place_and_split(new_hdrp, target_size);
   mm_memcpy((char*)new_hdrp + WSIZE, ptr, ori_size - WSIZE);
-  mm_free(ptr);
+#if HEAP_CHECK
+  delete_from_alloc_list(ptr);
+#endif
+  free_block(ptr);
 #if HEAP_CHECK
   add_to_alloc_list((char*)new_hdrp + WSIZE, size, target_size);
 #endif
   return (char*)new_hdrp + WSIZE;
 }
 
+// class i holds sizes [2^(i+4), 2^(i+5)), so the index is the position of
+// the highest set bit minus 4
 int find_index(size_t size) {
-  int low = 0, high = LEVEL;
-  int ret = -1;
-  int mid;
-  while (low < high) {
-    mid = (high + low) >> 1;
-    if (size < index_arr[mid]) {
-      high = mid;
-    } else {
-      low = mid + 1;
-    }
-  }
-  return low - 1;
+  int index = (int)(sizeof(unsigned long) * 8 - 1) - __builtin_clzl(size) - 4;
+  return index < LEVEL ? index : LEVEL - 1;
+}
+
+// the first non-empty class at or above index, LEVEL if none
+inline static int next_nonempty_class(int index) {
+  uint32_t bits = index < LEVEL ? class_bitmap & (~0u << index) : 0;
+  return bits ? __builtin_ctz(bits) : LEVEL;
+}
+
+// walk the free blocks of a class, from its smallest block of at least
+// min_size bytes in a tree class, from its head in a list class
+inline static void *class_first(int index, size_t min_size) {
+  return index >= TREE_CLASS ? tree_best_fit(free_list_arr[index], min_size)
+    : free_list_arr[index];
+}
+
+inline static void *class_next(int index, void *hdrp) {
+  return index >= TREE_CLASS ? tree_next(free_list_arr[index], hdrp)
+    : get_next_ptr(hdrp);
 }
 
 void *extend_heap(size_t size, int type) {
   char *hdrp = NULL;
-  size_t asize =
-    type == 0 ? align_chunksize(size) : align_realloc_chunksize(size);
+  size_t asize = type == 0 ? align_chunksize(size)
+    : type == 1 ? align_realloc_chunksize(size) : align_with_min_bk_size(size);
   if ((void*)(hdrp = mem_sbrk(asize)) == (void*)(-1)) return NULL;
   heap_tail += asize;
   hdrp = (char*)hdrp - WSIZE; // points to heap-end 0 padding
@@ -327,11 +684,17 @@ void *coalesce(void *hdrp) {
   return (char*)prev_hdrp;
 }
 
-// linear search
+// linear search in a list class, tree search in a tree class
 void *find_fit(size_t asize) {
 #if FIRST_FIT
-  int index = find_index(asize);
+  int index = next_nonempty_class(find_index(asize));
   while (index < LEVEL) {
+    if (index >= TREE_CLASS) {
+      void *fit = tree_best_fit(free_list_arr[index], asize);
+      if (fit) return fit;
+      index = next_nonempty_class(index + 1);
+      continue;
+    }
     void *head = free_list_arr[index];
     while (head) {
       if (get_size(head) >= asize) {
@@ -339,13 +702,19 @@ void *find_fit(size_t asize) {
       }
       head = get_next_ptr(head);
     }
-    ++index;
+    index = next_nonempty_class(index + 1);
   }
 #else
-  int index = find_index(asize);
+  int index = next_nonempty_class(find_index(asize));
   void *ret = NULL;
-  size_t min_size = (1 << 31) - 1;
+  size_t min_size = ~(size_t)0;
   while (index < LEVEL) {
+    if (index >= TREE_CLASS) {
+      ret = tree_best_fit(free_list_arr[index], asize);
+      if (ret) return ret;
+      index = next_nonempty_class(index + 1);
+      continue;
+    }
     void *head = free_list_arr[index];
     while (head) {
       size_t h_size = get_size(head);
@@ -356,7 +725,7 @@ void *find_fit(size_t asize) {
       head = get_next_ptr(head);
     }
     if (ret == NULL) {
-      ++index;
+      index = next_nonempty_class(index + 1);
     } else {
       return ret;
     }
@@ -419,19 +788,176 @@ void *backward_collect(void *hdrp, size_t target_size) {
   }
 
   size_t size = get_size(hdrp);
-  if (size < target_size &&
+  // a free block in front is merged by forward_collect(), so the heap
+  // only grows by what the two of them lack
+  size_t have = get_prev_alloc(hdrp) ? size : size + get_size((char*)hdrp - WSIZE);
+  if (have < target_size &&
       (char*)hdrp + size == (char*)heap_tail - WSIZE) {
-    hdrp = extend_heap(target_size - size, 1);
+    // the block ends the heap: absorb the space the heap grows by, which
+    // extend_heap() hands back as a free block behind it
+    void *new_hdrp = extend_heap(target_size - have, 2);
+    if (new_hdrp) {
+      size_t new_size = get_size(new_hdrp);
+      delete_from_size_class(new_hdrp, find_index(new_size));
+      write_word(hdrp, read_word(hdrp) + new_size);
+      set_prev_alloc_bit((char*)hdrp + get_size(hdrp));
+    }
   }
   return hdrp;
 }
 
+// merge the allocated block hdrp with the free block in front of it and
+// move its first num payload bytes to the front, returns the merged block
+void *forward_collect(void *hdrp, size_t num) {
+  size_t prev_size = get_size((char*)hdrp - WSIZE);
+  void *prev_hdrp = (char*)hdrp - prev_size;
+  delete_from_size_class(prev_hdrp, find_index(prev_size));
+  write_word(prev_hdrp,
+             pack(prev_size + get_size(hdrp), get_prev_alloc(prev_hdrp) | CURR_ALLOC));
+  memmove((char*)prev_hdrp + WSIZE, (char*)hdrp + WSIZE, num);
+  return prev_hdrp;
+}
+
+// copy fewer than 32 bytes with moves from both ends, which may overlap
+inline static void copy_small(char *dst, const char *src, size_t num) {
+  uint64_t a, b, c, d;
+  uint32_t x, y;
+  if (num >= 16) {
+    memcpy(&a, src, 8);
+    memcpy(&b, src + 8, 8);
+    memcpy(&c, src + num - 16, 8);
+    memcpy(&d, src + num - 8, 8);
+    memcpy(dst, &a, 8);
+    memcpy(dst + 8, &b, 8);
+    memcpy(dst + num - 16, &c, 8);
+    memcpy(dst + num - 8, &d, 8);
+  } else if (num >= 8) {
+    memcpy(&a, src, 8);
+    memcpy(&b, src + num - 8, 8);
+    memcpy(dst, &a, 8);
+    memcpy(dst + num - 8, &b, 8);
+  } else if (num >= 4) {
+    memcpy(&x, src, 4);
+    memcpy(&y, src + num - 4, 4);
+    memcpy(dst, &x, 4);
+    memcpy(dst + num - 4, &y, 4);
+  } else {
+    while (num--) *dst++ = *src++;
+  }
+}
+
+// copy one word at a time, where no vector copy is available
+static void memcpy_words(char *dst, const char *src, size_t num) {
+  word_t w;
+  for (; num >= WSIZE; num -= WSIZE, dst += WSIZE, src += WSIZE) {
+    memcpy(&w, src, WSIZE);
+    memcpy(dst, &w, WSIZE);
+  }
+  while (num--) *dst++ = *src++;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+// copy at least 16 bytes, 64 bytes per step, the last 16 bytes are stored
+// from a load taken up front so the tail needs no byte loop
+__attribute__((target("sse2")))
+static void memcpy_sse2(char *dst, const char *src, size_t num) {
+  __m128i tail = _mm_loadu_si128((const __m128i*)(src + num - 16));
+  char *dst_tail = dst + num - 16;
+  if (num >= MEMCPY_NT_SIZE) {
+    // streaming stores need 16 byte aligned destinations, the first
+    // store covers the bytes skipped to get there
+    size_t skip = 16 - ((uintptr_t)dst & 15);
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+    dst += skip, src += skip, num -= skip;
+    for (; num > 64; num -= 64, dst += 64, src += 64) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)src);
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+      __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+      __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+      _mm_stream_si128((__m128i*)dst, v0);
+      _mm_stream_si128((__m128i*)(dst + 16), v1);
+      _mm_stream_si128((__m128i*)(dst + 32), v2);
+      _mm_stream_si128((__m128i*)(dst + 48), v3);
+    }
+    _mm_sfence();
+  } else {
+    for (; num > 64; num -= 64, dst += 64, src += 64) {
+      __m128i v0 = _mm_loadu_si128((const __m128i*)src);
+      __m128i v1 = _mm_loadu_si128((const __m128i*)(src + 16));
+      __m128i v2 = _mm_loadu_si128((const __m128i*)(src + 32));
+      __m128i v3 = _mm_loadu_si128((const __m128i*)(src + 48));
+      _mm_storeu_si128((__m128i*)dst, v0);
+      _mm_storeu_si128((__m128i*)(dst + 16), v1);
+      _mm_storeu_si128((__m128i*)(dst + 32), v2);
+      _mm_storeu_si128((__m128i*)(dst + 48), v3);
+    }
+  }
+  for (; num > 16; num -= 16, dst += 16, src += 16) {
+    _mm_storeu_si128((__m128i*)dst, _mm_loadu_si128((const __m128i*)src));
+  }
+  _mm_storeu_si128((__m128i*)dst_tail, tail);
+}
+
+// the same with 32 byte vectors, for at least 32 bytes
+__attribute__((target("avx2")))
+static void memcpy_avx2(char *dst, const char *src, size_t num) {
+  __m256i tail = _mm256_loadu_si256((const __m256i*)(src + num - 32));
+  char *dst_tail = dst + num - 32;
+  if (num >= MEMCPY_NT_SIZE) {
+    size_t skip = 32 - ((uintptr_t)dst & 31);
+    _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+    dst += skip, src += skip, num -= skip;
+    for (; num > 128; num -= 128, dst += 128, src += 128) {
+      __m256i v0 = _mm256_loadu_si256((const __m256i*)src);
+      __m256i v1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+      __m256i v2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+      __m256i v3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+      _mm256_stream_si256((__m256i*)dst, v0);
+      _mm256_stream_si256((__m256i*)(dst + 32), v1);
+      _mm256_stream_si256((__m256i*)(dst + 64), v2);
+      _mm256_stream_si256((__m256i*)(dst + 96), v3);
+    }
+    _mm_sfence();
+  } else {
+    for (; num > 128; num -= 128, dst += 128, src += 128) {
+      __m256i v0 = _mm256_loadu_si256((const __m256i*)src);
+      __m256i v1 = _mm256_loadu_si256((const __m256i*)(src + 32));
+      __m256i v2 = _mm256_loadu_si256((const __m256i*)(src + 64));
+      __m256i v3 = _mm256_loadu_si256((const __m256i*)(src + 96));
+      _mm256_storeu_si256((__m256i*)dst, v0);
+      _mm256_storeu_si256((__m256i*)(dst + 32), v1);
+      _mm256_storeu_si256((__m256i*)(dst + 64), v2);
+      _mm256_storeu_si256((__m256i*)(dst + 96), v3);
+    }
+  }
+  for (; num > 32; num -= 32, dst += 32, src += 32) {
+    _mm256_storeu_si256((__m256i*)dst, _mm256_loadu_si256((const __m256i*)src));
+  }
+  _mm256_storeu_si256((__m256i*)dst_tail, tail);
+}
+#endif
+
+// copy of 32 bytes or more, chosen by select_memcpy()
+static void (*memcpy_bulk)(char *dst, const char *src, size_t num) = memcpy_words;
+
+// pick the widest copy the CPU runs, before any thread can copy
+void select_memcpy(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    memcpy_bulk = memcpy_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    memcpy_bulk = memcpy_sse2;
+  }
+#endif
+}
+
+// copy between two blocks, which never overlap
 void mm_memcpy(void *dst, void *src, size_t num) {
-  char* ddst = (char*)dst;
-  char* ssrc = (char*)src;
-  size_t i = 0;
-  for (i = 0; i < num; ++i) {
-    *ddst++ = *ssrc++;
+  if (num < 32) {
+    copy_small(dst, src, num);
+  } else {
+    memcpy_bulk(dst, src, num);
   }
 }
 
@@ -444,6 +970,11 @@ void init_free_block(void *hdrp, size_t bk_size) {
 }
 
 void insert_into_size_class(void *hdrp, int index) {
+  class_bitmap |= 1u << index;
+  if (index >= TREE_CLASS) {
+    free_list_arr[index] = tree_insert(free_list_arr[index], hdrp);
+    return;
+  }
 #if LIFO_ORDERING
   set_next_ptr(hdrp, free_list_arr[index]); // hdrp->next = head
   set_prev_ptr(hdrp, NULL); // hdrp->prev = NULL
@@ -475,7 +1006,7 @@ void insert_into_size_class(void *hdrp, int index) {
 #endif
 }
 
-// O(1)
+// O(1), in expectation in a tree class
 void delete_from_size_class(void *hdrp, int index) {
   void *head = free_list_arr[index];
 #if HEAP_CHECK
@@ -490,36 +1021,499 @@ void delete_from_size_class(void *hdrp, int index) {
     assert(!is_in_size_class(hdrp, i));
   }
 #endif
-  void *prev_ptr = get_prev_ptr(hdrp);
-  void *next_ptr = get_next_ptr(hdrp);
-  if (!prev_ptr) { // if current node is the firt node
-    free_list_arr[index] = next_ptr; // head = curr_node->next
+  if (index >= TREE_CLASS) {
+    free_list_arr[index] = tree_delete(free_list_arr[index], hdrp);
   } else {
-    set_next_ptr(prev_ptr, next_ptr); // curr->prev->next = curr_node->next
-  }
+    void *prev_ptr = get_prev_ptr(hdrp);
+    void *next_ptr = get_next_ptr(hdrp);
+    if (!prev_ptr) { // if current node is the firt node
+      free_list_arr[index] = next_ptr; // head = curr_node->next
+    } else {
+      set_next_ptr(prev_ptr, next_ptr); // curr->prev->next = curr_node->next
+    }
 
-  if (next_ptr) { // if curr_node->next != NULL
-    set_prev_ptr(next_ptr, prev_ptr); // curr_node->next->prev = curr_node->prev
+    if (next_ptr) { // if curr_node->next != NULL
+      set_prev_ptr(next_ptr, prev_ptr); // curr_node->next->prev = curr_node->prev
+    }
+  }
+  if (!free_list_arr[index]) {
+    class_bitmap &= ~(1u << index);
   }
   set_prev_ptr(hdrp, NULL); // curr->next = NULL
   set_next_ptr(hdrp, NULL); // curr->prev = NULL
 }
 
 int is_in_size_class(void *hdrp, int index) {
-  void *head = free_list_arr[index];
+  void *head = class_first(index, 0);
   while (head && head != hdrp) {
-    head = get_next_ptr(head);
+    head = class_next(index, head);
   }
   return head == hdrp ? 1 : 0;
 }
 
+// --------------------------------------
+// Size Trees
+// --------------------------------------
+// a treap keyed by (size, address): a binary search tree by key and a heap
+// by the priority hashed from the address, which keeps it balanced in
+// expectation; a node is a free block whose prev and next pointers are its
+// children, plus a parent pointer
+inline static void *tree_left(void *node) {
+  return get_prev_ptr(node);
+}
+
+inline static void *tree_right(void *node) {
+  return get_next_ptr(node);
+}
+
+inline static uint32_t tree_priority(void *node) {
+  uint64_t a = (uintptr_t)node >> 4;
+  uint32_t x = (uint32_t)(a ^ (a >> 32));
+  x ^= x >> 16;
+  x *= 0x7feb352d;
+  x ^= x >> 15;
+  x *= 0x846ca68b;
+  x ^= x >> 16;
+  return x;
+}
+
+inline static int tree_less(void *a, void *b) {
+  size_t a_size = get_size(a), b_size = get_size(b);
+  return a_size < b_size || (a_size == b_size && a < b);
+}
+
+// make child the left or right child of parent
+inline static void set_child(void *parent, int right, void *child) {
+  if (right) {
+    set_next_ptr(parent, child);
+  } else {
+    set_prev_ptr(parent, child);
+  }
+  if (child) {
+    set_parent_ptr(child, parent);
+  }
+}
+
+// top down: descend to the first node of lower priority, split its subtree
+// around node into the children of node and put node in its place
+// return the new root
+void *tree_insert(void *root, void *node) {
+  uint32_t priority = tree_priority(node);
+  void *parent = NULL;
+  int right = 0;
+  void *curr = root;
+  while (curr && tree_priority(curr) > priority) {
+    parent = curr;
+    right = !tree_less(node, curr);
+    curr = right ? tree_right(curr) : tree_left(curr);
+  }
+  // last, the rightmost node of the smaller side, first the leftmost of the larger
+  void *last = node, *first = node;
+  while (curr) {
+    if (tree_less(curr, node)) {
+      set_child(last, last != node, curr);
+      last = curr;
+      curr = tree_right(curr);
+    } else {
+      set_child(first, first == node, curr);
+      first = curr;
+      curr = tree_left(curr);
+    }
+  }
+  set_child(last, last != node, NULL);
+  set_child(first, first == node, NULL);
+  if (!parent) {
+    set_parent_ptr(node, NULL);
+    return node;
+  }
+  set_child(parent, right, node);
+  return root;
+}
+
+// node must be in the tree, the merge of its children takes its place
+// without a search from the root, O(1) in expectation
+// return the new root
+void *tree_delete(void *root, void *node) {
+  void *parent = get_parent_ptr(node);
+  void *children = tree_merge(tree_left(node), tree_right(node));
+  if (!parent) {
+    if (children) {
+      set_parent_ptr(children, NULL);
+    }
+    return children;
+  }
+  set_child(parent, tree_right(parent) == node, children);
+  return root;
+}
+
+// join two trees, every key of left is smaller than every key of right
+void *tree_merge(void *left, void *right) {
+  void *root = NULL, *parent = NULL;
+  int side = 0;
+  while (left && right) {
+    // the top of higher priority keeps its outer child, the merge goes on
+    // in its inner one
+    int top_side = tree_priority(left) > tree_priority(right);
+    void *top = top_side ? left : right;
+    if (parent) {
+      set_child(parent, side, top);
+    } else {
+      root = top;
+    }
+    if (top_side) {
+      left = tree_right(left);
+    } else {
+      right = tree_left(right);
+    }
+    parent = top;
+    side = top_side;
+  }
+  void *rest = left ? left : right;
+  if (parent) {
+    set_child(parent, side, rest);
+  } else {
+    root = rest;
+  }
+  return root;
+}
+
+// the smallest block of at least asize bytes, the lowest one among equals
+void *tree_best_fit(void *root, size_t asize) {
+  void *best = NULL;
+  while (root) {
+    if (get_size(root) >= asize) {
+      best = root;
+      root = tree_left(root);
+    } else {
+      root = tree_right(root);
+    }
+  }
+  return best;
+}
+
+// the block after node in (size, address) order
+void *tree_next(void *root, void *node) {
+  void *next = NULL;
+  while (root) {
+    if (tree_less(node, root)) {
+      next = root;
+      root = tree_left(root);
+    } else {
+      root = tree_right(root);
+    }
+  }
+  return next;
+}
+
+// --------------------------------------
+// Slabs
+// --------------------------------------
+// take an object of class cls, called with the heap lock held
+// return NULL if no slab can be made
+void *slab_malloc(int cls) {
+  Slab *slab = slab_partial[cls];
+  if (!slab && !(slab = new_slab(cls))) {
+    return NULL;
+  }
+  void *obj = slab->free_list;
+  if (obj) {
+    slab->free_list = *(void**)obj;
+  } else {
+    obj = (char*)slab + slab->unused;
+    slab->unused += slab->obj_size;
+  }
+  if (!--slab->nfree) { // full
+    unlink_slab(slab);
+  }
+  return obj;
+}
+
+// give an object back to its slab, called with the heap lock held
+void slab_free(void *ptr) {
+  Slab *slab = slab_of(ptr);
+  *(void**)ptr = slab->free_list;
+  slab->free_list = ptr;
+  if (!slab->nfree++) { // was full
+    link_slab(slab);
+  }
+  size_t nobjs = (SLAB_AREA - SLAB_HEADER_SIZE) / slab->obj_size;
+  if (slab->nfree == nobjs && (slab->prev || slab->next)) {
+    unlink_slab(slab);
+    mark_slab_page(slab, 0);
+    free_block(slab->block);
+  }
+}
+
+// carve a slab of class cls from a free block that holds an aligned page,
+// or from the top of the heap
+Slab *new_slab(int cls) {
+  void *hdrp = NULL;
+  char *page = NULL;
+  int index = next_nonempty_class(find_index(SLAB_AREA + WSIZE));
+  while (index < LEVEL && !page) {
+    for (hdrp = class_first(index, SLAB_AREA + WSIZE); hdrp;
+         hdrp = class_next(index, hdrp)) {
+      if ((page = slab_window(hdrp, get_size(hdrp)))) {
+        break;
+      }
+    }
+    index = next_nonempty_class(index + 1);
+  }
+
+  if (!page) {
+    // the free block at the top of the heap, or where the next one starts
+    char *start = (char*)heap_tail - WSIZE;
+    if (!get_prev_alloc(start)) {
+      start -= get_size(start - WSIZE);
+    }
+    page = slab_window(start, ~(size_t)0);
+    size_t end = page + SLAB_AREA + MIN_BK_SIZE - start;
+    size_t have = (char*)heap_tail - WSIZE - start;
+    if (!(hdrp = extend_heap(end - have, 0))) {
+      return NULL;
+    }
+  }
+
+  void *block = place_slab(hdrp, page);
+  Slab *slab = (Slab*)page;
+  slab->prev = slab->next = NULL;
+  slab->free_list = NULL;
+  slab->block = block;
+  slab->obj_size = (cls + 1) * ALIGNMENT;
+  slab->cls = cls;
+  slab->nfree = (SLAB_AREA - SLAB_HEADER_SIZE) / slab->obj_size;
+  slab->unused = SLAB_HEADER_SIZE;
+  mark_slab_page(slab, 1);
+  link_slab(slab);
+  return slab;
+}
+
+// the first SLAB_SIZE aligned page that a block carved from the free block
+// hdrp can hold with a free block of at least MIN_BK_SIZE left in front
+// return NULL if the free block is too small
+char *slab_window(void *hdrp, size_t bk_size) {
+  char *payload = (char*)hdrp + WSIZE;
+  char *page = (char*)(((uintptr_t)payload + SLAB_SIZE - 1) & ~(uintptr_t)(SLAB_SIZE - 1));
+  size_t front = (page - payload) / MIN_BK_SIZE * MIN_BK_SIZE;
+  size_t lead = page - (payload + front);
+  size_t need = align_with_min_bk_size(WSIZE + lead + SLAB_AREA);
+  return front + need <= bk_size ? page : NULL;
+}
+
+// allocate the block of the slab at page from the free block hdrp, the
+// free parts in front and behind it go back to the segregated lists
+// return the payload of the slab's block
+void *place_slab(void *hdrp, char *page) {
+  size_t bk_size = get_size(hdrp);
+  delete_from_size_class(hdrp, find_index(bk_size));
+  char *payload = (char*)hdrp + WSIZE;
+  size_t front = (page - payload) / MIN_BK_SIZE * MIN_BK_SIZE;
+  if (front) {
+    init_free_block(hdrp, front);
+    insert_into_size_class(hdrp, find_index(front));
+    hdrp = (char*)hdrp + front;
+    bk_size -= front;
+    write_word(hdrp, pack(bk_size, 0));
+  }
+
+  size_t need = align_with_min_bk_size(WSIZE + (page - ((char*)hdrp + WSIZE)) + SLAB_AREA);
+  size_t left_size = bk_size - need;
+  if (left_size) {
+    write_word(hdrp, pack(need, get_prev_alloc(hdrp) | CURR_ALLOC));
+    void *new_free_hdrp = (char*)hdrp + need;
+    write_word(new_free_hdrp, PREV_ALLOC);
+    init_free_block(new_free_hdrp, left_size);
+    insert_into_size_class(new_free_hdrp, find_index(left_size));
+  } else {
+    set_alloc_bit(hdrp);
+    set_prev_alloc_bit((char*)hdrp + bk_size);
+  }
+  return (char*)hdrp + WSIZE;
+}
+
+void link_slab(Slab *slab) {
+  Slab **head = &slab_partial[slab->cls];
+  slab->prev = NULL;
+  slab->next = *head;
+  if (*head) {
+    (*head)->prev = slab;
+  }
+  *head = slab;
+}
+
+void unlink_slab(Slab *slab) {
+  if (slab->prev) {
+    slab->prev->next = slab->next;
+  } else {
+    slab_partial[slab->cls] = slab->next;
+  }
+  if (slab->next) {
+    slab->next->prev = slab->prev;
+  }
+  slab->prev = slab->next = NULL;
+}
+
+// --------------------------------------
+// Huge Blocks
+// --------------------------------------
+// bytes to map for a huge block of size bytes, 0 if too large
+inline static size_t huge_map_size(size_t size) {
+  size_t page = mem_pagesize();
+  if (size > SIZE_MAX - sizeof(Huge) - page) return 0;
+  return (sizeof(Huge) + size + page - 1) / page * page;
+}
+
+// map a huge block, called with the heap lock held
+// return the payload pointer, NULL if it cannot be mapped
+void *huge_malloc(size_t size) {
+  size_t map_size = huge_map_size(size);
+  Huge *huge = map_size ? mem_map(map_size) : NULL;
+  if (!huge) return NULL;
+  huge->size = map_size;
+  huge->header = MMAPPED | CURR_ALLOC;
+  link_huge(huge);
+  return huge + 1;
+}
+
+// unmap a huge block, called with the heap lock held
+void huge_free(void *ptr) {
+  Huge *huge = huge_of(ptr);
+  unlink_huge(huge);
+  mem_unmap(huge, huge->size);
+}
+
+// resize a huge block, by page table updates rather than a copy,
+// called with the heap lock held
+// return the payload pointer, NULL with the block unchanged on failure
+void *huge_realloc(void *ptr, size_t size) {
+  Huge *huge = huge_of(ptr);
+  size_t map_size = huge_map_size(size);
+  if (map_size == huge->size) return ptr;
+  if (!map_size) return NULL;
+  unlink_huge(huge);
+  Huge *moved = mem_remap(huge, huge->size, map_size);
+  if (!moved) {
+    link_huge(huge);
+    return NULL;
+  }
+  moved->size = map_size;
+  link_huge(moved);
+  return moved + 1;
+}
+
+void link_huge(Huge *huge) {
+  huge->prev = NULL;
+  huge->next = huge_list;
+  if (huge_list) {
+    huge_list->prev = huge;
+  }
+  huge_list = huge;
+}
+
+void unlink_huge(Huge *huge) {
+  if (huge->prev) {
+    huge->prev->next = huge->next;
+  } else {
+    huge_list = huge->next;
+  }
+  if (huge->next) {
+    huge->next->prev = huge->prev;
+  }
+}
+
+#if MULTI_THREAD
+// --------------------------------------
+// Per-thread Cache
+// --------------------------------------
+// make the calling thread's cache usable: register it for the exit flush and
+// drop the objects it holds from before the last mm_init
+void tcache_attach(void) {
+  if (!tcache.registered) {
+    pthread_once(&tcache_once, tcache_make_key);
+    pthread_setspecific(tcache_key, &tcache);
+    tcache.registered = 1;
+  }
+  if (tcache.generation != heap_generation) {
+    int i;
+    for (i = 0; i < SLAB_CLASSES; ++i) {
+      tcache.bins[i] = NULL;
+      tcache.counts[i] = 0;
+    }
+    tcache.generation = heap_generation;
+  }
+}
+
+void *tcache_malloc(int cls) {
+  tcache_attach();
+  void *ptr = tcache.bins[cls];
+  if (ptr) { // hit, no lock
+    tcache.bins[cls] = *(void**)ptr;
+    --tcache.counts[cls];
+    return ptr;
+  }
+  // miss: take a batch from the slabs, keep all but one
+  lock_heap();
+  ptr = slab_malloc(cls);
+  int i;
+  for (i = 1; ptr && i < TCACHE_FILL; ++i) {
+    void *extra = slab_malloc(cls);
+    if (!extra) break;
+    *(void**)extra = tcache.bins[cls];
+    tcache.bins[cls] = extra;
+    ++tcache.counts[cls];
+  }
+  unlock_heap();
+  return ptr;
+}
+
+void tcache_free(void *ptr) {
+  tcache_attach();
+  int cls = slab_of(ptr)->cls;
+  *(void**)ptr = tcache.bins[cls];
+  tcache.bins[cls] = ptr;
+  if (++tcache.counts[cls] > TCACHE_LIMIT) {
+    lock_heap();
+    tcache_flush(&tcache, cls, TCACHE_LIMIT / 2);
+    unlock_heap();
+  }
+}
+
+// give the objects of a bin back to their slabs, all but keep of them,
+// called with the heap lock held
+void tcache_flush(ThreadCache *cache, int bin, int keep) {
+  while (cache->counts[bin] > keep) {
+    void *ptr = cache->bins[bin];
+    cache->bins[bin] = *(void**)ptr;
+    --cache->counts[bin];
+    slab_free(ptr);
+  }
+}
+
+// thread exit destructor: flush every bin
+void tcache_exit(void *cache) {
+  ThreadCache *tc = (ThreadCache*)cache;
+  lock_heap();
+  if (tc->generation == heap_generation) {
+    int i;
+    for (i = 0; i < SLAB_CLASSES; ++i) {
+      tcache_flush(tc, i, 0);
+    }
+  }
+  unlock_heap();
+}
+
+void tcache_make_key(void) {
+  pthread_key_create(&tcache_key, tcache_exit);
+}
+#endif
+
 void print_list(void *hdrp) {
   fprintf(stderr, "\n\n");
   while (hdrp) {
     fprintf(stderr, "-------------------\n");
-    fprintf(stderr, "Block Header: %x, Size = %u, ALLOC Bit = %d\n",
+    fprintf(stderr, "Block Header: %p, Size = %zu, ALLOC Bit = %zu\n",
             hdrp, get_size(hdrp), get_alloc(hdrp));
-    fprintf(stderr, "Previous Ptr: %x, Next Ptr: %x\n",
+    fprintf(stderr, "Previous Ptr: %p, Next Ptr: %p\n",
             get_prev_ptr(hdrp), get_next_ptr(hdrp));
     hdrp = get_next_ptr(hdrp);
   }
@@ -534,7 +1528,7 @@ void to_binary_str(size_t num, int sep) {
   int size = sizeof(num) * 8;
   int i;
   for (i = size - 1; i >= 0; --i) {
-    fprintf(stderr, "%d", !!(num & (1 << i)));
+    fprintf(stderr, "%d", !!(num & ((size_t)1 << i)));
     if (sep && !(i % 4)) {
       fprintf(stderr, " ");
     }
@@ -547,7 +1541,7 @@ void to_hex_str(size_t num, int sep) {
   int size = sizeof(num) * 8;
   int i;
   for (i = size - 4; i >= 0; i -= 4) {
-    fprintf(stderr, "%x", (num & (mask << i)) >> i);
+    fprintf(stderr, "%x", (unsigned)((num & (mask << i)) >> i));
     if (sep && !(i % 8)) {
       fprintf(stderr, " ");
     }
@@ -644,30 +1638,30 @@ void show_heap(void) {
   // TODO: change the code, since i change the heap_tail to one byte after
   void* p = heap_head;
   DebugStr("-----------------\n");
-  DebugStr("heap_head = %x, heap size = %u\n",
+  DebugStr("heap_head = %p, heap size = %zu\n",
            p, (char*)heap_tail  - (char*)heap_head);
   DebugStr("-----------------\n");
-  DebugStr("%x\n", (char*)p + WSIZE);
-  DebugStr("%x\n", (char*)p + 2 * WSIZE);
+  DebugStr("%p\n", (char*)p + WSIZE);
+  DebugStr("%p\n", (char*)p + 2 * WSIZE);
   DebugStr("-----------------\n");
   p = (char*)p + 3 * WSIZE;
   assert(p < heap_tail);
   while (get_size(p) > 0) {
     assert(p < heap_tail);
-    DebugStr("hdrp:%x val = ", p);
-    to_hex_str(*(size_t*)p, 1);
-    DebugStr("size = %u, ALLOC = %d, PREV_ALLOC = %d\n",
+    DebugStr("hdrp:%p val = ", p);
+    to_hex_str(read_word(p), 1);
+    DebugStr("size = %zu, ALLOC = %d, PREV_ALLOC = %d\n",
              get_size(p), !!get_alloc(p), !!get_prev_alloc(p));
     void *ftrp = (char*)p + get_size(p) - WSIZE;
-    DebugStr("ftrp:%x val = ", ftrp);
-    to_hex_str(*(size_t*)ftrp, 1);
+    DebugStr("ftrp:%p val = ", ftrp);
+    to_hex_str(read_word(ftrp), 1);
     if (!get_alloc(p)) { // if current block is not allocated, header = footer
       assert(read_word(p) == read_word(ftrp));
     }
     DebugStr("-----------------\n");
     p += get_size(p);
   }
-  DebugStr("heap_tail = %x\n", p);
+  DebugStr("heap_tail = %p\n", p);
   DebugStr("-----------------\n");
 }
 
@@ -687,7 +1681,7 @@ void show_alloc_list(void) {
   HeapStruct *alist = alloc_list;
   DebugStr("\n-------------------\n");
   while (alist) {
-    DebugStr("Head = %x, Tail = %x, Payload Head = %x, Payload Tail = %x\n",
+    DebugStr("Head = %p, Tail = %p, Payload Head = %p, Payload Tail = %p\n",
       alist->bk_head, alist->bk_tail, alist->pl_head, alist->pl_tail);
     DebugStr("-------------------\n");
     alist = alist->next;
@@ -714,13 +1708,13 @@ size_t heap_size(void) {
 int segregated_free_list_valid(void) {
   int i = 0;
   for (i = 0; i < LEVEL; ++i) {
-    size_t low = index_arr[i];
+    size_t low = (size_t)1 << (i + 4);
     size_t high = low * 2 - 1;
-    void *head = free_list_arr[i];
+    void *head = class_first(i, 0);
     while (head) {
       size_t size = get_size(head);
       assert(size >= low && size < high);
-      head = get_next_ptr(head);
+      head = class_next(i, head);
     }
   }
 }
@@ -49,8 +49,12 @@ size_t heap_size(void);
 int segregated_free_list_valid(void);
 #endif
 
+// a header, a footer or a link is a word, as wide as a pointer
+typedef uintptr_t word_t;
+
 const size_t CURR_ALLOC = (1 << 0);
 const size_t PREV_ALLOC = (1 << 1);
+const size_t MMAPPED = (1 << 2);
 const size_t SIZE_MASK = (~(ALIGNMENT-1));
 
 inline static size_t align(size_t size) {
@@ -85,65 +89,69 @@ inline static int is_align_with_rechunksize(size_t size) {
   return !(size % REALLOC_CHUNKSIZE);
 }
 
-inline static uint32_t read_word(uint32_t *p) {
+inline static word_t read_word(void *p) {
 #if HEAP_CHECK
   if (!within_heap(p)) {
-    DebugStr("%x lies outside heap [%x, %x)\n", p, heap_head, heap_tail);
+    DebugStr("%p lies outside heap [%p, %p)\n", p, heap_head, heap_tail);
     abort();
   }
 #endif
-  return *p;
+  return *(word_t*)p;
 }
 
-inline static void write_word(uint32_t *p, uint32_t val) {
+inline static void write_word(void *p, word_t val) {
 #if HEAP_CHECK
   if (!within_heap(p)) {
-    DebugStr("%x lies outside heap [%x, %x)\n", p, heap_head, heap_tail);
+    DebugStr("%p lies outside heap [%p, %p)\n", p, heap_head, heap_tail);
     abort();
   }
 
   if (addr_is_payload(p)) {
-    DebugStr("%x is inside payload\n", p);
+    DebugStr("%p is inside payload\n", p);
     abort();
   }
 #endif
-  *p = val;
+  *(word_t*)p = val;
 }
 
-inline static void set_alloc_bit(uint32_t *p) {
-  *p |= CURR_ALLOC;
+inline static void set_alloc_bit(void *p) {
+  *(word_t*)p |= CURR_ALLOC;
 }
 
-inline static void clr_alloc_bit(uint32_t *p) {
-  *p &= ~CURR_ALLOC;
+inline static void clr_alloc_bit(void *p) {
+  *(word_t*)p &= ~CURR_ALLOC;
 }
 
-inline static void set_prev_alloc_bit(uint32_t *p) {
-  *p |= PREV_ALLOC;
+inline static void set_prev_alloc_bit(void *p) {
+  *(word_t*)p |= PREV_ALLOC;
 }
 
-inline static void clr_prev_alloc_bit(uint32_t *p) {
-  *p &= ~PREV_ALLOC;
+inline static void clr_prev_alloc_bit(void *p) {
+  *(word_t*)p &= ~PREV_ALLOC;
 }
 
 inline static size_t pack(size_t size, size_t val) {
   return (size | val);
 }
 
-inline static void set_size(uint32_t *p, size_t size) {
-  *p = (((*p) & ~(SIZE_MASK)) | size);
+inline static void set_size(void *p, size_t size) {
+  *(word_t*)p = ((*(word_t*)p & ~(SIZE_MASK)) | size);
+}
+
+inline static size_t get_size(void *hdrp) {
+  return (*(word_t*)hdrp & SIZE_MASK);
 }
 
-inline static size_t get_size(uint32_t *hdrp) {
-  return ((*hdrp) & SIZE_MASK);
+inline static size_t get_alloc(void *hdrp) {
+  return (*(word_t*)hdrp & CURR_ALLOC);
 }
 
-inline static size_t get_alloc(uint32_t *hdrp) {
-  return ((*hdrp) & CURR_ALLOC);
+inline static size_t get_prev_alloc(void *hdrp) {
+  return (*(word_t*)hdrp & PREV_ALLOC);
 }
 
-inline static size_t get_prev_alloc(uint32_t *hdrp) {
-  return ((*hdrp) & PREV_ALLOC);
+inline static size_t get_mmapped(void *hdrp) {
+  return (*(word_t*)hdrp & MMAPPED);
 }
 
 inline static void *get_hdrp(void *ptr) {
@@ -163,19 +171,32 @@ inline static void *prev_ptr(void *hdrp) {
 }
 
 inline static void *get_prev_ptr(void *hdrp) {
-  return (void*)(*((uint32_t*)prev_ptr(hdrp)));
+  return *(void**)prev_ptr(hdrp);
 }
 
 inline static void *get_next_ptr(void *hdrp) {
-  return (void*)(*(uint32_t*)next_ptr(hdrp));
+  return *(void**)next_ptr(hdrp);
 }
 
 inline static void set_prev_ptr(void *hdrp, void *ptr) {
-  *(uint32_t*)(prev_ptr(hdrp)) = ptr;
+  *(void**)prev_ptr(hdrp) = ptr;
 }
 
 inline static void set_next_ptr(void *hdrp, void *ptr) {
-  *(uint32_t*)(next_ptr(hdrp)) = ptr;
+  *(void**)next_ptr(hdrp) = ptr;
+}
+
+// only blocks of the tree classes, large enough for a third pointer, have a parent
+inline static void *parent_ptr(void *hdrp) {
+  return ((char*)hdrp + DSIZE + WSIZE);
+}
+
+inline static void *get_parent_ptr(void *hdrp) {
+  return *(void**)parent_ptr(hdrp);
+}
+
+inline static void set_parent_ptr(void *hdrp, void *ptr) {
+  *(void**)parent_ptr(hdrp) = ptr;
 }
 
 #endif
\ No newline at end of file
@@ -0,0 +1,367 @@
+/*
+ * mtdriver.c - Threaded stress driver for the MULTI_THREAD build of mm.c
+ *
+ * Runs several threads that malloc, realloc and free blocks of mixed
+ * sizes at random, fill each block with a byte of its own and check the
+ * byte is still there before the block is resized or freed. Threads hand
+ * blocks to each other through a shared table, so objects cached by one
+ * thread are freed by another. A block given to two callers at once, or
+ * a cache holding a live object, shows up as an overwritten fill byte.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include "mm.h"
+#include "memlib.h"
+#include "config.h"
+
+/**********************
+ * Constants and macros
+ **********************/
+
+#define NUM_THREADS   4       /* default number of threads */
+#define NUM_OPS       200000  /* default requests per thread and round */
+#define NUM_ROUNDS    3       /* default rounds, each one after mm_init */
+#define NUM_SLOTS     512     /* blocks a thread holds at most */
+#define NUM_HANDOFF   64      /* blocks in flight between threads */
+#define MAX_THREADS   64
+
+/* Returns true if p is ALIGNMENT-byte aligned */
+#define IS_ALIGNED(p)  ((((uintptr_t)(p)) % ALIGNMENT) == 0)
+
+/******************************
+ * The key compound data types
+ *****************************/
+
+/* A live block and the byte it is filled with */
+typedef struct {
+    char *p;               /* payload, NULL if the slot is empty */
+    size_t size;           /* bytes requested */
+    unsigned char fill;    /* every payload byte holds this */
+} block_t;
+
+/* One thread's state */
+typedef struct {
+    int id;                /* thread number */
+    int ops;               /* requests to make */
+    unsigned seed;         /* state of the random number generator */
+    block_t slots[NUM_SLOTS];
+} worker_t;
+
+/********************
+ * Global variables
+ *******************/
+static int verbose = 0;           /* print each round */
+static int errors = 0;            /* number of errors found */
+static pthread_mutex_t error_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* blocks handed from one thread to another, guarded by handoff_lock */
+static block_t handoff[NUM_HANDOFF];
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*********************
+ * Function prototypes
+ *********************/
+
+static void *run_worker(void *arg);
+static unsigned next_rand(unsigned *seed);
+static size_t pick_size(unsigned *seed);
+static int new_block(worker_t *w, block_t *b, int op);
+static int check_block(worker_t *w, block_t *b, int op);
+static int resize_block(worker_t *w, block_t *b, int op);
+static void free_block(block_t *b);
+static void swap_handoff(worker_t *w, block_t *b);
+static void usage(void);
+static void unix_error(char *msg);
+static void app_error(char *msg);
+static void malloc_error(int thread, int op, char *msg);
+
+/**************
+ * Main routine
+ **************/
+int main(int argc, char **argv)
+{
+    int i, round;
+    char c;
+    int num_threads = NUM_THREADS;
+    int num_ops = NUM_OPS;
+    int num_rounds = NUM_ROUNDS;
+    pthread_t tids[MAX_THREADS];
+    worker_t *workers;
+    struct timespec start, end;
+    double secs;
+
+    while ((c = getopt(argc, argv, "t:n:r:vh")) != EOF) {
+        switch (c) {
+        case 't': /* number of threads */
+            num_threads = atoi(optarg);
+            break;
+        case 'n': /* requests per thread and round */
+            num_ops = atoi(optarg);
+            break;
+        case 'r': /* rounds */
+            num_rounds = atoi(optarg);
+            break;
+        case 'v': /* Print each round */
+            verbose = 1;
+            break;
+        case 'h': /* Print this message */
+            usage();
+            exit(0);
+        default:
+            usage();
+            exit(1);
+        }
+    }
+    if (num_threads < 1 || num_threads > MAX_THREADS ||
+        num_ops < 1 || num_rounds < 1)
+        app_error("mtdriver: bad -t, -n or -r value");
+
+    if ((workers = calloc(num_threads, sizeof(worker_t))) == NULL)
+        unix_error("calloc in main failed");
+
+    mem_init();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (round = 0; round < num_rounds && !errors; round++) {
+        /* blocks cached by the threads of the last round are dropped */
+        mem_reset_brk();
+        if (mm_init() < 0)
+            app_error("mm_init failed.");
+        memset(handoff, 0, sizeof(handoff));
+
+        for (i = 0; i < num_threads; i++) {
+            memset(&workers[i], 0, sizeof(worker_t));
+            workers[i].id = i;
+            workers[i].ops = num_ops;
+            workers[i].seed = 2654435761u * (unsigned)(round * MAX_THREADS + i + 1);
+            if (pthread_create(&tids[i], NULL, run_worker, &workers[i]) != 0)
+                unix_error("pthread_create in main failed");
+        }
+        for (i = 0; i < num_threads; i++)
+            pthread_join(tids[i], NULL);
+
+        /* the blocks left in flight are freed by the main thread */
+        for (i = 0; i < NUM_HANDOFF; i++) {
+            if (handoff[i].p && !errors)
+                check_block(&workers[0], &handoff[i], -1);
+            free_block(&handoff[i]);
+        }
+        if (verbose)
+            printf("round %d: %d threads x %d requests, heap %zu bytes\n",
+                   round, num_threads, num_ops, mem_heapsize());
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    mem_deinit();
+    free(workers);
+
+    if (errors) {
+        printf("mtdriver: %d errors\n", errors);
+        exit(1);
+    }
+    secs = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("mtdriver: %d threads, %d rounds, %.0f Kops/sec: ok\n",
+           num_threads, num_rounds,
+           (double)num_threads * num_ops * num_rounds / secs / 1e3);
+    exit(0);
+}
+
+/*
+ * run_worker - make w->ops random requests, then free what is left
+ */
+static void *run_worker(void *arg)
+{
+    worker_t *w = (worker_t *)arg;
+    int op;
+
+    for (op = 0; op < w->ops && !errors; op++) {
+        unsigned r = next_rand(&w->seed);
+        block_t *b = &w->slots[r % NUM_SLOTS];
+
+        r >>= 16;
+        if (!b->p) {
+            if (new_block(w, b, op) < 0)
+                break;
+            continue;
+        }
+        if (check_block(w, b, op) < 0)
+            break;
+        if (r % 16 == 0) {        /* pass the block to another thread */
+            swap_handoff(w, b);
+            if (b->p && check_block(w, b, op) < 0)
+                break;
+        } else if (r % 16 < 4) {  /* resize it */
+            if (resize_block(w, b, op) < 0)
+                break;
+        } else {
+            free_block(b);
+        }
+    }
+
+    for (op = 0; op < NUM_SLOTS; op++)
+        free_block(&w->slots[op]);
+    return NULL;
+}
+
+/*
+ * next_rand - xorshift generator, one state per thread
+ */
+static unsigned next_rand(unsigned *seed)
+{
+    unsigned x = *seed;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    return *seed = x;
+}
+
+/*
+ * pick_size - mostly small objects served by the thread caches, some
+ *     blocks from the segregated lists and a few huge blocks
+ */
+static size_t pick_size(unsigned *seed)
+{
+    unsigned r = next_rand(seed);
+
+    if (r % 100 < 85)
+        return 1 + (r >> 8) % 512;
+    if (r % 100 < 99)
+        return 513 + (r >> 8) % (16 * 1024);
+    return 100 * 1024 + (r >> 8) % (100 * 1024);
+}
+
+/*
+ * new_block - malloc a block of random size into b and fill it
+ */
+static int new_block(worker_t *w, block_t *b, int op)
+{
+    b->size = pick_size(&w->seed);
+    if ((b->p = mm_malloc(b->size)) == NULL) {
+        malloc_error(w->id, op, "mm_malloc failed.");
+        return -1;
+    }
+    if (!IS_ALIGNED(b->p)) {
+        malloc_error(w->id, op, "Payload address not aligned.");
+        return -1;
+    }
+    b->fill = (unsigned char)next_rand(&w->seed);
+    memset(b->p, b->fill, b->size);
+    return 0;
+}
+
+/*
+ * check_block - whether the payload of b still holds its fill byte, at
+ *     most 256 bytes of it spread over the block and the last one
+ */
+static int check_block(worker_t *w, block_t *b, int op)
+{
+    size_t i, step = b->size / 256 + 1;
+
+    for (i = 0; i < b->size; i += step)
+        if ((unsigned char)b->p[i] != b->fill)
+            break;
+    if (i < b->size || (unsigned char)b->p[b->size - 1] != b->fill) {
+        malloc_error(w->id, op, "Payload overwritten while the block was live.");
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * resize_block - mm_realloc b to a random size, the old bytes it keeps
+ *     must come along
+ */
+static int resize_block(worker_t *w, block_t *b, int op)
+{
+    size_t size = pick_size(&w->seed);
+    size_t keep = size < b->size ? size : b->size;
+    char *p;
+
+    if ((p = mm_realloc(b->p, size)) == NULL) {
+        malloc_error(w->id, op, "mm_realloc failed.");
+        return -1;
+    }
+    if (!IS_ALIGNED(p)) {
+        malloc_error(w->id, op, "Payload address not aligned.");
+        return -1;
+    }
+    b->p = p;
+    b->size = keep;
+    if (check_block(w, b, op) < 0)
+        return -1;
+    b->size = size;
+    memset(b->p, b->fill, b->size);
+    return 0;
+}
+
+/*
+ * free_block - mm_free the block of b, if any, and empty the slot
+ */
+static void free_block(block_t *b)
+{
+    if (b->p)
+        mm_free(b->p);
+    b->p = NULL;
+}
+
+/*
+ * swap_handoff - trade b for the block of a random handoff slot, which
+ *     another thread most likely allocated
+ */
+static void swap_handoff(worker_t *w, block_t *b)
+{
+    block_t tmp;
+    int i = next_rand(&w->seed) % NUM_HANDOFF;
+
+    pthread_mutex_lock(&handoff_lock);
+    tmp = handoff[i];
+    handoff[i] = *b;
+    pthread_mutex_unlock(&handoff_lock);
+    *b = tmp;
+}
+
+/*
+ * app_error - Report an arbitrary application error
+ */
+void app_error(char *msg)
+{
+    printf("%s\n", msg);
+    exit(1);
+}
+
+/*
+ * unix_error - Report a Unix-style error
+ */
+void unix_error(char *msg)
+{
+    perror(msg);
+    exit(1);
+}
+
+/*
+ * malloc_error - Report an error returned by the mm_malloc package
+ */
+void malloc_error(int thread, int op, char *msg)
+{
+    pthread_mutex_lock(&error_lock);
+    errors++;
+    printf("ERROR [thread %d, request %d]: %s\n", thread, op, msg);
+    pthread_mutex_unlock(&error_lock);
+}
+
+/*
+ * usage - Explain the command line arguments
+ */
+static void usage(void)
+{
+    fprintf(stderr, "Usage: mtdriver [-hv] [-t <n>] [-n <n>] [-r <n>]\n");
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "\t-n <n>     Make <n> requests per thread and round.\n");
+    fprintf(stderr, "\t-r <n>     Run <n> rounds, each after mm_init.\n");
+    fprintf(stderr, "\t-t <n>     Run <n> threads.\n");
+    fprintf(stderr, "\t-v         Print each round.\n");
+}
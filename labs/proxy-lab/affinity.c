@@ -0,0 +1,68 @@
+#ifdef __linux__
+#define _GNU_SOURCE
+#include <sched.h>
+#include <dirent.h>
+#endif
+#include "affinity.h"
+
+int ParseCpuList(const char *list, int *cpus, int max) {
+  int n = 0;
+  const char *p = list;
+  while (*p) {
+    char *end;
+    if (!isdigit(*p)) return -1;
+    long first = strtol(p, &end, 10);
+    long last = first;
+    if (*end == '-') {
+      if (!isdigit(end[1])) return -1;
+      last = strtol(end + 1, &end, 10);
+      if (last < first) return -1;
+    }
+    for (long cpu = first; cpu <= last; ++cpu) {
+      if (n == max) return -1;
+      cpus[n++] = cpu;
+    }
+    if (*end == ',') {
+      ++end;
+    } else if (*end) {
+      return -1;
+    }
+    p = end;
+  }
+  return n;
+}
+
+int PinThreadToCpu(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  return pthread_setaffinity_np(pthread_self(), sizeof(set), &set) ? -1 : 0;
+#else
+  return -1;
+#endif
+}
+
+int CpuToNode(int cpu) {
+#ifdef __linux__
+  // /sys/devices/system/cpu/cpuN/ holds a nodeM link to its NUMA node
+  char path[64];
+  snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d", cpu);
+  DIR *dir = opendir(path);
+  if (!dir) {
+    return 0;
+  }
+  int node = 0;
+  struct dirent *entry;
+  while ((entry = readdir(dir))) {
+    if (!strncmp(entry->d_name, "node", 4) && isdigit(entry->d_name[4])) {
+      node = atoi(entry->d_name + 4);
+      break;
+    }
+  }
+  closedir(dir);
+  return node;
+#else
+  return 0;
+#endif
+}
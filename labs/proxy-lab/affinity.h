@@ -0,0 +1,23 @@
+#ifndef __AFFINITY_H__
+#define __AFFINITY_H__
+#include "xnix_helper.h"
+
+// CPU and NUMA placement of worker threads. Pinning is only supported on
+// Linux, elsewhere the functions report failure and workers float.
+
+// Parse a CPU list such as "0-3,8,10-11"
+// 1. Input:
+//  <1> list
+//  <2> cpus : receives the CPU ids in order
+//  <3> max : capacity of cpus
+// 2. Output:
+//  <1> ret : number of CPUs, -1 if the list is malformed or too long
+int ParseCpuList(const char *list, int *cpus, int max);
+
+// Pin the calling thread to one CPU
+// return 0 on success, -1 otherwise
+int PinThreadToCpu(int cpu);
+
+// NUMA node of a CPU as reported by sysfs, 0 if unknown
+int CpuToNode(int cpu);
+#endif
@@ -0,0 +1,165 @@
+#include "breaker.h"
+
+typedef struct Breaker {
+  char *origin;               // "host:port"
+  int failures;               // consecutive
+  long cooldown;              // ms the breaker opens for
+  long open_until;            // NowMs() before which requests fail
+  int probing;                // a probe was let through
+  long last_failure;          // NowMs() of the last failure
+  size_t bucket;
+  struct Breaker *next;       // hash bucket chain
+  struct Breaker *older;      // list by last failure, oldest first
+  struct Breaker *newer;
+} Breaker;
+
+static Breaker *buckets[BREAKER_BUCKETS];
+static Breaker *oldest = NULL;
+static Breaker *newest = NULL;
+static int nbreakers = 0;
+static pthread_mutex_t breakers_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void list_unlink(Breaker *breaker);
+static void list_push(Breaker *breaker);
+static void remove_breaker(Breaker **pp);
+static void remove_oldest(void);
+
+// FNV-1a of "host:port"
+static size_t hash_origin(const char *host, const char *port) {
+  uint32_t h = 2166136261u;
+  for (const char *p = host; *p; ++p) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  h = (h ^ ':') * 16777619u;
+  for (const char *p = port; *p; ++p) {
+    h = (h ^ (unsigned char)*p) * 16777619u;
+  }
+  return h % BREAKER_BUCKETS;
+}
+
+// Find the breaker of an origin, called with breakers_lock held
+static Breaker **find_breaker(const char *host, const char *port) {
+  size_t host_size = strlen(host);
+  Breaker **pp = &buckets[hash_origin(host, port)];
+  while (*pp) {
+    const char *origin = (*pp)->origin;
+    if (!strncmp(origin, host, host_size) && origin[host_size] == ':' &&
+        !strcmp(origin + host_size + 1, port)) {
+      break;
+    }
+    pp = &(*pp)->next;
+  }
+  return pp;
+}
+
+int BreakerAllow(const char *host, const char *port) {
+  pthread_mutex_lock(&breakers_lock);
+  Breaker *breaker = *find_breaker(host, port);
+  int allowed = 1;
+  if (breaker && breaker->failures >= BREAKER_THRESHOLD) {
+    long now = NowMs();
+    if (now < breaker->open_until) {
+      allowed = 0;
+    } else {
+      // this request is the probe, the others wait for its outcome or for
+      // another cooldown if it never reports
+      breaker->open_until = now + breaker->cooldown;
+      breaker->probing = 1;
+      LogInfo("Breaker: probe %s\n", breaker->origin);
+    }
+  }
+  pthread_mutex_unlock(&breakers_lock);
+  return allowed;
+}
+
+void BreakerSuccess(const char *host, const char *port) {
+  pthread_mutex_lock(&breakers_lock);
+  Breaker **pp = find_breaker(host, port);
+  if (*pp) {
+    if ((*pp)->failures >= BREAKER_THRESHOLD) {
+      LogInfo("Breaker: %s recovered\n", (*pp)->origin);
+    }
+    remove_breaker(pp);
+  }
+  pthread_mutex_unlock(&breakers_lock);
+}
+
+void BreakerFailure(const char *host, const char *port) {
+  pthread_mutex_lock(&breakers_lock);
+  long now = NowMs();
+  // forget the origins that stopped failing long ago
+  while (oldest && now - oldest->last_failure > BREAKER_FORGET) {
+    remove_oldest();
+  }
+  Breaker **pp = find_breaker(host, port);
+  Breaker *breaker = *pp;
+  if (breaker) {
+    list_unlink(breaker);
+  } else {
+    if (nbreakers >= BREAKER_MAX_ORIGINS) {
+      remove_oldest();
+      pp = find_breaker(host, port);  // the chain may have changed
+    }
+    breaker = *pp = Calloc(1, sizeof(Breaker));
+    breaker->origin = Malloc(strlen(host) + strlen(port) + 2);
+    sprintf(breaker->origin, "%s:%s", host, port);
+    breaker->cooldown = BREAKER_COOLDOWN;
+    breaker->bucket = hash_origin(host, port);
+    ++nbreakers;
+  }
+  breaker->last_failure = now;
+  list_push(breaker);
+  // requests sent before the breaker opened do not extend the cooldown
+  int open = ++breaker->failures == BREAKER_THRESHOLD;
+  if (breaker->probing) {
+    breaker->probing = 0;
+    breaker->cooldown *= 2;
+    if (breaker->cooldown > BREAKER_MAX_COOLDOWN) {
+      breaker->cooldown = BREAKER_MAX_COOLDOWN;
+    }
+    open = 1;
+  }
+  if (open) {
+    breaker->open_until = now + breaker->cooldown;
+    LogWarn("Breaker: %s open for %ld ms after %d failures\n",
+            breaker->origin, breaker->cooldown, breaker->failures);
+  }
+  pthread_mutex_unlock(&breakers_lock);
+}
+
+static void list_unlink(Breaker *breaker) {
+  if (breaker->older) breaker->older->newer = breaker->newer;
+  else oldest = breaker->newer;
+  if (breaker->newer) breaker->newer->older = breaker->older;
+  else newest = breaker->older;
+  breaker->older = breaker->newer = NULL;
+}
+
+static void list_push(Breaker *breaker) {
+  breaker->newer = NULL;
+  breaker->older = newest;
+  if (newest) newest->newer = breaker;
+  else oldest = breaker;
+  newest = breaker;
+}
+
+// Unlink the breaker *pp of its bucket chain and free it, called with
+// breakers_lock held
+static void remove_breaker(Breaker **pp) {
+  Breaker *breaker = *pp;
+  *pp = breaker->next;
+  list_unlink(breaker);
+  --nbreakers;
+  Free(breaker->origin);
+  Free(breaker);
+}
+
+// Forget the origin that failed the longest ago, called with breakers_lock
+// held
+static void remove_oldest(void) {
+  Breaker **pp = &buckets[oldest->bucket];
+  while (*pp != oldest) {
+    pp = &(*pp)->next;
+  }
+  remove_breaker(pp);
+}
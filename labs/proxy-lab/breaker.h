@@ -0,0 +1,37 @@
+#ifndef __BREAKER_H__
+#define __BREAKER_H__
+#include "xnix_helper.h"
+
+// Per-origin circuit breaker, safe to share between threads
+// Consecutive failures of an origin (name resolution, connect, no response
+// header in time) are counted. After BREAKER_THRESHOLD of them the breaker
+// of the origin opens: its requests fail at once for a cooldown, then one
+// request is let through as a probe. A probe that gets a response closes
+// the breaker, a failed one opens it again for twice the cooldown. Only
+// origins that failed since their last success are tracked. Browsers name
+// the origins, so the table is bounded: an origin is forgotten once it has
+// not failed for BREAKER_FORGET, or when BREAKER_MAX_ORIGINS newer ones
+// failed since.
+#define BREAKER_THRESHOLD 5         // consecutive failures opening a breaker
+#define BREAKER_COOLDOWN 5000       // ms of the first cooldown
+#define BREAKER_MAX_COOLDOWN 60000  // ms
+#define BREAKER_FORGET (2 * BREAKER_MAX_COOLDOWN) // ms
+#define BREAKER_MAX_ORIGINS 4096
+#define BREAKER_BUCKETS 256
+
+// Whether a request may be sent to an origin. Past the cooldown of an open
+// breaker, the request allowed is the probe and the next one waits for
+// another cooldown.
+// 1. Input:
+//  <1> host
+//  <2> port
+// 2. Output:
+//  <1> ret : 1 if allowed, 0 if the request must fail at once
+int BreakerAllow(const char *host, const char *port);
+
+// Report that an origin answered, its breaker is closed
+void BreakerSuccess(const char *host, const char *port);
+
+// Report that a request to an origin got no response
+void BreakerFailure(const char *host, const char *port);
+#endif
@@ -0,0 +1,209 @@
+#include "cache.h"
+
+static uint32_t fnv1a(const char *key);
+static size_t hash_key(const char *key);
+static void lru_unlink(Cache *cache, CacheObject *obj);
+static void lru_push_front(Cache *cache, CacheObject *obj);
+static void remove_object(Cache *cache, CacheObject *obj);
+static void free_object(CacheObject *obj);
+static int insert_object(Cache *cache, const char *key, const char *data,
+                         size_t size, size_t header_size, time_t expires,
+                         const CacheObject *base);
+
+void CacheInit(Cache *cache, size_t max_size, size_t max_object_size) {
+  cache->buckets = Calloc(CACHE_BUCKETS, sizeof(CacheObject *));
+  cache->head = NULL;
+  cache->tail = NULL;
+  cache->total_size = 0;
+  cache->max_size = max_size;
+  cache->max_object_size =
+    max_object_size < max_size ? max_object_size : max_size;
+  memset(cache->uncacheable, 0, sizeof(cache->uncacheable));
+  pthread_mutex_init(&cache->lock, NULL);
+}
+
+void CacheFree(Cache *cache) {
+  while (cache->head) {
+    remove_object(cache, cache->head);
+  }
+  Free(cache->buckets);
+  cache->buckets = NULL;
+  pthread_mutex_destroy(&cache->lock);
+}
+
+void MakeCacheKey(char *key, size_t n, const char *host, const char *port,
+                  const char *path) {
+  snprintf(key, n, "%s:%s %s", host, port, path);
+}
+
+CacheObject *CacheLookup(Cache *cache, const char *key) {
+  pthread_mutex_lock(&cache->lock);
+  CacheObject *obj = cache->buckets[hash_key(key)];
+  while (obj && strcmp(obj->key, key)) {
+    obj = obj->hnext;
+  }
+  if (obj && obj->expires <= time(NULL)) {
+    LogDebug("Cache: drop stale %s\n", key);
+    remove_object(cache, obj);
+    obj = NULL;
+  }
+  if (obj) {
+    lru_unlink(cache, obj);
+    lru_push_front(cache, obj);
+    ++obj->refcnt;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return obj;
+}
+
+void CacheRelease(Cache *cache, CacheObject *obj) {
+  pthread_mutex_lock(&cache->lock);
+  int last = --obj->refcnt == 0 && obj->evicted;
+  pthread_mutex_unlock(&cache->lock);
+  if (last) {
+    free_object(obj);
+  }
+}
+
+int CacheInsert(Cache *cache, const char *key, const char *data, size_t size,
+                size_t header_size, time_t expires) {
+  return insert_object(cache, key, data, size, header_size, expires, NULL);
+}
+
+int CacheInsertDerived(Cache *cache, const char *key, const char *data,
+                       size_t size, size_t header_size,
+                       const CacheObject *base) {
+  return insert_object(cache, key, data, size, header_size, base->expires,
+                       base);
+}
+
+// Store a copy of a response, unless base is given and no longer cached
+static int insert_object(Cache *cache, const char *key, const char *data,
+                         size_t size, size_t header_size, time_t expires,
+                         const CacheObject *base) {
+  if (size > cache->max_object_size) {
+    return 0;
+  }
+
+  // copy outside the lock, readers are not blocked by large objects
+  CacheObject *obj = Malloc(sizeof(CacheObject));
+  size_t key_size = strlen(key) + 1;
+  memcpy(obj->key = Malloc(key_size), key, key_size);
+  memcpy(obj->data = Malloc(size), data, size);
+  obj->size = size;
+  obj->header_size = header_size;
+  obj->expires = expires;
+  obj->refcnt = 0;
+  obj->evicted = 0;
+
+  pthread_mutex_lock(&cache->lock);
+  // base is unlinked under this lock when it is replaced or evicted
+  if (base && base->evicted) {
+    pthread_mutex_unlock(&cache->lock);
+    free_object(obj);
+    return 0;
+  }
+  // replace the stale copy if any
+  CacheObject *old = cache->buckets[hash_key(key)];
+  while (old && strcmp(old->key, key)) {
+    old = old->hnext;
+  }
+  if (old) {
+    remove_object(cache, old);
+  }
+
+  while (cache->tail && cache->total_size + size > cache->max_size) {
+    LogDebug("Cache: evict %s\n", cache->tail->key);
+    remove_object(cache, cache->tail);
+  }
+
+  size_t index = hash_key(key);
+  obj->hnext = cache->buckets[index];
+  cache->buckets[index] = obj;
+  lru_push_front(cache, obj);
+  cache->total_size += size;
+  uint32_t h = fnv1a(key) | 1;
+  if (cache->uncacheable[h % UNCACHEABLE_SLOTS] == h) {
+    cache->uncacheable[h % UNCACHEABLE_SLOTS] = 0;
+  }
+  pthread_mutex_unlock(&cache->lock);
+  return 1;
+}
+
+void CacheRemove(Cache *cache, const char *key) {
+  pthread_mutex_lock(&cache->lock);
+  CacheObject *obj = cache->buckets[hash_key(key)];
+  while (obj && strcmp(obj->key, key)) {
+    obj = obj->hnext;
+  }
+  if (obj) {
+    remove_object(cache, obj);
+  }
+  pthread_mutex_unlock(&cache->lock);
+}
+
+void CacheMarkUncacheable(Cache *cache, const char *key) {
+  uint32_t h = fnv1a(key) | 1; // 0 marks an empty slot
+  pthread_mutex_lock(&cache->lock);
+  cache->uncacheable[h % UNCACHEABLE_SLOTS] = h;
+  pthread_mutex_unlock(&cache->lock);
+}
+
+int CacheIsUncacheable(Cache *cache, const char *key) {
+  uint32_t h = fnv1a(key) | 1;
+  pthread_mutex_lock(&cache->lock);
+  int marked = cache->uncacheable[h % UNCACHEABLE_SLOTS] == h;
+  pthread_mutex_unlock(&cache->lock);
+  return marked;
+}
+
+static uint32_t fnv1a(const char *key) {
+  uint32_t h = 2166136261u;
+  while (*key) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static size_t hash_key(const char *key) {
+  return fnv1a(key) % CACHE_BUCKETS;
+}
+
+static void lru_unlink(Cache *cache, CacheObject *obj) {
+  if (obj->prev) obj->prev->next = obj->next;
+  else cache->head = obj->next;
+  if (obj->next) obj->next->prev = obj->prev;
+  else cache->tail = obj->prev;
+  obj->prev = obj->next = NULL;
+}
+
+static void lru_push_front(Cache *cache, CacheObject *obj) {
+  obj->prev = NULL;
+  obj->next = cache->head;
+  if (cache->head) cache->head->prev = obj;
+  else cache->tail = obj;
+  cache->head = obj;
+}
+
+// Unlink an object from the hash table and the LRU list. Objects still held
+// by a reader are freed by the last CacheRelease().
+static void remove_object(Cache *cache, CacheObject *obj) {
+  CacheObject **pp = &cache->buckets[hash_key(obj->key)];
+  while (*pp != obj) {
+    pp = &(*pp)->hnext;
+  }
+  *pp = obj->hnext;
+  lru_unlink(cache, obj);
+  cache->total_size -= obj->size;
+  obj->evicted = 1;
+  if (obj->refcnt == 0) {
+    free_object(obj);
+  }
+}
+
+static void free_object(CacheObject *obj) {
+  Free(obj->key);
+  Free(obj->data);
+  Free(obj);
+}
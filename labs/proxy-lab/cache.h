@@ -0,0 +1,106 @@
+#ifndef __CACHE_H__
+#define __CACHE_H__
+#include "xnix_helper.h"
+
+// Web object cache, safe to share between worker threads
+// Complete responses (status line, headers and body) are stored as one
+// contiguous block keyed by "host:port path". Eviction is LRU bounded by
+// the total number of cached bytes. An object is dropped by the first
+// lookup after it turns stale, it is fetched again rather than revalidated.
+// The keys of responses the cache could not store, e.g. too large or
+// no-store, are remembered in a small table, so a Range request for them
+// goes to the origin instead of fetching the whole object to cut it. A slot
+// keeps the last key hashed to it: a collision only forgets a key.
+#define MAX_CACHE_SIZE  (64 * (1 << 20))
+#define MAX_OBJECT_SIZE (8 * (1 << 20))
+#define CACHE_BUCKETS   1024
+#define UNCACHEABLE_SLOTS 256
+#define DEFAULT_TTL 60            // s a response without freshness
+                                  // information nor Last-Modified is fresh
+#define HEURISTIC_MAX_TTL 86400   // s of freshness from Last-Modified at most
+
+typedef struct CacheObject {
+  char *key;
+  char *data;                 // raw response bytes
+  size_t size;                // total bytes of data
+  size_t header_size;         // bytes of status line + headers + blank line
+  time_t expires;             // stale from this time on
+  int refcnt;                 // readers holding this object
+  int evicted;                // removed from the cache, free on last release
+  struct CacheObject *prev;   // LRU list, most recently used at head
+  struct CacheObject *next;
+  struct CacheObject *hnext;  // hash bucket chain
+} CacheObject;
+
+typedef struct {
+  CacheObject **buckets;
+  CacheObject *head;
+  CacheObject *tail;
+  size_t total_size;
+  size_t max_size;
+  size_t max_object_size;
+  uint32_t uncacheable[UNCACHEABLE_SLOTS]; // key hashes, 0 if empty
+  pthread_mutex_t lock;
+} Cache;
+
+// Initialize an empty cache
+// 1. Input:
+//  <1> cache
+//  <2> max_size : total bytes the cache may hold
+//  <3> max_object_size : larger responses are never cached
+void CacheInit(Cache *cache, size_t max_size, size_t max_object_size);
+
+// Free every object of the cache
+void CacheFree(Cache *cache);
+
+// Build the cache key of a request into key (at most n bytes)
+void MakeCacheKey(char *key, size_t n, const char *host, const char *port,
+                  const char *path);
+
+// Look up an object and move it to the head of the LRU list. A stale
+// object is removed instead.
+// 1. Output:
+//  <1> ret : the object with its refcnt increased, NULL on miss.
+//            The caller must hand it back with CacheRelease().
+CacheObject *CacheLookup(Cache *cache, const char *key);
+
+// Drop a reference returned by CacheLookup()
+void CacheRelease(Cache *cache, CacheObject *obj);
+
+// Copy a complete response into the cache, evicting LRU objects to make room.
+// An existing object with the same key is replaced.
+// 1. Input:
+//  <1> cache
+//  <2> key
+//  <3> data : raw response bytes
+//  <4> size : total bytes of data
+//  <5> header_size : bytes of status line + headers + blank line
+//  <6> expires : time the response turns stale, see ResponseExpires()
+// 2. Output:
+//  <1> ret : 1 if the object was stored, 0 if it is too large
+int CacheInsert(Cache *cache, const char *key, const char *data, size_t size,
+                size_t header_size, time_t expires);
+
+// CacheInsert() a response derived from base, e.g. a compressed variant,
+// only while base is still cached: a variant of a replaced or evicted
+// response is dropped. It turns stale with base.
+// 1. Input:
+//  <1> ... <5> : as CacheInsert()
+//  <6> base : an object the caller holds a reference to
+// 2. Output:
+//  <1> ret : 1 if the object was stored, 0 if it is too large or base is
+//            gone
+int CacheInsertDerived(Cache *cache, const char *key, const char *data,
+                       size_t size, size_t header_size,
+                       const CacheObject *base);
+
+// Remove the object of key if cached, readers holding it keep their copy
+void CacheRemove(Cache *cache, const char *key);
+
+// Remember that the response of key cannot be cached, until it is inserted
+void CacheMarkUncacheable(Cache *cache, const char *key);
+
+// Whether the response of key was marked as not cacheable
+int CacheIsUncacheable(Cache *cache, const char *key);
+
+#endif
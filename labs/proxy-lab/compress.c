@@ -0,0 +1,285 @@
+#include "compress.h"
+#include <zlib.h>
+
+// bytes the variant header may grow by: W/ on every ETag and the added fields
+#define VARIANT_HEADER_ROOM (3 * MAX_HEADERS + 128)
+
+typedef struct CompressJob {
+  Cache *cache;
+  CacheObject *obj;            // identity response the variant is made from,
+                               // held until the job is done
+  struct CompressJob *next;
+} CompressJob;
+
+static CompressJob *queue_head = NULL;
+static CompressJob *queue_tail = NULL;
+static int queue_size = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static int started = 0;
+
+static int IsCompressibleHeader(const HeaderBlock *block, size_t body_size);
+static int CompressObject(Cache *cache, CacheObject *obj);
+static void *CompressThread(void *vargp);
+static void Compress(const CompressJob *job);
+static void FreeJob(CompressJob *job);
+
+void CompressInit(int nthreads) {
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, CompressThread, NULL);
+  }
+  started = nthreads > 0;
+}
+
+// Whether a media type is text that compresses well
+static int IsTextType(const char *type, size_t size) {
+  static const char *types[] = {
+    "application/javascript", "application/json", "application/xml",
+    "application/xhtml+xml", "image/svg+xml", NULL
+  };
+  // parameters such as charset do not matter
+  size_t n = 0;
+  while (n < size && type[n] != ';' && !isspace(type[n])) {
+    ++n;
+  }
+  if (n >= 5 && !strncasecmp(type, "text/", 5)) {
+    return 1;
+  }
+  if ((n > 5 && !strncasecmp(type + n - 5, "+json", 5)) ||
+      (n > 4 && !strncasecmp(type + n - 4, "+xml", 4))) {
+    return 1;
+  }
+  for (const char **t = types; *t; ++t) {
+    if (strlen(*t) == n && !strncasecmp(type, *t, n)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// IsCompressible() from the parsed header of a response
+static int IsCompressibleHeader(const HeaderBlock *block, size_t body_size) {
+  if (body_size < COMPRESS_MIN_SIZE) {
+    return 0;
+  }
+  const HeaderSpan *type = FindHeaderSpan(block, "Content-Type");
+  const HeaderSpan *encoding = FindHeaderSpan(block, "Content-Encoding");
+  const HeaderSpan *cc = FindHeaderSpan(block, "Cache-Control");
+  return type && IsTextType(type->value, type->value_size) &&
+    (!encoding || (encoding->value_size == 8 &&
+                   !strncasecmp(encoding->value, "identity", 8))) &&
+    !(cc && HeaderHasToken(cc, "no-transform"));
+}
+
+int IsCompressible(const CacheObject *obj) {
+  HeaderBlock block;
+  return ParseHeaderBlock(obj->data, obj->header_size, &block) &&
+    IsCompressibleHeader(&block, obj->size - obj->header_size);
+}
+
+int NeedsEncodingVary(const HeaderBlock *block, size_t body_size) {
+  if (!started || !IsCompressibleHeader(block, body_size)) {
+    return 0;
+  }
+  const HeaderSpan *vary = FindHeaderSpan(block, "Vary");
+  return !(vary && HeaderHasToken(vary, "Accept-Encoding"));
+}
+
+int AcceptsGzip(const HeaderBlock *block) {
+  const HeaderSpan *accept = FindHeaderSpan(block, "Accept-Encoding");
+  if (!accept) {
+    return 0;
+  }
+  // q-values of gzip and of *, -1 while not listed
+  double gzip = -1, any = -1;
+  const char *p = accept->value;
+  const char *end = p + accept->value_size;
+  while (p < end) {
+    const char *item_end = memchr(p, ',', end - p);
+    if (!item_end) {
+      item_end = end;
+    }
+    while (p < item_end && isspace(*p)) {
+      ++p;
+    }
+    const char *name = p;
+    while (p < item_end && *p != ';' && !isspace(*p)) {
+      ++p;
+    }
+    size_t name_size = p - name;
+    double q = 1;
+    for (; p + 2 <= item_end; ++p) {
+      if ((*p == 'q' || *p == 'Q') && p[1] == '=') {
+        // the field is followed by its line break, strtod stops there
+        q = strtod(p + 2, NULL);
+        break;
+      }
+    }
+    if ((name_size == 4 && !strncasecmp(name, "gzip", 4)) ||
+        (name_size == 6 && !strncasecmp(name, "x-gzip", 6))) {
+      gzip = q;
+    } else if (name_size == 1 && *name == '*') {
+      any = q;
+    }
+    p = item_end + 1;
+  }
+  return gzip >= 0 ? gzip > 0 : any > 0;
+}
+
+void MakeGzipKey(char *gzip_key, size_t n, const char *key) {
+  snprintf(gzip_key, n, "%s%s", key, GZIP_KEY_SUFFIX);
+}
+
+void CompressCached(Cache *cache, const char *key) {
+  if (!started) {
+    return;
+  }
+  char *gzip_key = Malloc(strlen(key) + sizeof(GZIP_KEY_SUFFIX));
+  MakeGzipKey(gzip_key, strlen(key) + sizeof(GZIP_KEY_SUFFIX), key);
+  CacheRemove(cache, gzip_key);
+  Free(gzip_key);
+  CacheObject *obj = CacheLookup(cache, key);
+  if (obj && IsCompressible(obj)) {
+    CompressObject(cache, obj);
+  } else if (obj) {
+    CacheRelease(cache, obj);
+  }
+}
+
+// Queue a cached response to be compressed, the reference is consumed
+// return 1 if queued, 0 if the queue is full
+static int CompressObject(Cache *cache, CacheObject *obj) {
+  CompressJob *job = Malloc(sizeof(CompressJob));
+  job->cache = cache;
+  job->obj = obj;
+  job->next = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  int queued = queue_size < COMPRESS_QUEUE;
+  if (queued) {
+    if (queue_tail) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    ++queue_size;
+    pthread_cond_signal(&queue_not_empty);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  if (!queued) {
+    LogDebug("Compress: queue full, skip %s\n", obj->key);
+    FreeJob(job);
+  }
+  return queued;
+}
+
+static void *CompressThread(void *vargp) {
+  pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) {
+      pthread_cond_wait(&queue_not_empty, &queue_lock);
+    }
+    CompressJob *job = queue_head;
+    if (!(queue_head = job->next)) {
+      queue_tail = NULL;
+    }
+    --queue_size;
+    pthread_mutex_unlock(&queue_lock);
+
+    Compress(job);
+    FreeJob(job);
+  }
+  return NULL;
+}
+
+static void FreeJob(CompressJob *job) {
+  CacheRelease(job->cache, job->obj);
+  Free(job);
+}
+
+// Write the header of the gzip variant: the fields of the identity response
+// but its Content-Length, a weak ETag since the bytes differ, and the
+// encoding, length and Vary of the variant
+// return bytes written, at most obj->header_size + VARIANT_HEADER_ROOM
+static size_t BuildVariantHeader(const HeaderBlock *block, size_t body_size,
+                                 char *header) {
+  size_t size = 0;
+  memcpy(header, block->start_line, block->start_line_size);
+  size += block->start_line_size;
+  header[size++] = '\r';
+  header[size++] = '\n';
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *span = &block->headers[i];
+    if (span->name_size == 14 && !strncasecmp(span->line, "Content-Length", 14)) {
+      continue;
+    }
+    if (span->name_size == 4 && !strncasecmp(span->line, "ETag", 4) &&
+        span->value_size >= 2 && strncmp(span->value, "W/", 2)) {
+      size += sprintf(header + size, "ETag: W/%.*s\r\n", (int)span->value_size,
+                      span->value);
+      continue;
+    }
+    memcpy(header + size, span->line, span->line_size);
+    size += span->line_size;
+  }
+  size += sprintf(header + size, "Content-Encoding: gzip\r\n"
+                  "Content-Length: %zu\r\nVary: Accept-Encoding\r\n\r\n",
+                  body_size);
+  return size;
+}
+
+// Gzip a cached response and cache the variant, unless it does not shrink
+// by an eighth at least
+static void Compress(const CompressJob *job) {
+  const CacheObject *obj = job->obj;
+  HeaderBlock block;
+  if (!ParseHeaderBlock(obj->data, obj->header_size, &block)) {
+    return;
+  }
+  const char *body = obj->data + obj->header_size;
+  size_t body_size = obj->size - obj->header_size;
+
+  z_stream stream;
+  memset(&stream, 0, sizeof(stream));
+  // window bits + 16: gzip framing instead of zlib's
+  if (deflateInit2(&stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    LogWarn("Compress: deflateInit2 failed\n");
+    return;
+  }
+  // the body is compressed behind room for the header, so the variant is
+  // one contiguous block
+  size_t room = obj->header_size + VARIANT_HEADER_ROOM;
+  size_t bound = deflateBound(&stream, body_size);
+  char *buf = Malloc(room + bound);
+  stream.next_in = (Bytef *)body;
+  stream.avail_in = body_size;
+  stream.next_out = (Bytef *)buf + room;
+  stream.avail_out = bound;
+  int done = deflate(&stream, Z_FINISH) == Z_STREAM_END;
+  size_t zsize = stream.total_out;
+  deflateEnd(&stream);
+
+  if (done && zsize < body_size - body_size / 8) {
+    char *header = Malloc(room);
+    size_t header_size = BuildVariantHeader(&block, zsize, header);
+    char *variant = buf + room - header_size;
+    memcpy(variant, header, header_size);
+    Free(header);
+    char *gzip_key = Malloc(strlen(obj->key) + sizeof(GZIP_KEY_SUFFIX));
+    MakeGzipKey(gzip_key, strlen(obj->key) + sizeof(GZIP_KEY_SUFFIX), obj->key);
+    // the identity response may have been replaced while it was compressed,
+    // its variant must not outlive it
+    if (CacheInsertDerived(job->cache, gzip_key, variant, header_size + zsize,
+                           header_size, obj)) {
+      LogDebug("Compress: %s %zu -> %zu bytes\n", obj->key, body_size, zsize);
+    } else {
+      LogDebug("Compress: %s replaced or too large, variant dropped\n",
+               obj->key);
+    }
+    Free(gzip_key);
+  } else {
+    LogDebug("Compress: %s does not shrink\n", obj->key);
+  }
+  Free(buf);
+}
@@ -0,0 +1,49 @@
+#ifndef __COMPRESS_H__
+#define __COMPRESS_H__
+#include "header.h"
+
+// Response compression
+// A cached response of a compressible type that the origin sent without a
+// Content-Encoding is gzipped once in the background, by the compression
+// threads and never by a worker, and cached next to it under its gzip key.
+// A browser accepting gzip is answered from that variant when it is there,
+// from the identity response otherwise. Both answers carry Vary:
+// Accept-Encoding. Variants are not written to the
+// object log, they are made again from the logged identity response.
+#define COMPRESS_QUEUE 64         // responses waiting to be compressed
+#define COMPRESS_MIN_SIZE 256     // smaller bodies are sent as they are
+#define GZIP_KEY_SUFFIX " gzip"   // a path has no spaces, no identity key
+                                  // ends with it
+
+// Start the compression threads
+// 1. Input:
+//  <1> nthreads : responses compressed concurrently, 0 = no compression
+void CompressInit(int nthreads);
+
+// Whether a cached response is worth compressing: a text-like Content-Type,
+// no Content-Encoding, no Cache-Control: no-transform, a large enough body
+int IsCompressible(const CacheObject *obj);
+
+// Whether the identity answer of a response must carry Vary:
+// Accept-Encoding: compression is on and the response is worth compressing,
+// so the same URL is answered gzipped to a browser accepting gzip, and the
+// origin did not name Accept-Encoding in a Vary field itself
+// 1. Input:
+//  <1> block : the parsed response header
+//  <2> body_size : bytes of its body, from Content-Length while it streams
+int NeedsEncodingVary(const HeaderBlock *block, size_t body_size);
+
+// Whether a browser request accepts a gzip response, from its
+// Accept-Encoding field and the q-values in it
+int AcceptsGzip(const HeaderBlock *block);
+
+// Build the cache key of the gzip variant of the response cached under key
+void MakeGzipKey(char *gzip_key, size_t n, const char *key);
+
+// A response was just cached under key: drop the variant of the response
+// it replaces, and queue it to be compressed if it is worth it
+// 1. Input:
+//  <1> cache : the cache shard holding it, the variant goes there
+//  <2> key
+void CompressCached(Cache *cache, const char *key);
+#endif
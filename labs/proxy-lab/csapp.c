@@ -650,28 +650,46 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n)
 
 /* 
  * rio_readlineb - robustly read a text line (buffered)
+ *    The newline is found with memchr() over the unread bytes of the
+ *    internal buffer and the line is copied with one memcpy() per
+ *    refill, instead of calling rio_read() for every byte.
  */
 /* $begin rio_readlineb */
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) 
 {
-    int n, rc;
-    char c, *bufp = usrbuf;
-
-    for (n = 1; n < maxlen; n++) { 
-	if ((rc = rio_read(rp, &c, 1)) == 1) {
-	    *bufp++ = c;
-	    if (c == '\n')
-		break;
-	} else if (rc == 0) {
-	    if (n == 1)
-		return 0; /* EOF, no data read */
-	    else
-		break;    /* EOF, some data was read */
-	} else
-	    return -1;	  /* error */
+    size_t n = 0, cnt;
+    char *bufp = usrbuf, *newline = NULL;
+
+    if (maxlen == 0)
+	return 0;
+    while (n + 1 < maxlen && !newline) { 
+	while (rp->rio_cnt <= 0) {  /* refill if buf is empty */
+	    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, 
+			       sizeof(rp->rio_buf));
+	    if (rp->rio_cnt < 0) {
+		if (errno != EINTR) /* interrupted by sig handler return */
+		    return -1;      /* error */
+	    }
+	    else if (rp->rio_cnt == 0)  /* EOF */
+		goto done;
+	    else 
+		rp->rio_bufptr = rp->rio_buf; /* reset buffer ptr */
+	}
+
+	/* Copy up to and including the newline, at most maxlen-1 bytes */
+	cnt = maxlen - 1 - n;
+	if (rp->rio_cnt < cnt)
+	    cnt = rp->rio_cnt;
+	if ((newline = memchr(rp->rio_bufptr, '\n', cnt)) != NULL)
+	    cnt = newline - rp->rio_bufptr + 1;
+	memcpy(bufp + n, rp->rio_bufptr, cnt);
+	rp->rio_bufptr += cnt;
+	rp->rio_cnt -= cnt;
+	n += cnt;
     }
-    *bufp = 0;
-    return n;
+ done:
+    bufp[n] = 0;
+    return n;   /* 0 on EOF with no data read */
 }
 /* $end rio_readlineb */
 
@@ -0,0 +1,292 @@
+#include "header.h"
+#include <stdarg.h>
+
+// RFC 7230 6.1, plus Proxy-Connection sent by old browsers
+static const char *hop_by_hop[] = {
+  "Connection", "Keep-Alive", "Proxy-Connection", "Proxy-Authenticate",
+  "Proxy-Authorization", "TE", "Trailer", "Transfer-Encoding", "Upgrade", NULL
+};
+
+// End-to-end request fields forwarded to the origin, a name ending with '-'
+// is a prefix. Any other field is dropped, the hop-by-hop ones among them.
+static const char *forwarded_fields[] = {
+  "Accept", "Accept-Charset", "Accept-Encoding", "Accept-Language",
+  "Authorization", "Cache-Control", "Cookie", "DNT", "Forwarded", "From",
+  "Host", "If-Match", "If-Modified-Since", "If-None-Match", "If-Range",
+  "If-Unmodified-Since", "Max-Forwards", "Origin", "Pragma", "Range",
+  "Referer", "Upgrade-Insecure-Requests", "User-Agent", "Via", "Sec-", "X-",
+  NULL
+};
+
+static const char close_line[] = "Connection: close\r\n\r\n";
+static const char keep_alive_line[] = "Connection: keep-alive\r\n\r\n";
+static const char vary_encoding_line[] = "Vary: Accept-Encoding\r\n";
+
+static pthread_once_t via_once = PTHREAD_ONCE_INIT;
+static char via_lines[2][300];  // by the minor version a message came in
+
+static void init_via(void) {
+  char host[256];
+  if (gethostname(host, sizeof(host)) < 0) {
+    strcpy(host, "proxy");
+  }
+  host[sizeof(host) - 1] = '\0';
+  for (int minor = 0; minor < 2; ++minor) {
+    snprintf(via_lines[minor], sizeof(via_lines[minor]), "Via: 1.%d %s\r\n",
+             minor, host);
+  }
+}
+
+// HTTP minor version of a message: the status line starts with it, the
+// request line ends with it
+static int block_minor(const HeaderBlock *block) {
+  const char *line = block->start_line;
+  size_t size = block->start_line_size;
+  const char *version = size >= 8 && !strncmp(line, "HTTP/1.", 7) ? line :
+    size >= 8 && !strncmp(line + size - 8, "HTTP/1.", 7) ? line + size - 8 :
+    NULL;
+  return version && version[7] == '0' ? 0 : 1;
+}
+
+const char *ViaLine(const HeaderBlock *block) {
+  pthread_once(&via_once, init_via);
+  return via_lines[block_minor(block)];
+}
+
+static int name_is(const HeaderSpan *header, const char *name, size_t name_size) {
+  return header->name_size == name_size &&
+    !strncasecmp(header->line, name, name_size);
+}
+
+// Whether a comma separated list has the token, case-insensitive
+static int list_has_token(const char *list, size_t size, const char *token,
+                          size_t token_size) {
+  const char *p = list, *end = list + size;
+  while (p < end) {
+    const char *item_end = memchr(p, ',', end - p);
+    if (!item_end) {
+      item_end = end;
+    }
+    const char *item = p;
+    while (item < item_end && (*item == ' ' || *item == '\t')) ++item;
+    const char *e = item_end;
+    while (e > item && (e[-1] == ' ' || e[-1] == '\t')) --e;
+    if (e - item == token_size && !strncasecmp(item, token, token_size)) {
+      return 1;
+    }
+    p = item_end + 1;
+  }
+  return 0;
+}
+
+int ParseHeaderBlock(const char *buf, size_t size, HeaderBlock *block) {
+  const char *p = buf, *end = buf + size;
+  const char *line_end = memchr(p, '\n', end - p);
+  if (!line_end) {
+    return 0;
+  }
+  block->start_line = p;
+  block->start_line_size = line_end - p - (line_end > p && line_end[-1] == '\r');
+  block->nheaders = 0;
+  p = line_end + 1;
+  while (1) {
+    if (!(line_end = memchr(p, '\n', end - p))) {
+      return 0;
+    }
+    const char *content_end = line_end - (line_end > p && line_end[-1] == '\r');
+    if (content_end == p) { // empty line, end of header
+      block->size = line_end + 1 - buf;
+      return 1;
+    }
+    if (block->nheaders == MAX_HEADERS) {
+      return 0;
+    }
+    // obsolete line folding is rejected as RFC 7230 3.2.4 allows
+    const char *colon = memchr(p, ':', content_end - p);
+    if (!colon || colon == p || *p == ' ' || *p == '\t') {
+      return 0;
+    }
+    HeaderSpan *header = &block->headers[block->nheaders++];
+    header->line = p;
+    header->line_size = line_end + 1 - p;
+    header->name_size = colon - p;
+    const char *value = colon + 1;
+    while (value < content_end && (*value == ' ' || *value == '\t')) ++value;
+    while (content_end > value &&
+           (content_end[-1] == ' ' || content_end[-1] == '\t')) --content_end;
+    header->value = value;
+    header->value_size = content_end - value;
+    p = line_end + 1;
+  }
+}
+
+const HeaderSpan *FindHeaderSpan(const HeaderBlock *block, const char *name) {
+  size_t name_size = strlen(name);
+  for (int i = 0; i < block->nheaders; ++i) {
+    if (name_is(&block->headers[i], name, name_size)) {
+      return &block->headers[i];
+    }
+  }
+  return NULL;
+}
+
+int HeaderHasToken(const HeaderSpan *header, const char *token) {
+  return list_has_token(header->value, header->value_size, token, strlen(token));
+}
+
+int IsHopByHop(const HeaderBlock *block, const HeaderSpan *header) {
+  for (const char **name = hop_by_hop; *name; ++name) {
+    if (name_is(header, *name, strlen(*name))) {
+      return 1;
+    }
+  }
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *connection = &block->headers[i];
+    if (name_is(connection, "Connection", 10) &&
+        list_has_token(connection->value, connection->value_size,
+                       header->line, header->name_size)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Whether a request field is on the forwarded allow-list
+static int is_forwarded(const HeaderSpan *header) {
+  for (const char **name = forwarded_fields; *name; ++name) {
+    size_t name_size = strlen(*name);
+    if ((*name)[name_size - 1] == '-' ?
+        header->name_size > name_size &&
+        !strncasecmp(header->line, *name, name_size) :
+        name_is(header, *name, name_size)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+// Format text at scratch + size, scratch holding MAXLINE bytes
+// return the new size, MAXLINE or more if the text does not fit
+static size_t add_text(char *scratch, size_t size, const char *format, ...) {
+  if (size >= MAXLINE) {
+    return size;
+  }
+  va_list ap;
+  va_start(ap, format);
+  size += vsnprintf(scratch + size, MAXLINE - size, format, ap);
+  va_end(ap);
+  return size;
+}
+
+// Append a span, merged with the previous segment if it ends where the span
+// starts
+static int add_span(struct iovec *iov, int n, const char *base, size_t size,
+                    int mergeable) {
+  if (mergeable && n &&
+      (const char *)iov[n - 1].iov_base + iov[n - 1].iov_len == base) {
+    iov[n - 1].iov_len += size;
+    return n;
+  }
+  iov[n].iov_base = (void *)base;
+  iov[n].iov_len = size;
+  return n + 1;
+}
+
+int BuildUpstreamRequest(const HeaderBlock *block, int minor,
+                         const char *client_addr, int drop_range,
+                         struct iovec *iov, char *scratch) {
+  // request line: method SP request-target SP HTTP-version
+  const char *line = block->start_line;
+  const char *line_end = line + block->start_line_size;
+  const char *target = memchr(line, ' ', line_end - line);
+  if (!target) {
+    return 0;
+  }
+  ++target;
+  const char *target_end = memchr(target, ' ', line_end - target);
+  if (!target_end) {
+    return 0;
+  }
+  int n = add_span(iov, 0, line, target - line, 0);
+  if (target_end - target > 7 && !strncasecmp(target, "http://", 7)) {
+    target = memchr(target + 7, '/', target_end - target - 7);
+    if (!target) { // "http://host" asks for the root
+      target = "/";
+      target_end = target + 1;
+    }
+  }
+  n = add_span(iov, n, target, target_end - target, 0);
+  const char *version = minor ? " HTTP/1.1\r\n" : " HTTP/1.0\r\n";
+  n = add_span(iov, n, version, strlen(version), 0);
+
+  int merge = 0; // only kept header lines are merged
+  const HeaderSpan *forwarded_for = NULL; // first X-Forwarded-For with a value
+  size_t size = 0;
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *header = &block->headers[i];
+    if (name_is(header, "X-Forwarded-For", 15)) {
+      // the browser address is appended to the addresses of the list, the
+      // values of later lines are copied after the first one
+      if (!forwarded_for && header->value_size) {
+        forwarded_for = header;
+      } else if (header->value_size) {
+        size = add_text(scratch, size, ", %.*s", (int)header->value_size,
+                        header->value);
+      }
+      merge = 0;
+      continue;
+    }
+    if (!is_forwarded(header) || IsHopByHop(block, header) ||
+        (drop_range && (name_is(header, "Range", 5) ||
+                        name_is(header, "If-Range", 8)))) {
+      merge = 0;
+      continue;
+    }
+    n = add_span(iov, n, header->line, header->line_size, merge);
+    merge = 1;
+  }
+
+  // the first list is sent from the request, the copied values and the
+  // browser address follow it
+  if (forwarded_for) {
+    n = add_span(iov, n, forwarded_for->line, forwarded_for->value +
+                 forwarded_for->value_size - forwarded_for->line, 0);
+    size = add_text(scratch, size, ", %s\r\n", client_addr);
+  } else {
+    size = add_text(scratch, size, "X-Forwarded-For: %s\r\n", client_addr);
+  }
+  // origin connections are not pooled: the response ends when the origin
+  // closes at the latest
+  size = add_text(scratch, size, "%s%s", ViaLine(block), close_line);
+  if (size >= MAXLINE) {
+    return 0;
+  }
+  return add_span(iov, n, scratch, size, 0);
+}
+
+int BuildClientHeader(const HeaderBlock *block, int keep_alive,
+                      int vary_encoding, struct iovec *iov) {
+  const char *status_end = block->start_line + block->start_line_size;
+  status_end += *status_end == '\r' ? 2 : 1;
+  int n = add_span(iov, 0, block->start_line, status_end - block->start_line, 0);
+  int merge = 1;
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *header = &block->headers[i];
+    // a chunked body is relayed as it is received, so is its framing
+    if (IsHopByHop(block, header) &&
+        !name_is(header, "Transfer-Encoding", 17) &&
+        !name_is(header, "Trailer", 7)) {
+      merge = 0;
+      continue;
+    }
+    n = add_span(iov, n, header->line, header->line_size, merge);
+    merge = 1;
+  }
+  if (vary_encoding) {
+    n = add_span(iov, n, vary_encoding_line, sizeof(vary_encoding_line) - 1, 0);
+  }
+  const char *via = ViaLine(block);
+  n = add_span(iov, n, via, strlen(via), 0);
+  const char *connection = keep_alive ? keep_alive_line : close_line;
+  return add_span(iov, n, connection, strlen(connection), 0);
+}
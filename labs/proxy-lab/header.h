@@ -0,0 +1,85 @@
+#ifndef __HEADER_H__
+#define __HEADER_H__
+#include "proxy.h"
+
+// HTTP header rewriting on parsed spans
+// A header block is parsed into spans pointing into the received bytes.
+// The rewritten request or response header is a list of iovec segments:
+// the kept lines are sent from where they were received, only the lines
+// the proxy adds are new, and the segments are sent with one gather-write.
+#define MAX_HEADER_IOV (MAX_HEADERS + 6)
+
+typedef struct {
+  const char *line;         // start of the header line
+  size_t line_size;         // bytes of the line including its line break
+  size_t name_size;         // the name is line[0, name_size)
+  const char *value;        // value without surrounding whitespace
+  size_t value_size;
+} HeaderSpan;
+
+typedef struct {
+  const char *start_line;   // request line or status line
+  size_t start_line_size;   // without its line break
+  HeaderSpan headers[MAX_HEADERS];
+  int nheaders;
+  size_t size;              // bytes of the block including the empty line
+} HeaderBlock;
+
+// Parse the header block at the start of buf
+// 1. Input:
+//  <1> buf
+//  <2> size : bytes of buf
+//  <3> block : receives spans pointing into buf
+// 2. Output:
+//  <1> ret : 1 on success, 0 if the block is incomplete, has more than
+//            MAX_HEADERS fields or a malformed line
+int ParseHeaderBlock(const char *buf, size_t size, HeaderBlock *block);
+
+// return the first field named name, NULL if none
+const HeaderSpan *FindHeaderSpan(const HeaderBlock *block, const char *name);
+
+// Whether a field only concerns the current connection: the fixed
+// hop-by-hop fields and the fields listed in Connection
+int IsHopByHop(const HeaderBlock *block, const HeaderSpan *header);
+
+// Whether the field of header has the token, e.g. "close" in Connection
+int HeaderHasToken(const HeaderSpan *header, const char *token);
+
+// Rewrite a browser request into the request sent to the origin:
+//  - absolute-form target becomes origin-form, the version is HTTP/1.minor
+//  - only the end-to-end fields of an allow-list are kept, less the fields
+//    named in Connection, and less Range/If-Range if drop_range
+//  - the browser address is appended to X-Forwarded-For and Via is added
+//  - Connection: close is sent, origin connections are not pooled, so the
+//    response ends when the origin closes it at the latest
+// 1. Input:
+//  <1> block : the parsed browser request
+//  <2> minor : HTTP minor version of the upstream request, 0 or 1
+//  <3> client_addr : address of the browser
+//  <4> drop_range
+//  <5> scratch : MAXLINE bytes for the added fields
+// 2. Output:
+//  <1> iov : at most MAX_HEADER_IOV segments
+//  <2> ret : number of segments, 0 if the request line is malformed or the
+//      added fields do not fit in scratch
+int BuildUpstreamRequest(const HeaderBlock *block, int minor,
+                         const char *client_addr, int drop_range,
+                         struct iovec *iov, char *scratch);
+
+// Rewrite an origin response header for the browser: hop-by-hop fields are
+// dropped except the framing of a relayed chunked body, and Via and
+// Connection are added
+// 1. Input:
+//  <1> block : the parsed response header
+//  <2> keep_alive : whether the browser connection is reused
+//  <3> vary_encoding : whether Vary: Accept-Encoding is added
+// 2. Output:
+//  <1> iov : at most MAX_HEADER_IOV segments
+//  <2> ret : number of segments
+int BuildClientHeader(const HeaderBlock *block, int keep_alive,
+                      int vary_encoding, struct iovec *iov);
+
+// return the Via field the proxy adds to the message of block, with its line
+// break. It names the version the message was received in, RFC 7230 5.7.1.
+const char *ViaLine(const HeaderBlock *block);
+#endif
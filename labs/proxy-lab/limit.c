@@ -0,0 +1,109 @@
+#include "limit.h"
+
+void LimiterInit(Limiter *limiter, size_t max) {
+  limiter->used = 0;
+  limiter->max = max;
+  pthread_mutex_init(&limiter->lock, NULL);
+  // timed waits are measured on the clock of NowMs()
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&limiter->released, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+void LimiterDeinit(Limiter *limiter) {
+  pthread_mutex_destroy(&limiter->lock);
+  pthread_cond_destroy(&limiter->released);
+}
+
+int LimiterTryAcquire(Limiter *limiter, size_t n) {
+  int ret = 0;
+  pthread_mutex_lock(&limiter->lock);
+  if (!limiter->max || limiter->used + n <= limiter->max) {
+    limiter->used += n;
+    ret = 1;
+  }
+  pthread_mutex_unlock(&limiter->lock);
+  return ret;
+}
+
+int LimiterAcquire(Limiter *limiter, size_t n, long timeout) {
+  struct timespec deadline;
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += timeout / 1000;
+  deadline.tv_nsec += timeout % 1000 * 1000000;
+  if (deadline.tv_nsec >= 1000000000) {
+    ++deadline.tv_sec;
+    deadline.tv_nsec -= 1000000000;
+  }
+  int ret = 1;
+  pthread_mutex_lock(&limiter->lock);
+  while (limiter->max && limiter->used + n > limiter->max) {
+    if (pthread_cond_timedwait(&limiter->released, &limiter->lock,
+                               &deadline) == ETIMEDOUT) {
+      ret = 0;
+      break;
+    }
+  }
+  if (ret) {
+    limiter->used += n;
+  }
+  pthread_mutex_unlock(&limiter->lock);
+  return ret;
+}
+
+void LimiterRelease(Limiter *limiter, size_t n) {
+  pthread_mutex_lock(&limiter->lock);
+  limiter->used -= n;
+  pthread_cond_broadcast(&limiter->released);
+  pthread_mutex_unlock(&limiter->lock);
+}
+
+void TokenBucketInit(TokenBucket *bucket, size_t rate, size_t burst) {
+  bucket->rate = rate;
+  bucket->burst = burst;
+  bucket->tokens = burst;
+  bucket->last_ms = NowMs();
+  pthread_mutex_init(&bucket->lock, NULL);
+}
+
+void TokenBucketDeinit(TokenBucket *bucket) {
+  pthread_mutex_destroy(&bucket->lock);
+}
+
+// called with the lock held
+static void refill(TokenBucket *bucket) {
+  long now = NowMs();
+  bucket->tokens += (now - bucket->last_ms) * bucket->rate / 1000;
+  if (bucket->tokens > bucket->burst) {
+    bucket->tokens = bucket->burst;
+  }
+  bucket->last_ms = now;
+}
+
+size_t TokenBucketTake(TokenBucket *bucket, size_t n) {
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  if (bucket->tokens < n) {
+    n = bucket->tokens;
+  }
+  bucket->tokens -= n;
+  pthread_mutex_unlock(&bucket->lock);
+  return n;
+}
+
+void TokenBucketGive(TokenBucket *bucket, size_t n) {
+  pthread_mutex_lock(&bucket->lock);
+  bucket->tokens += n;
+  pthread_mutex_unlock(&bucket->lock);
+}
+
+long TokenBucketWait(TokenBucket *bucket) {
+  pthread_mutex_lock(&bucket->lock);
+  refill(bucket);
+  long wait = bucket->tokens >= 1 ? 0 :
+    (long)((1 - bucket->tokens) * 1000 / bucket->rate) + 1;
+  pthread_mutex_unlock(&bucket->lock);
+  return wait;
+}
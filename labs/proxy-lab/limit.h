@@ -0,0 +1,51 @@
+#ifndef __LIMIT_H__
+#define __LIMIT_H__
+#include "xnix_helper.h"
+
+// Counting limiter for a shared resource (connections, origin requests,
+// buffered bytes). A limiter with max = 0 is unlimited.
+typedef struct {
+  size_t used;
+  size_t max;
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+} Limiter;
+
+void LimiterInit(Limiter *limiter, size_t max);
+void LimiterDeinit(Limiter *limiter);
+
+// Take n units if they are available
+// return 1 on success, 0 if the limit would be exceeded
+int LimiterTryAcquire(Limiter *limiter, size_t n);
+
+// Take n units, block until they are released by other threads, for at
+// most timeout ms
+// return 1 on success, 0 if the units were not released in time
+int LimiterAcquire(Limiter *limiter, size_t n, long timeout);
+
+// Give back n units
+void LimiterRelease(Limiter *limiter, size_t n);
+
+// Token bucket refilled at rate tokens (bytes) per second, holding at most
+// burst tokens. Used to limit the bandwidth of a client.
+typedef struct {
+  double tokens;
+  double rate;
+  double burst;
+  long last_ms;         // time of the last refill, NowMs()
+  pthread_mutex_t lock;
+} TokenBucket;
+
+void TokenBucketInit(TokenBucket *bucket, size_t rate, size_t burst);
+void TokenBucketDeinit(TokenBucket *bucket);
+
+// Take up to n tokens
+// return the number of tokens taken, 0 if the bucket is empty
+size_t TokenBucketTake(TokenBucket *bucket, size_t n);
+
+// Give back n unused tokens of TokenBucketTake()
+void TokenBucketGive(TokenBucket *bucket, size_t n);
+
+// return ms until at least one token is available
+long TokenBucketWait(TokenBucket *bucket);
+#endif
@@ -0,0 +1,499 @@
+#include "objlog.h"
+#include <stddef.h>
+
+#define LOG_FILE_MAGIC 0x474f4c43u    // "CLOG"
+#define LOG_VERSION 2
+#define LOG_RECORD_MAGIC 0x4a424f43u  // "COBJ"
+#define MAX_LOG_KEY 65536             // longer keys mean a corrupt record
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} LogFileHeader;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t checksum;          // CRC-32 of the fields below, the key and data
+  uint32_t key_size;
+  uint32_t header_size;
+  uint64_t size;
+  int64_t expires;            // the object is stale from this time on
+} LogRecord;
+
+typedef struct LogJob {
+  Cache *cache;
+  CacheObject *obj;           // held until it is written
+  struct LogJob *next;
+} LogJob;
+
+static uint32_t crc_table[256];
+static pthread_once_t crc_once = PTHREAD_ONCE_INIT;
+
+static void init_crc_table(void) {
+  for (uint32_t i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (int k = 0; k < 8; ++k) {
+      c = c & 1 ? 0xedb88320u ^ (c >> 1) : c >> 1;
+    }
+    crc_table[i] = c;
+  }
+}
+
+static uint32_t crc32_update(uint32_t crc, const void *buf, size_t size) {
+  const unsigned char *p = buf;
+  crc = ~crc;
+  while (size--) {
+    crc = crc_table[(crc ^ *p++) & 0xff] ^ (crc >> 8);
+  }
+  return ~crc;
+}
+
+static uint32_t record_checksum(const LogRecord *record, const char *key,
+                                const char *data) {
+  uint32_t crc = crc32_update(0, &record->key_size,
+                              sizeof(LogRecord) - offsetof(LogRecord, key_size));
+  crc = crc32_update(crc, key, record->key_size);
+  return crc32_update(crc, data, record->size);
+}
+
+static size_t record_size(const LogRecord *record) {
+  size_t size = sizeof(LogRecord) + record->key_size + record->size;
+  return (size + 7) & ~(size_t)7;
+}
+
+// FNV-1a over a key of size bytes
+static uint32_t hash_key(const char *key, size_t size) {
+  uint32_t h = 2166136261u;
+  while (size--) {
+    h ^= (unsigned char)*key++;
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// Map the file with room for appends up to MAX_LOG_SIZE, so appended
+// records are seen through the same mapping. Only the bytes written are
+// ever read.
+static int remap(ObjLog *log) {
+  if (log->map) {
+    munmap(log->map, log->map_size);
+    log->map = NULL;
+  }
+  size_t map_size = log->size > MAX_LOG_SIZE ? log->size : MAX_LOG_SIZE;
+  char *map = mmap(NULL, map_size, PROT_READ, MAP_SHARED, log->fd, 0);
+  if (map == MAP_FAILED) {
+    perror("ObjLog: mmap");
+    return -1;
+  }
+  log->map = map;
+  log->map_size = map_size;
+  return 0;
+}
+
+static const LogRecord *entry_record(const ObjLog *log, const LogEntry *entry) {
+  return (const LogRecord *)(log->map + entry->offset);
+}
+
+static LogEntry **find_entry(ObjLog *log, const char *key, size_t key_size,
+                             uint32_t hash) {
+  LogEntry **pp = &log->buckets[hash % LOG_BUCKETS];
+  while (*pp) {
+    const LogRecord *record = entry_record(log, *pp);
+    if ((*pp)->hash == hash && record->key_size == key_size &&
+        !memcmp(record + 1, key, key_size)) {
+      break;
+    }
+    pp = &(*pp)->next;
+  }
+  return pp;
+}
+
+// Index the record at offset, replacing the entry of the same key
+static void index_record(ObjLog *log, uint64_t offset, int verified) {
+  const LogRecord *record = (const LogRecord *)(log->map + offset);
+  const char *key = (const char *)(record + 1);
+  uint32_t hash = hash_key(key, record->key_size);
+  LogEntry **pp = find_entry(log, key, record->key_size, hash);
+  LogEntry *entry = *pp;
+  if (entry) {
+    log->dead_size += record_size(entry_record(log, entry));
+  } else {
+    entry = *pp = Malloc(sizeof(LogEntry));
+    entry->next = NULL;
+    entry->hash = hash;
+    ++log->nentries;
+  }
+  entry->offset = offset;
+  entry->verified = verified;
+}
+
+// Walk the record headers, stopping at the first one that does not fit in
+// the file: everything from there is a torn append
+// return bytes of valid records
+static size_t scan_records(ObjLog *log, size_t file_size) {
+  size_t offset = sizeof(LogFileHeader);
+  while (offset + sizeof(LogRecord) <= file_size) {
+    const LogRecord *record = (const LogRecord *)(log->map + offset);
+    if (record->magic != LOG_RECORD_MAGIC || record->key_size > MAX_LOG_KEY ||
+        record->header_size > record->size ||
+        record->size > MAX_OBJECT_SIZE ||
+        record_size(record) > file_size - offset) {
+      break;
+    }
+    index_record(log, offset, 0);
+    offset += record_size(record);
+  }
+  return offset;
+}
+
+// Forget the records of objects that turned stale, they are dead bytes
+// for the next compaction
+static void drop_expired(ObjLog *log) {
+  time_t now = time(NULL);
+  for (int i = 0; i < LOG_BUCKETS; ++i) {
+    LogEntry **pp = &log->buckets[i];
+    while (*pp) {
+      LogEntry *entry = *pp;
+      const LogRecord *record = entry_record(log, entry);
+      if (record->expires > now) {
+        pp = &entry->next;
+        continue;
+      }
+      log->dead_size += record_size(record);
+      *pp = entry->next;
+      Free(entry);
+      --log->nentries;
+    }
+  }
+}
+
+static void free_index(ObjLog *log) {
+  for (int i = 0; i < LOG_BUCKETS; ++i) {
+    LogEntry *entry = log->buckets[i];
+    while (entry) {
+      LogEntry *next = entry->next;
+      Free(entry);
+      entry = next;
+    }
+    log->buckets[i] = NULL;
+  }
+  log->nentries = 0;
+  log->dead_size = 0;
+}
+
+static int compare_offset(const void *a, const void *b) {
+  uint64_t x = (*(LogEntry * const *)a)->offset;
+  uint64_t y = (*(LogEntry * const *)b)->offset;
+  return x < y ? -1 : x > y;
+}
+
+// Rewrite the latest record of every key into a new file renamed over the
+// log, in log order. Corrupt records are dropped on the way.
+// return 0 on success, -1 if the log is left as it was
+static int compact(ObjLog *log, const char *path) {
+  char *tmp = Malloc(strlen(path) + 5);
+  sprintf(tmp, "%s.tmp", path);
+  int fd = open(tmp, O_RDWR | O_CREAT | O_TRUNC, 0600);
+  if (fd < 0) {
+    perror("ObjLog: compact");
+    Free(tmp);
+    return -1;
+  }
+  LogEntry **entries = Malloc((log->nentries + 1) * sizeof(LogEntry *));
+  size_t n = 0;
+  for (int i = 0; i < LOG_BUCKETS; ++i) {
+    for (LogEntry *entry = log->buckets[i]; entry; entry = entry->next) {
+      entries[n++] = entry;
+    }
+  }
+  qsort(entries, n, sizeof(LogEntry *), compare_offset);
+
+  LogFileHeader file_header = {LOG_FILE_MAGIC, LOG_VERSION};
+  int ok = rio_writen(fd, &file_header, sizeof(file_header)) ==
+    sizeof(file_header);
+  for (size_t i = 0; ok && i < n; ++i) {
+    const LogRecord *record = entry_record(log, entries[i]);
+    const char *key = (const char *)(record + 1);
+    if (record_checksum(record, key, key + record->key_size) !=
+        record->checksum) {
+      continue;
+    }
+    ok = rio_writen(fd, (void *)record, record_size(record)) ==
+      (ssize_t)record_size(record);
+  }
+  Free(entries);
+  // the records must be on disk before the name points at them
+  if (!ok || fsync(fd) < 0 || rename(tmp, path) < 0) {
+    perror("ObjLog: compact");
+    close(fd);
+    unlink(tmp);
+    Free(tmp);
+    return -1;
+  }
+  Free(tmp);
+
+  free_index(log);
+  close(log->fd);
+  log->fd = fd;
+  log->size = lseek(fd, 0, SEEK_END);
+  if (remap(log) < 0) {
+    return -1;
+  }
+  scan_records(log, log->size);
+  // every record was just verified
+  for (int i = 0; i < LOG_BUCKETS; ++i) {
+    for (LogEntry *entry = log->buckets[i]; entry; entry = entry->next) {
+      entry->verified = 1;
+    }
+  }
+  return 0;
+}
+
+static void destroy(ObjLog *log) {
+  ObjLogClose(log);
+  pthread_mutex_destroy(&log->lock);
+  pthread_cond_destroy(&log->queued);
+  pthread_cond_destroy(&log->unpinned);
+  Free(log->buckets);
+  Free(log);
+}
+
+// Drop a pin taken under the lock, called with the lock held
+static void unpin(ObjLog *log) {
+  if (--log->pins == 0) {
+    pthread_cond_broadcast(&log->unpinned);
+  }
+}
+
+// Append the record of a cached object. The writer is the only appender,
+// so the end of the log stays where it was while the lock is dropped.
+// return 1 if appended, 0 if the log is full or closed
+static int write_record(ObjLog *log, const CacheObject *obj) {
+  LogRecord record = {LOG_RECORD_MAGIC, 0, strlen(obj->key), obj->header_size,
+                      obj->size, obj->expires};
+  record.checksum = record_checksum(&record, obj->key, obj->data);
+  static const char padding[8];
+  struct iovec iov[4] = {
+    {&record, sizeof(record)},
+    {obj->key, record.key_size},
+    {obj->data, obj->size},
+    {(void *)padding, record_size(&record) - sizeof(record) -
+      record.key_size - obj->size}
+  };
+  size_t total = 0;
+  for (int i = 0; i < 4; ++i) {
+    total += iov[i].iov_len;
+  }
+
+  pthread_mutex_lock(&log->lock);
+  uint64_t offset = log->size;
+  int ok = !log->closing && offset + total <= MAX_LOG_SIZE;
+  if (ok) {
+    ++log->pins;
+  }
+  pthread_mutex_unlock(&log->lock);
+  if (!ok) {
+    return 0;
+  }
+  ok = pwritev(log->fd, iov, 4, offset) == (ssize_t)total;
+  pthread_mutex_lock(&log->lock);
+  if (ok) {
+    index_record(log, offset, 1);
+    log->size = offset + total;
+  }
+  unpin(log);
+  pthread_mutex_unlock(&log->lock);
+  return ok;
+}
+
+static void *writer_thread(void *vargp) {
+  ObjLog *log = vargp;
+  pthread_mutex_lock(&log->lock);
+  while (1) {
+    while (!log->queue_head && !log->closing) {
+      pthread_cond_wait(&log->queued, &log->lock);
+    }
+    if (log->closing) {
+      break;
+    }
+    LogJob *job = log->queue_head;
+    if (!(log->queue_head = job->next)) {
+      log->queue_tail = NULL;
+    }
+    --log->queue_size;
+    pthread_mutex_unlock(&log->lock);
+
+    if (!write_record(log, job->obj)) {
+      LogDebug("ObjLog: %s not appended\n", job->obj->key);
+    }
+    CacheRelease(job->cache, job->obj);
+    Free(job);
+    pthread_mutex_lock(&log->lock);
+  }
+  pthread_mutex_unlock(&log->lock);
+  return NULL;
+}
+
+ObjLog *ObjLogOpen(const char *path) {
+  pthread_once(&crc_once, init_crc_table);
+  int fd = open(path, O_RDWR | O_CREAT, 0600);
+  if (fd < 0) {
+    perror("ObjLogOpen: open");
+    return NULL;
+  }
+  ObjLog *log = Calloc(1, sizeof(ObjLog));
+  log->fd = fd;
+  log->buckets = Calloc(LOG_BUCKETS, sizeof(LogEntry *));
+  pthread_mutex_init(&log->lock, NULL);
+  pthread_cond_init(&log->queued, NULL);
+  pthread_cond_init(&log->unpinned, NULL);
+
+  off_t file_size = lseek(fd, 0, SEEK_END);
+  LogFileHeader file_header = {LOG_FILE_MAGIC, LOG_VERSION};
+  log->size = file_size;
+  if (file_size >= (off_t)sizeof(LogFileHeader) && remap(log) == 0 &&
+      !memcmp(log->map, &file_header, sizeof(file_header))) {
+    log->size = scan_records(log, file_size);
+    drop_expired(log);
+  } else {
+    // new file, or another format: start over
+    free_index(log);
+    if (ftruncate(fd, 0) < 0 ||
+        pwrite(fd, &file_header, sizeof(file_header), 0) !=
+        sizeof(file_header)) {
+      perror("ObjLogOpen: write");
+      destroy(log);
+      return NULL;
+    }
+    log->size = sizeof(file_header);
+  }
+  if (log->size < (size_t)file_size) {
+    LogWarn("ObjLogOpen: cut torn tail of %zu bytes\n",
+             (size_t)file_size - log->size);
+    if (ftruncate(fd, log->size) < 0) {
+      perror("ObjLogOpen: ftruncate");
+    }
+  }
+  if (log->dead_size > log->size / 2) {
+    compact(log, path);
+  }
+  if (!log->map && remap(log) < 0) {
+    destroy(log);
+    return NULL;
+  }
+  pthread_create(&log->writer, NULL, writer_thread, log);
+  log->writer_started = 1;
+  LogInfo("ObjLogOpen: %zu object(s), %zu bytes\n", log->nentries, log->size);
+  return log;
+}
+
+void ObjLogClose(ObjLog *log) {
+  pthread_mutex_lock(&log->lock);
+  if (log->closing) {
+    pthread_mutex_unlock(&log->lock);
+    return;
+  }
+  log->closing = 1;
+  pthread_cond_broadcast(&log->queued);
+  pthread_mutex_unlock(&log->lock);
+  // the record being written is finished, the next proxy appends after it
+  if (log->writer_started) {
+    pthread_join(log->writer, NULL);
+  }
+
+  pthread_mutex_lock(&log->lock);
+  while (log->pins) {
+    pthread_cond_wait(&log->unpinned, &log->lock);
+  }
+  LogJob *job = log->queue_head;
+  log->queue_head = log->queue_tail = NULL;
+  log->queue_size = 0;
+  free_index(log);
+  if (log->map) {
+    munmap(log->map, log->map_size);
+    log->map = NULL;
+  }
+  if (log->fd >= 0) {
+    close(log->fd);
+    log->fd = -1;
+  }
+  pthread_mutex_unlock(&log->lock);
+  while (job) {
+    LogJob *next = job->next;
+    CacheRelease(job->cache, job->obj);
+    Free(job);
+    job = next;
+  }
+  // the log may still be used by a worker that has not seen it closed
+}
+
+int ObjLogAppend(ObjLog *log, Cache *cache, CacheObject *obj) {
+  LogJob *job = Malloc(sizeof(LogJob));
+  job->cache = cache;
+  job->obj = obj;
+  job->next = NULL;
+
+  pthread_mutex_lock(&log->lock);
+  int queued = !log->closing && log->queue_size < LOG_QUEUE;
+  if (queued) {
+    if (log->queue_tail) log->queue_tail->next = job;
+    else log->queue_head = job;
+    log->queue_tail = job;
+    ++log->queue_size;
+    pthread_cond_signal(&log->queued);
+  }
+  pthread_mutex_unlock(&log->lock);
+  if (!queued) {
+    LogDebug("ObjLog: queue full or closed, skip %s\n", obj->key);
+    CacheRelease(cache, obj);
+    Free(job);
+  }
+  return queued;
+}
+
+CacheObject *ObjLogLoad(ObjLog *log, Cache *cache, const char *key) {
+  size_t key_size = strlen(key);
+  uint32_t hash = hash_key(key, key_size);
+  pthread_mutex_lock(&log->lock);
+  LogEntry *entry = log->nentries && !log->closing ?
+    *find_entry(log, key, key_size, hash) : NULL;
+  if (!entry) {
+    pthread_mutex_unlock(&log->lock);
+    return NULL;
+  }
+  uint64_t offset = entry->offset;
+  int verified = entry->verified;
+  ++log->pins;
+  pthread_mutex_unlock(&log->lock);
+
+  // the pin keeps the mapping, a record is never written again
+  const LogRecord *record = (const LogRecord *)(log->map + offset);
+  const char *data = (const char *)(record + 1) + record->key_size;
+  int fresh = record->expires > time(NULL);
+  int ok = fresh &&
+    (verified || record_checksum(record, key, data) == record->checksum);
+  int loaded = ok &&
+    CacheInsert(cache, key, data, record->size, record->header_size,
+                record->expires);
+
+  pthread_mutex_lock(&log->lock);
+  // an append may have replaced the record meanwhile
+  LogEntry **pp = find_entry(log, key, key_size, hash);
+  if (*pp && (*pp)->offset == offset) {
+    if (ok) {
+      (*pp)->verified = 1;
+    } else {
+      if (fresh) {
+        LogWarn("ObjLogLoad: corrupt record of %s skipped\n", key);
+      }
+      log->dead_size += record_size(record);
+      entry = *pp;
+      *pp = entry->next;
+      Free(entry);
+      --log->nentries;
+    }
+  }
+  unpin(log);
+  pthread_mutex_unlock(&log->lock);
+  return loaded ? CacheLookup(cache, key) : NULL;
+}
@@ -0,0 +1,82 @@
+#ifndef __OBJLOG_H__
+#define __OBJLOG_H__
+#include "cache.h"
+
+// Persistent object log behind the in-memory cache
+// Every object inserted into the cache is appended to a log file, so a
+// restarted proxy finds the objects of the previous one. Appends are
+// written by a thread of the log, never by a worker. The log is memory
+// mapped. At open only the record headers and keys are read to build the
+// index, an object body is paged in and its checksum verified the first
+// time the object is asked for, and the object is then copied into the
+// cache. A record torn by a crash fails its checksum and is skipped.
+// Checksums and copies run outside the lock of the log: a record is never
+// rewritten, and the mapping is only dropped once no load or append holds
+// a pin on it.
+//
+// File layout: a LogFileHeader, then records of a LogRecord, the key, the
+// response bytes and padding to 8 bytes.
+#define LOG_BUCKETS 4096
+#define LOG_QUEUE 64              // objects waiting to be appended
+#define MAX_LOG_SIZE (4 * (size_t)MAX_CACHE_SIZE)  // appends stop beyond
+
+typedef struct LogEntry {
+  uint64_t offset;            // of the LogRecord in the file
+  uint32_t hash;
+  int verified;               // checksum checked once
+  struct LogEntry *next;      // hash bucket chain
+} LogEntry;
+
+typedef struct ObjLog {
+  int fd;
+  char *map;                  // read-only mapping of the file
+  size_t map_size;
+  size_t size;                // bytes of valid records, appends go there
+  size_t dead_size;           // bytes of superseded or corrupt records
+  size_t nentries;
+  LogEntry **buckets;
+  int pins;                   // loads and appends using the file unlocked
+  int closing;                // ObjLogClose() was called
+  struct LogJob *queue_head;  // objects waiting for the writer
+  struct LogJob *queue_tail;
+  int queue_size;
+  int writer_started;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;      // a job was queued or the log is closing
+  pthread_cond_t unpinned;    // pins dropped to 0
+} ObjLog;
+
+// Open or create a log and index its records. A torn tail is cut off,
+// stale objects are forgotten, and a log mostly made of superseded or stale
+// records is compacted first.
+// 1. Input:
+//  <1> path
+// 2. Output:
+//  <1> ret : the log, NULL if the file cannot be used
+ObjLog *ObjLogOpen(const char *path);
+
+// Stop appending and free the log, the file stays for the next proxy.
+// Waits for the append being written, queued ones are dropped.
+void ObjLogClose(ObjLog *log);
+
+// Queue a cached object to be appended by the writer, its record replaces
+// an older one of the same key
+// 1. Input:
+//  <1> log
+//  <2> cache : the cache holding obj
+//  <3> obj : a reference from CacheLookup(), consumed
+// 2. Output:
+//  <1> ret : 1 if queued, 0 if the queue is full or the log closed
+int ObjLogAppend(ObjLog *log, Cache *cache, CacheObject *obj);
+
+// Copy the logged object of key into a cache
+// 1. Input:
+//  <1> log
+//  <2> cache : receives the object
+//  <3> key
+// 2. Output:
+//  <1> ret : the object as returned by CacheLookup(), NULL if it is not
+//            logged, stale or its record is corrupt
+CacheObject *ObjLogLoad(ObjLog *log, Cache *cache, const char *key);
+#endif
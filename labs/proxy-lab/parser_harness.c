@@ -0,0 +1,665 @@
+// Tests, throughput benchmarks and fuzz entry point of the request parser
+// and the response framing code, run on in-memory buffers without sockets.
+// Usage:
+//   ./parser_harness [megabytes]    unit tests, then every benchmark over
+//                                   megabytes of input (default 64, 0 = none)
+//   ./parser_harness fuzz [files]   replay files through the fuzz entry
+//                                   point, or mutated seeds if none given
+// Built with -DPARSER_FUZZ and -fsanitize=fuzzer (make parser_fuzz), the
+// entry point is driven by libFuzzer instead.
+#define main proxy_main   // the proxy's own main() is not used
+#include "proxy.c"
+#undef main
+
+#define FUZZ_ROUNDS 200000
+
+static int failures = 0;
+
+#define CHECK(cond) do { \
+    if (!(cond)) { \
+      fprintf(stderr, "%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #cond); \
+      ++failures; \
+    } \
+  } while (0)
+
+static const char bench_request[] =
+  "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n"
+  "Host: www.cmu.edu\r\n"
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n"
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n"
+  "Accept-Language: en-US,en;q=0.5\r\n"
+  "Accept-Encoding: gzip, deflate\r\n"
+  "Cookie: session=8f3a9c0d2b7e4f61a5d8; theme=dark; tz=America/New_York\r\n"
+  "Connection: keep-alive\r\n"
+  "\r\n";
+
+static const char bench_response[] =
+  "HTTP/1.1 200 OK\r\n"
+  "Date: Mon, 19 Oct 2026 03:00:33 GMT\r\n"
+  "Server: Apache/2.4.41 (Ubuntu)\r\n"
+  "Last-Modified: Wed, 14 Oct 2026 18:22:05 GMT\r\n"
+  "ETag: \"2c39-5b1e8f3a7c1c0\"\r\n"
+  "Accept-Ranges: bytes\r\n"
+  "Cache-Control: max-age=3600\r\n"
+  "Vary: Accept-Encoding\r\n"
+  "Content-Type: text/html; charset=UTF-8\r\n"
+  "Content-Length: 0\r\n"
+  "\r\n";
+
+/*
+ * Unit tests
+ */
+
+typedef struct {
+  const char *request;
+  int ok;
+  const char *host, *port, *path, *range;
+  int status;               // error_status when not ok
+} RequestCase;
+
+static const RequestCase request_cases[] = {
+  {"GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\nHost: www.cmu.edu\r\n\r\n",
+   1, "www.cmu.edu", "80", "http://www.cmu.edu/hub/index.html", NULL, 0},
+  {"GET / HTTP/1.0\r\nHost: localhost:8000\r\nRange: bytes=0-99\r\n\r\n",
+   1, "localhost", "8000", "/", "bytes=0-99", 0},
+  {"GET /a HTTP/1.1\r\nX-Host: evil\r\nhost:example.com\r\n\r\n",
+   1, "example.com", "80", "/a", NULL, 0},
+  {"POST / HTTP/1.1\r\nHost: a\r\n\r\n", 0, NULL, NULL, NULL, NULL, 501},
+  {"POST /GET HTTP/1.1\r\nHost: a\r\n\r\n", 0, NULL, NULL, NULL, NULL, 501},
+  {"GET / HTTP/1.1\r\n\r\n", 0, NULL, NULL, NULL, NULL, 400},
+  {"GET / HTTP/1.1\r\nHost: a:\r\n\r\n", 0, NULL, NULL, NULL, NULL, 400},
+  {"GET / HTTP/1.1\r\nHost: :80\r\n\r\n", 0, NULL, NULL, NULL, NULL, 400},
+  {"GET HTTP/1.1\r\nHost: a\r\n\r\n", 0, NULL, NULL, NULL, NULL, 400},
+  {"GET  / HTTP/1.1\r\nHost: a\r\n\r\n", 0, NULL, NULL, NULL, NULL, 400},
+};
+
+static int StrEq(const char *a, const char *b) {
+  return a && b ? !strcmp(a, b) : a == b;
+}
+
+static void TestRequestParser(void) {
+  size_t n = sizeof(request_cases) / sizeof(request_cases[0]);
+  for (size_t i = 0; i < n; ++i) {
+    const RequestCase *c = &request_cases[i];
+    HTTPRequest request;
+    InitHTTPRequest(&request);
+    int ok = HTTPRequestParser(c->request, &request);
+    CHECK(ok == c->ok);
+    if (ok && c->ok) {
+      CHECK(StrEq(request.host, c->host));
+      CHECK(StrEq(request.port, c->port));
+      CHECK(StrEq(request.path, c->path));
+      CHECK(StrEq(request.range, c->range));
+    } else if (!ok) {
+      CHECK(request.error_status == c->status);
+    }
+    FreeHTTPRequest(&request);
+  }
+}
+
+static void TestHeaderBlock(void) {
+  HeaderBlock block;
+  const char *request = "GET / HTTP/1.1\r\nHost: a\r\nAccept:  */* \r\n"
+    "Connection: close\r\n\r\nbody";
+  CHECK(ParseHeaderBlock(request, strlen(request), &block));
+  CHECK(block.nheaders == 3);
+  CHECK(block.size == strlen(request) - 4);
+  const HeaderSpan *accept = FindHeaderSpan(&block, "accept");
+  CHECK(accept && accept->value_size == 3 && !strncmp(accept->value, "*/*", 3));
+  CHECK(!ParseHeaderBlock(request, 20, &block));          // incomplete
+  const char *folded = "GET / HTTP/1.1\r\nA: b\r\n c\r\n\r\n";
+  CHECK(!ParseHeaderBlock(folded, strlen(folded), &block));
+
+  char many[MAX_HEADERS * 8 + 64];
+  size_t size = sprintf(many, "GET / HTTP/1.1\r\n");
+  for (int i = 0; i <= MAX_HEADERS; ++i) {
+    size += sprintf(many + size, "H%d: x\r\n", i);
+  }
+  size += sprintf(many + size, "\r\n");
+  CHECK(!ParseHeaderBlock(many, size, &block));
+}
+
+static void TestUpstreamRequest(void) {
+  const char *request = "GET http://a/x HTTP/1.1\r\nHost: a\r\n"
+    "Proxy-Connection: keep-alive\r\nConnection: X-Hop\r\nX-Hop: 1\r\n"
+    "X-Forwarded-For: 10.0.0.1\r\nCookie: c=1\r\nUnknown: z\r\n"
+    "X-Forwarded-For: 10.0.0.2\r\nX-App: 2\r\nRange: bytes=0-1\r\n\r\n";
+  HeaderBlock block;
+  CHECK(ParseHeaderBlock(request, strlen(request), &block));
+  struct iovec iov[MAX_HEADER_IOV];
+  char scratch[MAXLINE], built[MAXLINE], expected[MAXLINE];
+  int n = BuildUpstreamRequest(&block, 0, "10.0.0.3", 1, iov, scratch);
+  size_t size = 0;
+  for (int i = 0; i < n; ++i) {
+    memcpy(built + size, iov[i].iov_base, iov[i].iov_len);
+    size += iov[i].iov_len;
+  }
+  built[size] = '\0';
+  snprintf(expected, MAXLINE, "GET /x HTTP/1.0\r\nHost: a\r\nCookie: c=1\r\n"
+           "X-App: 2\r\nX-Forwarded-For: 10.0.0.1, 10.0.0.2, 10.0.0.3\r\n"
+           "%sConnection: close\r\n\r\n", ViaLine(&block));
+  CHECK(!strcmp(built, expected));
+  CHECK(!strncmp(ViaLine(&block), "Via: 1.1 ", 9));
+
+  // the Via of a message names the version it was received in
+  const char *request10 = "GET / HTTP/1.0\r\nHost: a\r\n\r\n";
+  CHECK(ParseHeaderBlock(request10, strlen(request10), &block));
+  CHECK(!strncmp(ViaLine(&block), "Via: 1.0 ", 9));
+  const char *response10 = "HTTP/1.0 200 OK\r\nContent-Length: 0\r\n\r\n";
+  CHECK(ParseHeaderBlock(response10, strlen(response10), &block));
+  CHECK(!strncmp(ViaLine(&block), "Via: 1.0 ", 9));
+}
+
+// Feed a response piece bytes at a time
+// return the last FeedHostResponse() result
+static int FeedInPieces(HTTPResponse *response, const char *data, size_t size,
+                        size_t piece) {
+  int ret = 1;
+  for (size_t off = 0; off < size && ret > 0; off += piece) {
+    size_t n = size - off < piece ? size - off : piece;
+    ret = FeedHostResponse(response, data + off, n);
+  }
+  return ret;
+}
+
+static void FreeResponse(HTTPResponse *response) {
+  if (response->buf) {
+    BufferFree(response->buf, response->buffer_size);
+  }
+  FreeHTTPREsponse(response);
+}
+
+typedef struct {
+  const char *response;
+  int ret;                  // of the last feed
+  ResponseState state;      // state reached when ret is 1
+  int status_code;
+} ResponseCase;
+
+static const ResponseCase response_cases[] = {
+  {"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n\r\nhello", 1, RESPONSE_DONE, 200},
+  {"HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n", 1, RESPONSE_DONE, 404},
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+   "5;ext=1\r\nhello\r\nA\r\n0123456789\r\n0\r\nX-Trailer: a\r\n\r\n",
+   1, RESPONSE_DONE, 200},
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n5\r\nhello\r\n0\r\n",
+   1, CHUNKED_TRANS, 200},
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nfffffff\r\nab",
+   1, CHUNKED_TRANS, 200},
+  {"HTTP/1.1 200 OK\r\nContent-Length: 10\r\n\r\nhello", 1, KNOW_CONTENT_LENGTH,
+   200},
+  {"HTTP/1.1 200 OK\r\nContent-Length: 5\r\n", 1, WAIT_FOR_HEADER, 0},
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\nzz\r\n", -1, 0, 0},
+  {"HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+   "10000000000000000\r\n", -1, 0, 0},
+  {"HTTP/1.1 200 OK\r\nServer: x\r\n\r\nbody", -1, 0, 0},
+};
+
+static void TestResponseFraming(void) {
+  size_t n = sizeof(response_cases) / sizeof(response_cases[0]);
+  for (size_t i = 0; i < n; ++i) {
+    const ResponseCase *c = &response_cases[i];
+    size_t size = strlen(c->response);
+    // every way of receiving it must give the same result
+    for (size_t piece = 1; piece <= size; ++piece) {
+      HTTPResponse response;
+      InitHTTPResponse(&response);
+      int ret = FeedInPieces(&response, c->response, size, piece);
+      CHECK(ret == c->ret);
+      if (ret == 1) {
+        CHECK(response.state == c->state);
+        CHECK(response.rec_size == size);
+        CHECK(response.status_code == c->status_code);
+      } else {
+        CHECK(response.error_status == 502);
+      }
+      FreeResponse(&response);
+    }
+  }
+
+  // the framing fields of a complete response
+  const char *data = response_cases[0].response;
+  HTTPResponse response;
+  InitHTTPResponse(&response);
+  CHECK(FeedHostResponse(&response, data, strlen(data)) == 1);
+  CHECK(response.header_size == strlen(data) - 5);
+  CHECK(response.total_size == strlen(data));
+  CHECK(IsCompleteResponse(&response, response.rec_size));
+  FreeResponse(&response);
+}
+
+typedef struct {
+  const char *fields;       // response fields after the status line
+  int credentials;          // the request had Authorization or Cookie
+  int storable;
+} StorableCase;
+
+static const StorableCase storable_cases[] = {
+  {"Content-Length: 1\r\n", 0, 1},
+  {"Cache-Control: no-store\r\nContent-Length: 1\r\n", 0, 0},
+  {"Cache-Control: private\r\nContent-Length: 1\r\n", 0, 0},
+  {"Cache-Control: no-cache\r\nContent-Length: 1\r\n", 0, 0},
+  {"Cache-Control: max-age=0\r\nContent-Length: 1\r\n", 0, 0},
+  {"Cache-Control: max-age=60\r\nContent-Length: 1\r\n", 0, 1},
+  {"Cache-Control: s-maxage=0, max-age=60\r\nContent-Length: 1\r\n", 0, 0},
+  {"Expires: Thu, 01 Jan 1970 00:00:00 GMT\r\nContent-Length: 1\r\n", 0, 0},
+  {"Expires: 0\r\nContent-Length: 1\r\n", 0, 0},
+  {"Expires: Fri, 01 Jan 2100 00:00:00 GMT\r\nContent-Length: 1\r\n", 0, 1},
+  {"Expires: Friday, 01-Jan-69 00:00:00 GMT\r\nContent-Length: 1\r\n", 0, 1},
+  {"Expires: Fri Jan  1 00:00:00 2100\r\nContent-Length: 1\r\n", 0, 1},
+  {"Last-Modified: Thu, 01 Jan 1970 00:00:00 GMT\r\nContent-Length: 1\r\n",
+   0, 1},
+  {"Vary: Accept-Encoding\r\nContent-Length: 1\r\n", 0, 1},
+  {"Vary: Cookie\r\nContent-Length: 1\r\n", 0, 0},
+  {"Vary: *\r\nContent-Length: 1\r\n", 0, 0},
+  {"Content-Length: 1\r\n", 1, 0},
+  {"Cache-Control: public\r\nContent-Length: 1\r\n", 1, 1},
+  {"Cache-Control: s-maxage=60\r\nContent-Length: 1\r\n", 1, 1},
+  {"Set-Cookie: a=b\r\nContent-Length: 1\r\n", 0, 0},
+  {"Set-Cookie: a=b\r\nCache-Control: public\r\nContent-Length: 1\r\n", 0, 1},
+  {"Content-Encoding: gzip\r\nContent-Length: 1\r\n", 0, 0},
+  {"Content-Encoding: identity\r\nContent-Length: 1\r\n", 0, 1},
+  {"Transfer-Encoding: chunked\r\n", 0, 0},
+};
+
+static void TestStorable(void) {
+  size_t n = sizeof(storable_cases) / sizeof(storable_cases[0]);
+  for (size_t i = 0; i < n; ++i) {
+    const StorableCase *c = &storable_cases[i];
+    char data[MAXLINE];
+    snprintf(data, sizeof(data), "HTTP/1.1 200 OK\r\n%s\r\n", c->fields);
+    HTTPResponse response;
+    InitHTTPResponse(&response);
+    FeedHostResponse(&response, data, strlen(data));
+    CHECK(IsStorable(response.buf, &response, c->credentials) == c->storable);
+    FreeResponse(&response);
+  }
+}
+
+static void TestParseChunks(void) {
+  const char *body = "4\r\nabcd\r\n3\r\nef";
+  int done;
+  size_t next = ParseChunks(body, body + strlen(body), &done);
+  CHECK(done == 0 && next == 17);   // resumes past the partial chunk
+  const char *line = "4\r\nabcd\r\n3";
+  next = ParseChunks(line, line + strlen(line), &done);
+  CHECK(done == 0 && next == 9);    // resumes at the partial size line
+  const char *last = "0\r\n\r\n";
+  next = ParseChunks(last, last + 5, &done);
+  CHECK(done == 1 && next == 5);
+  const char *huge = "ffffffffffffffff\r\nab";
+  next = ParseChunks(huge, huge + strlen(huge), &done);
+  CHECK(done == -1);
+}
+
+// A chunked body relayed while it is received, dropping what was relayed
+static void TestDropResponseData(void) {
+  const char *data = "HTTP/1.1 200 OK\r\nTransfer-Encoding: chunked\r\n\r\n"
+    "5\r\nhello\r\nA\r\n0123456789\r\n0\r\n\r\n";
+  size_t size = strlen(data);
+  for (size_t piece = 1; piece <= size; ++piece) {
+    HTTPResponse response;
+    InitHTTPResponse(&response);
+    size_t relayed = 0;
+    int ret = 1;
+    for (size_t off = 0; off < size && ret > 0; off += piece) {
+      size_t n = size - off < piece ? size - off : piece;
+      ret = FeedHostResponse(&response, data + off, n);
+      CHECK(!memcmp(response.buf, data + response.buf_offset,
+                    response.rec_size - response.buf_offset));
+      if (response.state >= KNOW_CONTENT_LENGTH) {
+        size_t keep = response.state == CHUNKED_TRANS &&
+          response.chunk_pos < response.rec_size ?
+          response.chunk_pos : response.rec_size;
+        relayed += keep - response.buf_offset;
+        DropResponseData(&response, keep);
+      }
+    }
+    CHECK(ret == 1 && response.state == RESPONSE_DONE);
+    CHECK(relayed == size && response.buf_offset == size);
+    FreeResponse(&response);
+  }
+}
+
+typedef struct {
+  const char *spec;
+  size_t length;
+  int n;                    // ParseRange() result
+  size_t first, last;       // of the first range when n > 0
+} RangeCase;
+
+static const RangeCase range_cases[] = {
+  {"bytes=0-499", 1000, 1, 0, 499},
+  {"bytes=-200", 1000, 1, 800, 999},
+  {"bytes=500-", 1000, 1, 500, 999},
+  {"bytes=0-99999", 1000, 1, 0, 999},
+  {"bytes=0-0, -1", 1000, 2, 0, 0},
+  {"bytes=1000-", 1000, 0, 0, 0},
+  {"bytes=5-2", 1000, -1, 0, 0},
+  {"items=0-1", 1000, -1, 0, 0},
+  {"bytes=0-1;", 1000, -1, 0, 0},
+  {"bytes=", 1000, -1, 0, 0},
+  {"bytes= \t", 1000, -1, 0, 0},
+  {"bytes=0-1,", 1000, -1, 0, 0},
+  {"bytes=0-1,,2-3", 1000, -1, 0, 0},
+};
+
+static void TestParseRange(void) {
+  size_t n = sizeof(range_cases) / sizeof(range_cases[0]);
+  for (size_t i = 0; i < n; ++i) {
+    const RangeCase *c = &range_cases[i];
+    ByteRange ranges[MAX_RANGES];
+    int ret = ParseRange(c->spec, c->length, ranges, MAX_RANGES);
+    CHECK(ret == c->n);
+    if (ret > 0 && c->n > 0) {
+      CHECK(ranges[0].first == c->first && ranges[0].last == c->last);
+    }
+  }
+}
+
+typedef struct {
+  const char *if_range;
+  int ranged;               // answered with the range, else with the whole body
+} IfRangeCase;
+
+static const IfRangeCase if_range_cases[] = {
+  {NULL, 1},
+  {"\"v1\"", 1},
+  {"\"v2\"", 0},
+  {"W/\"v1\"", 0},
+  {"Wed, 14 Oct 2026 18:22:05 GMT", 1},
+  {"Thu, 15 Oct 2026 18:22:05 GMT", 0},
+};
+
+static void TestIfRange(void) {
+  static const char response[] =
+    "HTTP/1.1 200 OK\r\n"
+    "Last-Modified: Wed, 14 Oct 2026 18:22:05 GMT\r\n"
+    "ETag: \"v1\"\r\n"
+    "Content-Length: 10\r\n"
+    "\r\n"
+    "0123456789";
+  size_t size = strlen(response), header_size = size - 10;
+  size_t n = sizeof(if_range_cases) / sizeof(if_range_cases[0]);
+  for (size_t i = 0; i < n; ++i) {
+    const IfRangeCase *c = &if_range_cases[i];
+    struct iovec iov[MAX_IOV];
+    int iovcnt;
+    char *owned;
+    CHECK(BuildRangeResponse(response, size, header_size, "bytes=2-4",
+                             c->if_range, 0, iov, &iovcnt, &owned));
+    const struct iovec *body = &iov[iovcnt - 1];
+    CHECK(body->iov_len == (c->ranged ? 3 : 10));
+    CHECK(!memcmp(body->iov_base, c->ranged ? "234" : "0123456789",
+                  body->iov_len));
+    Free(owned);
+  }
+}
+
+/*
+ * Benchmarks, in MB/s of parsed input
+ */
+
+static double Seconds(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void Report(const char *name, size_t bytes, double seconds) {
+  printf("%-28s %9.1f MB/s\n", name, bytes / seconds / (1 << 20));
+}
+
+static volatile size_t sink;  // keeps the parsed results alive
+
+static void BenchRequestParser(size_t total) {
+  size_t size = strlen(bench_request), bytes = 0;
+  double start = Seconds();
+  for (; bytes < total; bytes += size) {
+    HTTPRequest request;
+    InitHTTPRequest(&request);
+    sink += HTTPRequestParser(bench_request, &request);
+    FreeHTTPRequest(&request);
+  }
+  Report("HTTPRequestParser", bytes, Seconds() - start);
+}
+
+static void BenchHeaderBlock(size_t total) {
+  size_t size = strlen(bench_request), bytes = 0;
+  HeaderBlock block;
+  double start = Seconds();
+  for (; bytes < total; bytes += size) {
+    sink += ParseHeaderBlock(bench_request, size, &block);
+    sink += block.nheaders;
+  }
+  Report("ParseHeaderBlock", bytes, Seconds() - start);
+}
+
+static void BenchResponseHeader(size_t total) {
+  size_t size = strlen(bench_response), bytes = 0;
+  double start = Seconds();
+  for (; bytes < total; bytes += size) {
+    HTTPResponse response;
+    InitHTTPResponse(&response);
+    sink += FeedHostResponse(&response, bench_response, size);
+    sink += response.state;
+    FreeResponse(&response);
+  }
+  Report("FeedHostResponse header", bytes, Seconds() - start);
+}
+
+static void BenchParseChunks(size_t total) {
+  // 1 MB body of 4 KB chunks
+  size_t nchunks = 256, chunk = 4096;
+  char *body = Malloc(nchunks * (chunk + 16) + 8);
+  size_t size = 0;
+  for (size_t i = 0; i < nchunks; ++i) {
+    size += sprintf(body + size, "%zx\r\n", chunk);
+    memset(body + size, 'x', chunk);
+    size += chunk;
+    size += sprintf(body + size, "\r\n");
+  }
+  size += sprintf(body + size, "0\r\n\r\n");
+  size_t bytes = 0;
+  double start = Seconds();
+  for (; bytes < total; bytes += size) {
+    int done;
+    sink += ParseChunks(body, body + size, &done);
+    sink += done;
+  }
+  Report("ParseChunks", bytes, Seconds() - start);
+  Free(body);
+}
+
+/*
+ * Fuzz entry point: the first byte picks the parser, the rest is its input
+ */
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size) {
+  if (!size) {
+    return 0;
+  }
+  int target = data[0] % 4;
+  ++data;
+  --size;
+  // every parser expects NUL terminated text
+  char *text = Malloc(size + 1);
+  memcpy(text, data, size);
+  text[size] = '\0';
+
+  switch (target) {
+    case 0: {
+      HTTPRequest request;
+      InitHTTPRequest(&request);
+      if (HTTPRequestParser(text, &request) &&
+          (!request.host || !request.port || !request.path ||
+           !*request.host || !*request.port)) {
+        abort();
+      }
+      FreeHTTPRequest(&request);
+      HeaderBlock block;
+      if (ParseHeaderBlock(text, size, &block) &&
+          (block.size > size || block.nheaders > MAX_HEADERS)) {
+        abort();
+      }
+      break;
+    }
+
+    case 1: {
+      // received in pieces whose size comes from the input itself
+      size_t piece = size ? 1 + (unsigned char)text[0] % 64 : 1;
+      HTTPResponse response;
+      InitHTTPResponse(&response);
+      if (FeedInPieces(&response, text, size, piece) == 1 &&
+          (response.rec_size > size || response.header_size > response.rec_size ||
+           (response.buf &&
+            response.rec_size - response.buf_offset >= response.buffer_size) ||
+           (response.state == RESPONSE_DONE &&
+            response.total_size > response.rec_size))) {
+        abort();
+      }
+      FreeResponse(&response);
+      break;
+    }
+
+    case 2: {
+      int done;
+      size_t next = ParseChunks(text, text + size, &done);
+      if (done && next > size) {
+        abort();
+      }
+      break;
+    }
+
+    case 3: {
+      ByteRange ranges[MAX_RANGES];
+      size_t length = 1000;
+      int n = ParseRange(text, length, ranges, MAX_RANGES);
+      for (int i = 0; i < n; ++i) {
+        if (ranges[i].first > ranges[i].last || ranges[i].last >= length) {
+          abort();
+        }
+      }
+      break;
+    }
+  }
+  Free(text);
+  return 0;
+}
+
+#ifndef PARSER_FUZZ
+// Run the entry point on a file
+static void FuzzFile(const char *path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) {
+    unix_error("parser_harness: open");
+  }
+  struct stat st;
+  fstat(fd, &st);
+  uint8_t *data = Malloc(st.st_size + 1);
+  if (rio_readn(fd, data, st.st_size) != st.st_size) {
+    unix_error("parser_harness: read");
+  }
+  close(fd);
+  LLVMFuzzerTestOneInput(data, st.st_size);
+  Free(data);
+}
+
+// Run the entry point on random mutations of the unit test inputs, a
+// smoke test for machines without libFuzzer
+static void FuzzSeeds(void) {
+  const char *seeds[64];
+  int targets[64];
+  int nseeds = 0;
+  for (size_t i = 0; i < sizeof(request_cases) / sizeof(request_cases[0]); ++i) {
+    targets[nseeds] = 0;
+    seeds[nseeds++] = request_cases[i].request;
+  }
+  for (size_t i = 0; i < sizeof(response_cases) / sizeof(response_cases[0]); ++i) {
+    targets[nseeds] = 1;
+    seeds[nseeds++] = response_cases[i].response;
+  }
+  targets[nseeds] = 2;
+  seeds[nseeds++] = "4\r\nabcd\r\n0\r\n\r\n";
+  for (size_t i = 0; i < sizeof(range_cases) / sizeof(range_cases[0]); ++i) {
+    targets[nseeds] = 3;
+    seeds[nseeds++] = range_cases[i].spec;
+  }
+
+  srandom(1);
+  uint8_t input[1024];
+  for (int round = 0; round < FUZZ_ROUNDS; ++round) {
+    int seed = random() % nseeds;
+    size_t size = strlen(seeds[seed]);
+    input[0] = targets[seed];
+    memcpy(input + 1, seeds[seed], size);
+    ++size;
+    int mutations = 1 + random() % 4;
+    for (int i = 0; i < mutations; ++i) {
+      size_t pos = 1 + random() % size;
+      switch (random() % 4) {
+        case 0: // flip a byte
+          if (pos < size) input[pos] = random();
+          break;
+        case 1: // insert a byte
+          if (size < sizeof(input)) {
+            memmove(input + pos + 1, input + pos, size - pos);
+            input[pos] = "0123456789abcdef\r\n:;-, "[random() % 24];
+            ++size;
+          }
+          break;
+        case 2: // delete a byte
+          if (pos < size) {
+            memmove(input + pos, input + pos + 1, size - pos - 1);
+            --size;
+          }
+          break;
+        case 3: // truncate
+          size = pos;
+          break;
+      }
+    }
+    LLVMFuzzerTestOneInput(input, size);
+  }
+  printf("%d mutated inputs passed\n", FUZZ_ROUNDS);
+}
+
+int main(int argc, char **argv) {
+  LimiterInit(&buffered_limit, 0);
+  // parse errors are expected here
+  log_level = LOG_ERROR;
+  if (argc >= 2 && !strcmp(argv[1], "fuzz")) {
+    if (argc == 2) {
+      FuzzSeeds();
+    }
+    for (int i = 2; i < argc; ++i) {
+      FuzzFile(argv[i]);
+    }
+    return 0;
+  }
+
+  TestRequestParser();
+  TestHeaderBlock();
+  TestUpstreamRequest();
+  TestResponseFraming();
+  TestStorable();
+  TestParseChunks();
+  TestDropResponseData();
+  TestParseRange();
+  TestIfRange();
+  if (failures) {
+    printf("%d check(s) failed\n", failures);
+    return 1;
+  }
+  printf("all checks passed\n");
+
+  size_t total = (argc >= 2 ? strtoul(argv[1], NULL, 10) : 64) << 20;
+  if (total) {
+    BenchRequestParser(total);
+    BenchHeaderBlock(total);
+    BenchResponseHeader(total);
+    BenchParseChunks(total);
+  }
+  return 0;
+}
+#endif
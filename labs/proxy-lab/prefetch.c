@@ -0,0 +1,283 @@
+#include "prefetch.h"
+#include "objlog.h"
+#include "compress.h"
+#include "breaker.h"
+
+typedef struct PrefetchJob {
+  Cache *cache;
+  CacheObject *page;
+  char *host;
+  char *port;
+  char *path;
+  struct PrefetchJob *next;
+} PrefetchJob;
+
+static PrefetchJob *queue_head = NULL;
+static PrefetchJob *queue_tail = NULL;
+static int queue_size = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static size_t page_budget = 0;
+static int started = 0;
+
+static void *PrefetchThread(void *vargp);
+static void ScanPage(const PrefetchJob *job, char *read_buf);
+static int ResolveReference(const PrefetchJob *job, const char *ref,
+                            size_t ref_size, char *url, size_t n);
+static size_t Prefetch(const PrefetchJob *job, const char *url, char *read_buf);
+static void FreeJob(PrefetchJob *job);
+
+void PrefetchInit(int nthreads, size_t budget) {
+  page_budget = budget;
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, PrefetchThread, NULL);
+  }
+  started = nthreads > 0;
+}
+
+int IsHTMLResponse(const char *response_buf) {
+  size_t type_size;
+  const char *type = FindHeader(response_buf, "Content-Type", &type_size);
+  return type && type_size >= 9 && !strncasecmp(type, "text/html", 9);
+}
+
+int PrefetchPage(Cache *cache, CacheObject *page, const char *host,
+                 const char *port, const char *path) {
+  if (!started) {
+    CacheRelease(cache, page);
+    return 0;
+  }
+  PrefetchJob *job = Malloc(sizeof(PrefetchJob));
+  job->cache = cache;
+  job->page = page;
+  strcpy(job->host = Malloc(strlen(host) + 1), host);
+  strcpy(job->port = Malloc(strlen(port) + 1), port);
+  strcpy(job->path = Malloc(strlen(path) + 1), path);
+  job->next = NULL;
+
+  pthread_mutex_lock(&queue_lock);
+  int queued = queue_size < PREFETCH_QUEUE;
+  if (queued) {
+    if (queue_tail) queue_tail->next = job;
+    else queue_head = job;
+    queue_tail = job;
+    ++queue_size;
+    pthread_cond_signal(&queue_not_empty);
+  }
+  pthread_mutex_unlock(&queue_lock);
+  if (!queued) {
+    LogDebug("Prefetch: queue full, skip %s\n", path);
+    FreeJob(job);
+  }
+  return queued;
+}
+
+static void *PrefetchThread(void *vargp) {
+  pthread_detach(pthread_self());
+  char *read_buf = Malloc(READ_BUF_SIZE);
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) {
+      pthread_cond_wait(&queue_not_empty, &queue_lock);
+    }
+    PrefetchJob *job = queue_head;
+    if (!(queue_head = job->next)) {
+      queue_tail = NULL;
+    }
+    --queue_size;
+    pthread_mutex_unlock(&queue_lock);
+
+    ScanPage(job, read_buf);
+    FreeJob(job);
+  }
+  return NULL;
+}
+
+static void FreeJob(PrefetchJob *job) {
+  CacheRelease(job->cache, job->page);
+  Free(job->host);
+  Free(job->port);
+  Free(job->path);
+  Free(job);
+}
+
+static int MatchAttr(const char *p, const char *end, const char *name,
+                     size_t name_size) {
+  return (size_t)(end - p) >= name_size && !strncasecmp(p, name, name_size);
+}
+
+// Whether the attribute at p belongs to a <link> tag
+static int InLinkTag(const char *html, const char *p) {
+  while (p > html && *p != '<' && *p != '>') {
+    --p;
+  }
+  return *p == '<' && !strncasecmp(p + 1, "link", 4) && isspace(p[5]);
+}
+
+// Fetch the same-origin references of a page until its budget is spent
+static void ScanPage(const PrefetchJob *job, char *read_buf) {
+  const char *html = job->page->data + job->page->header_size;
+  const char *end = job->page->data + job->page->size;
+  size_t fetched = 0;
+  int links = 0;
+  for (const char *p = html; p < end; ++p) {
+    if (links == PREFETCH_MAX_LINKS || fetched >= page_budget) {
+      LogDebug("Prefetch: budget of %s spent\n", job->path);
+      break;
+    }
+    size_t name_size;
+    if (MatchAttr(p, end, "src=", 4)) {
+      name_size = 4;
+    } else if (MatchAttr(p, end, "href=", 5) && InLinkTag(html, p)) {
+      name_size = 5;
+    } else {
+      continue;
+    }
+    if (p == html || !isspace(p[-1])) {
+      continue;
+    }
+    const char *value = p + name_size;
+    char quote = 0;
+    if (value < end && (*value == '"' || *value == '\'')) {
+      quote = *value++;
+    }
+    const char *value_end = value;
+    while (value_end < end && (quote ? *value_end != quote :
+                               !isspace(*value_end) && *value_end != '>')) {
+      ++value_end;
+    }
+    p = value_end;
+
+    char url[MAXLINE];
+    if (ResolveReference(job, value, value_end - value, url, MAXLINE)) {
+      ++links;
+      fetched += Prefetch(job, url, read_buf);
+    }
+  }
+}
+
+// Resolve a reference of a page to the request path a browser would send
+// for it, e.g. "http://host:port/path" for a page requested through a proxy
+// return 1 if it is a same-origin http reference, 0 otherwise
+static int ResolveReference(const PrefetchJob *job, const char *ref,
+                            size_t ref_size, char *url, size_t n) {
+  char value[MAXLINE];
+  size_t size = 0;
+  if (ref_size >= MAXLINE) {
+    return 0;
+  }
+  for (size_t i = 0; i < ref_size; ++i) {
+    value[size++] = ref[i];
+    if (ref_size - i >= 5 && !strncmp(ref + i, "&amp;", 5)) {
+      i += 4;
+    }
+  }
+  value[size] = '\0';
+  char *fragment = strchr(value, '#');
+  if (fragment) {
+    *fragment = '\0';
+  }
+  if (!*value || strstr(value, "..")) {
+    return 0;
+  }
+
+  // origin of the page as the browser wrote it, empty for an origin-form path
+  const char *path = job->path;
+  size_t origin_size = 0;
+  if (!strncasecmp(path, "http://", 7)) {
+    const char *slash = strchr(path + 7, '/');
+    origin_size = slash ? slash - path : strlen(path);
+  }
+
+  int ret;
+  if (!strncmp(value, "//", 2) || !strncasecmp(value, "http://", 7)) {
+    const char *rest = value[0] == '/' ? value + 2 : value + 7;
+    if (!origin_size || strncasecmp(rest, path + 7, origin_size - 7) ||
+        rest[origin_size - 7] != '/') {
+      return 0;
+    }
+    ret = snprintf(url, n, "%.*s%s", (int)origin_size, path,
+                   rest + origin_size - 7);
+  } else if (value[0] == '/') {
+    ret = snprintf(url, n, "%.*s%s", (int)origin_size, path, value);
+  } else {
+    // another scheme such as data: or mailto:
+    const char *colon = strchr(value, ':');
+    const char *slash = strchr(value, '/');
+    if (colon && (!slash || colon < slash)) {
+      return 0;
+    }
+    // relative to the directory of the page
+    const char *query = strchr(path + origin_size, '?');
+    const char *dir_end = query ? query : path + strlen(path);
+    while (dir_end > path + origin_size && dir_end[-1] != '/') {
+      --dir_end;
+    }
+    if (dir_end == path + origin_size) {
+      return 0;
+    }
+    ret = snprintf(url, n, "%.*s%s", (int)(dir_end - path), path, value);
+  }
+  return ret > 0 && (size_t)ret < n;
+}
+
+// Fetch one reference into the cache unless it is cached already
+// return the bytes of the response fetched
+static size_t Prefetch(const PrefetchJob *job, const char *url, char *read_buf) {
+  char key[MAXLINE];
+  MakeCacheKey(key, MAXLINE, job->host, job->port, url);
+  CacheObject *obj = CacheLookup(job->cache, key);
+  if (obj) {
+    CacheRelease(job->cache, obj);
+    return 0;
+  }
+  // never take an origin slot a browser could use, nor wait for a dark
+  // origin
+  if (!BreakerAllow(job->host, job->port) ||
+      !LimiterTryAcquire(&origin_limit, 1)) {
+    return 0;
+  }
+
+  LogDebug("Prefetch: %s\n", key);
+  size_t size = 0;
+  int host_fd = ConnectTo(job->host, job->port, CONNECT_TIMEOUT, 0);
+  if (host_fd < 0) {
+    BreakerFailure(job->host, job->port);
+  } else {
+    // origin-form target, the url is absolute
+    const char *target = url;
+    if (!strncasecmp(target, "http://", 7) && !(target = strchr(url + 7, '/'))) {
+      target = "/";
+    }
+    char request[2 * MAXLINE];
+    int request_size = snprintf(request, sizeof(request),
+                                "GET %s HTTP/1.%d\r\nHost: %s%s%s\r\n"
+                                "Connection: close\r\n\r\n", target,
+                                config.upstream_minor, job->host,
+                                strcmp(job->port, "80") ? ":" : "",
+                                strcmp(job->port, "80") ? job->port : "");
+    if (ForwardBroswerRequest(host_fd, request, request_size)) {
+      HTTPResponse response;
+      char *response_buf = GetHostResponse(host_fd, read_buf, &size, &response);
+      if (response_buf) {
+        BreakerSuccess(job->host, job->port);
+        if (IsCacheable(response_buf, &response, size, 0) &&
+            CacheInsert(job->cache, key, response_buf, size,
+                        response.header_size,
+                        ResponseExpires(response_buf, response.header_size))) {
+          CacheObject *obj = object_log ? CacheLookup(job->cache, key) : NULL;
+          if (obj) {
+            ObjLogAppend(object_log, job->cache, obj);
+          }
+          CompressCached(job->cache, key);
+        }
+        BufferFree(response_buf, response.buffer_size);
+      }
+      FreeHTTPREsponse(&response);
+    }
+    Close(host_fd);
+  }
+  LimiterRelease(&origin_limit, 1);
+  return size;
+}
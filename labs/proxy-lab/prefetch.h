@@ -0,0 +1,35 @@
+#ifndef __PREFETCH_H__
+#define __PREFETCH_H__
+#include "proxy.h"
+
+// Prefetch of embedded resources
+// When an HTML page is cached, its same-origin <... src=> and <link href=>
+// references are fetched in the background so they are already cached when
+// the browser asks for them. Pages are scanned and fetched by a few
+// prefetch threads, never by the workers. A page may fetch at most a byte
+// budget, and a prefetch only runs if an origin request slot is free.
+// Prefetches carry no credentials, so only pages requested without
+// Authorization or Cookie are scanned, and a response is stored under the
+// same rules as one to an anonymous browser.
+#define PREFETCH_QUEUE 64       // pages waiting to be scanned
+#define PREFETCH_MAX_LINKS 64   // references fetched per page
+
+// Start the prefetch threads
+// 1. Input:
+//  <1> nthreads : number of pages scanned and fetched concurrently
+//  <2> budget : bytes of responses fetched per page
+void PrefetchInit(int nthreads, size_t budget);
+
+// Whether a response is an HTML page worth scanning
+int IsHTMLResponse(const char *response_buf);
+
+// Queue a cached page to be scanned
+// 1. Input:
+//  <1> cache : the cache shard holding the page, prefetched objects go there
+//  <2> page : a reference returned by CacheLookup(), always consumed
+//  <3> host, port, path : the request of the page
+// 2. Output:
+//  <1> ret : 1 if queued, 0 if the queue is full
+int PrefetchPage(Cache *cache, CacheObject *page, const char *host,
+                 const char *port, const char *path);
+#endif
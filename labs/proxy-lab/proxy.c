@@ -14,111 +14,347 @@
         3. Wait for the Server request
             (1) Parse Response and get the necessary info for logging
  */
-#include "xnix_helper.h"
+#include "proxy.h"
+#include "relay.h"
+#include "prefetch.h"
+#include "affinity.h"
+#include "header.h"
+#include "restart.h"
+#include "objlog.h"
+#include "trace.h"
+#include "compress.h"
+#include "resolve.h"
 #include <stdarg.h>
-#include <assert.h>
-#define MAXLINE 8192
+#include <limits.h>
 void format_log_entry(char *logstring, struct sockaddr_in *sockaddr, char *uri, int size);
-typedef struct {
-  char *path;
-  char *host;
-  char *port;
-  char *connection;
-}HTTPRequest;
-
-typedef struct {
-  char *status;
-  char *date;
-  char *size;
-}HTTPResponse;
-
-void InitHTTPRequest(HTTPRequest *ptr);
-void FreeHTTPRequest(HTTPRequest *ptr);
-int HTTPRequestParser(const char *buffer, HTTPRequest *request);
-void DispHTTPRequestStruct(const HTTPRequest *request);
-
-void InitHTTPResponse(HTTPResponse *ptr);
-void FreeHTTPREsponse(HTTPResponse *ptr);
-
-char *GetBroswerRequest(int sock_fd, size_t *rec_size, HTTPRequest *request);
-int ForwardBroswerRequest(int sock_fd, const char *request, size_t size);
-char *GetHostResponse(int sock_fd, size_t *rec_size, HTTPResponse *response);
-int ForwardHostResponse(int sock_fd, const char *response, size_t size);
-
-void ClientError(void);
-int IsTransferEnd(const char *ptr_beg, const char *ptr_end);
+
+void InitWorkers(void);
+void DispatchConnection(int broswer_fd);
+static void WakeWorkers(void);
+static int TakeOverListener(const char *path);
+static int WaitForConnection(int server_fd, int control_fd, int timeout);
+static void HandOff(int server_fd, int *control_fd);
+
+static int AdvanceResponse(HTTPResponse *response);
+static size_t ParseChunks(const char *ptr_beg, const char *ptr_end,
+                          int *done);
+
+ProxyConfig config = {8, 256, 64, 256 * (1 << 20), 0, NULL, 16384, 0,
+                      2, 4 * (1 << 20), 1, NULL, NULL, NULL,
+                      LOG_WARN, 1, HEADER_TIMEOUT};
+Limiter conn_limit;
+Limiter origin_limit;
+Limiter buffered_limit;
+static WorkerCtx *workers;
+static Cache *caches;           // one shard per NUMA node in use
+volatile int draining = 0;
+ObjLog *object_log = NULL;
+
 int main(int argc, char **argv) {
+  int opt;
+  while ((opt = getopt(argc, argv, "t:c:o:b:ra:q:l:p:f:u:R:C:T:v:z:d:")) != -1) {
+    switch (opt) {
+      case 't': config.threads = atoi(optarg); break;
+      case 'c': config.max_conns = strtoul(optarg, NULL, 10); break;
+      case 'o': config.max_origin = strtoul(optarg, NULL, 10); break;
+      case 'b': config.max_buffered = strtoul(optarg, NULL, 10); break;
+      case 'r': config.reject_overload = 1; break;
+      case 'a': config.cpu_list = optarg; break;
+      case 'q': config.quantum = strtoul(optarg, NULL, 10); break;
+      case 'l': config.client_rate = strtoul(optarg, NULL, 10); break;
+      case 'p': config.prefetch_threads = atoi(optarg); break;
+      case 'f': config.prefetch_budget = strtoul(optarg, NULL, 10); break;
+      case 'u': config.upstream_minor = atoi(optarg); break;
+      case 'R': config.restart_path = optarg; break;
+      case 'C': config.log_path = optarg; break;
+      case 'T': config.trace_path = optarg; break;
+      case 'v': config.log_level = atoi(optarg); break;
+      case 'z': config.compress_threads = atoi(optarg); break;
+      case 'd': config.request_timeout = atol(optarg); break;
+      default: argc = 0; break;
+    }
+  }
   /* Check arguments */
-  if (argc != 2) {
-    fprintf(stderr, "Usage: %s <port number>\n", argv[0]);
+  if (optind != argc - 1 || config.threads <= 0 || !config.max_conns ||
+      !config.quantum || config.prefetch_threads < 0 ||
+      config.compress_threads < 0 || config.request_timeout <= 0 ||
+      (config.upstream_minor != 0 && config.upstream_minor != 1) ||
+      config.log_level < LOG_ERROR || config.log_level > LOG_DEBUG) {
+    fprintf(stderr, "Usage: %s [-t threads] [-c max_conns] "
+            "[-o max_origin_requests] [-b max_buffered_bytes] [-r] "
+            "[-a cpu_list] [-q quantum_bytes] [-l client_bytes_per_sec] "
+            "[-p prefetch_threads] [-f prefetch_bytes_per_page] "
+            "[-u upstream_http_minor] [-R control_socket_path] "
+            "[-C cache_log_path] [-T trace_dump_path] "
+            "[-v log_level(0-3)] [-z compress_threads] "
+            "[-d request_timeout_ms] <port number>\n", argv[0]);
 	exit(0);
   }
-  int server_fd = CreateServerSocket(argv[1], AF_INET, 10);
+  log_level = config.log_level;
+  // a running proxy hands its listening socket over, the port is then unused
+  int server_fd = config.restart_path ?
+    TakeOverListener(config.restart_path) : -1;
+  if (server_fd < 0) {
+    server_fd = CreateServerSocket(argv[optind], AF_INET, 128);
+  }
   if (server_fd == -1) {
     exit(0);
   }
+  // a browser closing early must not kill the proxy
+  Signal(SIGPIPE, SIG_IGN);
+  LimiterInit(&conn_limit, config.max_conns);
+  LimiterInit(&origin_limit, config.max_origin);
+  LimiterInit(&buffered_limit, config.max_buffered);
+  // before any thread is created, they all leave SIGUSR1 to the dump thread
+  if (config.trace_path) {
+    TraceInit(config.trace_path);
+  }
+  // from now on lines are written by a thread of their own
+  LogInit(config.log_level);
+  InitWorkers();
+  ResolveInit(RESOLVE_THREADS);
+  PrefetchInit(config.prefetch_threads, config.prefetch_budget);
+  CompressInit(config.compress_threads);
+  // opened after the listener is handed over, the old proxy has stopped
+  // appending then
+  if (config.log_path && !(object_log = ObjLogOpen(config.log_path))) {
+    app_error("Cannot open cache log %s, objects are not persisted\n",
+              config.log_path);
+  }
+  int control_fd = -1;
+  if (config.restart_path) {
+    control_fd = OpenControlSocket(config.restart_path);
+  }
+
   char client_addr[120];
   while (1) {
-    DebugStr("Waiting for broswer connection...\n");
+    // Delay mode: stop accepting while full, new connections wait in the
+    // listen backlog instead of slowing down the ones being served. The
+    // wait is cut in steps, a new proxy asking for the listener is served
+    // while the proxy is full.
+    if (!config.reject_overload &&
+        !LimiterAcquire(&conn_limit, 1, CONTROL_POLL)) {
+      if (control_fd >= 0 && WaitForConnection(-1, control_fd, 0)) {
+        HandOff(server_fd, &control_fd);
+      }
+      continue;
+    }
+    if (control_fd >= 0 && WaitForConnection(server_fd, control_fd, -1)) {
+      if (!config.reject_overload) {
+        LimiterRelease(&conn_limit, 1);
+      }
+      HandOff(server_fd, &control_fd);
+      continue;
+    }
+    LogDebug("Waiting for broswer connection...\n");
     int broswer_fd = Accept(server_fd, -1, 0, client_addr);
-    int broswer_close_con = 0;
-    while (!broswer_close_con) {
-
-      DebugStr("Waiting for broswer request...\n");
-      HTTPRequest request;
-      size_t request_size = 0;
-      char *request_buf = GetBroswerRequest(broswer_fd, &request_size, &request);
-      if (!request_buf) {
-        FreeHTTPRequest(&request);
-        broswer_close_con = 1;
-        continue;
+    if (broswer_fd <= 0) {
+      if (!config.reject_overload) {
+        LimiterRelease(&conn_limit, 1);
+      }
+      if (errno == EMFILE || errno == ENFILE) {
+        usleep(10000);  // out of descriptors, let workers close some
       }
+      continue;
+    }
+    if (trace_enabled) {
+      TraceAccept(broswer_fd);
+    }
+    // Reject mode: shed the new connection with a fast 503
+    if (config.reject_overload && !LimiterTryAcquire(&conn_limit, 1)) {
+      LogInfo("Too many connections, reject %s\n", client_addr);
+      ClientError(broswer_fd, 503);
+      Close(broswer_fd);
+      continue;
+    }
+    DispatchConnection(broswer_fd);
+  }
+  exit(0);
+}
 
-      DebugStr("Received Broswer Request:\n");
-      DispHTTPRequestStruct(&request);
+// Create the workers, pin them to the CPUs of config.cpu_list and give every
+// NUMA node in use its own cache shard
+void InitWorkers(void) {
+  static int cpus[MAX_CPUS];
+  int ncpus = 0;
+  if (config.cpu_list &&
+      (ncpus = ParseCpuList(config.cpu_list, cpus, MAX_CPUS)) <= 0) {
+    app_error("Invalid cpu list %s\n", config.cpu_list);
+    exit(0);
+  }
 
-      DebugStr("Trying to connect to host...\n");
-      int host_fd = ConnectTo(request.host, request.port, -1, 0);
-      FreeHTTPRequest(&request);
-      if (host_fd < 0) {
-        ClientError();
-        continue;
-      }
+  // map the nodes of the CPUs in use to shard indexes
+  static int nodes[MAX_CPUS];
+  int shard_of_cpu[MAX_CPUS];
+  int nshards = 0;
+  for (int i = 0; i < ncpus; ++i) {
+    int node = CpuToNode(cpus[i]);
+    int shard = 0;
+    while (shard < nshards && nodes[shard] != node) {
+      ++shard;
+    }
+    if (shard == nshards) {
+      nodes[nshards++] = node;
+    }
+    shard_of_cpu[i] = shard;
+  }
+  if (!nshards) {
+    nshards = 1;
+  }
 
-      DebugStr("Trying to forward broswer request...\n");
-      if (!ForwardBroswerRequest(host_fd, request_buf, request_size)) {
-        DebugStr("Forward broswer error...\n");
-        Close(host_fd);
-        ClientError();
-        Free(request_buf);
-        continue;
-      }
-      Free(request_buf);
-
-      HTTPResponse response;
-      size_t response_size = 0;
-      char *response_buf = GetHostResponse(host_fd, &response_size, &response);
-      if (!response_buf) {
-        ClientError();
-        Close(host_fd);
-        FreeHTTPREsponse(&response);
-        continue;
-      }
-      FreeHTTPREsponse(&response);
+  caches = Calloc(nshards, sizeof(Cache));
+  for (int i = 0; i < nshards; ++i) {
+    CacheInit(&caches[i], MAX_CACHE_SIZE / nshards, MAX_OBJECT_SIZE);
+  }
+  LogInfo("%d workers, %d cache shard(s)\n", config.threads, nshards);
 
-      if (!ForwardHostResponse(broswer_fd, response_buf, response_size)) {
-        DebugStr("Forward Host response error...\n");
-        Free(response_buf);
-        break;
-      }
-      Free(response_buf);
-      Close(host_fd);
+  workers = Calloc(config.threads, sizeof(WorkerCtx));
+  for (int i = 0; i < config.threads; ++i) {
+    WorkerCtx *ctx = &workers[i];
+    ctx->cpu = ncpus ? cpus[i % ncpus] : -1;
+    ctx->cache = &caches[ncpus ? shard_of_cpu[i % ncpus] : 0];
+    sbuf_init(&ctx->queue, config.max_conns);
+    if (pipe(ctx->wake_fd) < 0) {
+      unix_error("InitWorkers: pipe");
+    }
+    // a full pipe already wakes the worker, writers never wait on it
+    SetSockNonBlocking(ctx->wake_fd[1]);
+    ctx->nconns = 0;
+    ctx->relays = NULL;
+    ctx->idle = NULL;
+    pthread_t tid;
+    pthread_create(&tid, NULL, Worker, ctx);
+  }
+}
+
+// Hand a new connection to the least loaded worker, it stays there until
+// it is closed
+void DispatchConnection(int broswer_fd) {
+  static int next = 0;
+  int best = next;
+  for (int i = 1; i < config.threads && workers[best].nconns; ++i) {
+    int candidate = (next + i) % config.threads;
+    if (workers[candidate].nconns < workers[best].nconns) {
+      best = candidate;
+    }
+  }
+  next = (best + 1) % config.threads;
+  __sync_fetch_and_add(&workers[best].nconns, 1);
+  sbuf_insert(&workers[best].queue, broswer_fd);
+  char wake = 0;
+  if (write(workers[best].wake_fd[1], &wake, 1) < 0 && errno != EAGAIN) {
+    perror("DispatchConnection: wake");
+  }
+}
+
+static void WakeWorkers(void) {
+  char wake = 0;
+  for (int i = 0; i < config.threads; ++i) {
+    if (write(workers[i].wake_fd[1], &wake, 1) < 0 && errno != EAGAIN) {
+      perror("WakeWorkers: write");
     }
-    Close(broswer_fd);
+  }
+}
+
+// Take the listening socket of the proxy running with the same control
+// socket, within HANDOFF_TIMEOUT
+// return the socket, -1 if no proxy runs there or it did not hand over
+static int TakeOverListener(const char *path) {
+  long deadline = NowMs() + HANDOFF_TIMEOUT;
+  int sock_fd = ConnectControlSocket(path, HANDOFF_TIMEOUT);
+  if (sock_fd < 0) {
+    return -1;
+  }
+  LogInfo("Taking over the listening socket of the running proxy...\n");
+  long left = deadline - NowMs();
+  int server_fd = RecvFd(sock_fd, left > 0 ? left : 0);
+  Close(sock_fd);
+  return server_fd;
+}
+
+// Wait until a browser connects or a new proxy asks for the listener, for
+// at most timeout ms, -1 = no limit. A server_fd of -1 only waits for a
+// new proxy.
+// return 1 if a new proxy asks, 0 otherwise
+static int WaitForConnection(int server_fd, int control_fd, int timeout) {
+  struct pollfd fds[2] = {{server_fd, POLLIN, 0}, {control_fd, POLLIN, 0}};
+  if (poll(fds, 2, timeout) < 0) {
+    return 0;
+  }
+  return fds[1].revents != 0;
+}
+
+// Pass the listening socket to a new proxy, then let the workers finish
+// their responses and exit. Idle keep-alive connections are closed at
+// once, the others after their current response.
+// Returns only if the new proxy went away before it got the socket.
+static void HandOff(int server_fd, int *control_fd) {
+  int sock_fd = accept(*control_fd, NULL, NULL);
+  if (sock_fd < 0) {
+    perror("HandOff: accept");
+    return;
+  }
+  draining = 1;
+  WakeWorkers();
+  // the object log belongs to the new proxy from now on
+  if (object_log) {
+    ObjLogClose(object_log);
+  }
+  // the new proxy opens its own control socket once it has the listener
+  Close(*control_fd);
+  unlink(config.restart_path);
+  int sent = SendFd(sock_fd, server_fd) > 0;
+  Close(sock_fd);
+  if (!sent) {
+    LogWarn("HandOff: new proxy gone, resume serving\n");
+    draining = 0;
+    if (config.log_path) {
+      object_log = ObjLogOpen(config.log_path);
+    }
+    *control_fd = OpenControlSocket(config.restart_path);
+    return;
+  }
+  Close(server_fd);
+
+  long deadline = NowMs() + DRAIN_TIMEOUT;
+  int active;
+  do {
+    active = 0;
+    for (int i = 0; i < config.threads; ++i) {
+      active += workers[i].nconns;
+    }
+    LogDebug("HandOff: %d connection(s) left\n", active);
+  } while (active && NowMs() < deadline && !usleep(100000));
+  if (trace_enabled) {
+    TraceDump();
   }
   exit(0);
 }
 
+// Request and response buffers are charged to the buffered-bytes limit, so
+// an overload fails the request that needs more memory instead of growing
+// the proxy until it dies.
+// return NULL if the limit would be exceeded
+char *BufferAlloc(size_t size) {
+  if (!LimiterTryAcquire(&buffered_limit, size)) {
+    return NULL;
+  }
+  return Malloc(size);
+}
+
+// return NULL if the limit would be exceeded, buf is still valid then
+char *BufferGrow(char *buf, size_t old_size, size_t new_size) {
+  if (!LimiterTryAcquire(&buffered_limit, new_size - old_size)) {
+    return NULL;
+  }
+  return Realloc(buf, new_size);
+}
+
+void BufferFree(char *buf, size_t size) {
+  Free(buf);
+  LimiterRelease(&buffered_limit, size);
+}
+
 /*
  * format_log_entry - Create a formatted log entry in logstring.
  *
@@ -155,36 +391,41 @@ void format_log_entry(char *logstring, struct sockaddr_in *sockaddr,
 
 int HTTPRequestParser(const char *buffer, HTTPRequest *request) {
 
-  if (!strstr(buffer, "GET")) {
-    app_error("Currently only support GET Method\n");
-    DebugStr("%s\n", buffer);
-    ClientError();
+  if (strncmp(buffer, "GET ", 4)) {
+    LogInfo("Currently only support GET Method\n");
+    LogDebug("%s\n", buffer);
+    request->error_status = 501;
     return 0;
   }
 
   const char *path_start = buffer + 4;
-  const char *path_end = strchr(path_start, ' ');
-  if (!path_end) {
-    app_error("Parse path error\n");
-    ClientError();
+  const char *path_end = strpbrk(path_start, " \r\n");
+  if (!path_end || *path_end != ' ' || path_end == path_start) {
+    LogInfo("Parse path error\n");
+    request->error_status = 400;
     return 0;
   }
 
   size_t path_size= path_end - path_start;
   strncpy(request->path = Malloc(path_size+1), path_start, path_size);
   request->path[path_size] = '\0';
-  const char *host_start = strstr(buffer, "Host: ");
-  if (!host_start) {
-    app_error("Parse host error\n");
-    ClientError();
+  // field names are case-insensitive
+  size_t host_value_size;
+  const char *host_start = FindHeader(buffer, "Host", &host_value_size);
+  if (!host_start || !host_value_size) {
+    LogInfo("Parse host error\n");
+    request->error_status = 400;
     return 0;
   }
 
-  host_start += 6;
-  const char *host_end = strpbrk(host_start, ":\r\n");
+  const char *host_value_end = host_start + host_value_size;
+  const char *host_end = memchr(host_start, ':', host_value_size);
   if (!host_end) {
-    app_error("Parse host error\n");
-    ClientError();
+    host_end = host_value_end;
+  }
+  if (host_end == host_start) {
+    LogInfo("Parse host error\n");
+    request->error_status = 400;
     return 0;
   }
 
@@ -192,20 +433,33 @@ int HTTPRequestParser(const char *buffer, HTTPRequest *request) {
   strncpy(request->host = Malloc(host_size+1), host_start, host_size);
   request->host[host_size] = '\0';
 
-  if (*host_end != ':') {
+  size_t range_size;
+  const char *range_start = FindHeader(buffer, "Range", &range_size);
+  if (range_start) {
+    strncpy(request->range = Malloc(range_size+1), range_start, range_size);
+    request->range[range_size] = '\0';
+  }
+  size_t if_range_size;
+  const char *if_range_start = FindHeader(buffer, "If-Range", &if_range_size);
+  if (if_range_start) {
+    strncpy(request->if_range = Malloc(if_range_size+1), if_range_start,
+            if_range_size);
+    request->if_range[if_range_size] = '\0';
+  }
+
+  if (host_end == host_value_end) {
     strncpy(request->port = Malloc(3), "80", 3);
     return 1;
   }
 
   const char *port_start = host_end + 1;
-  const char *port_end = strchr(port_start, '\n');
-  if (!port_end) {
-    app_error("Parse port error\n");
-    ClientError();
+  if (port_start == host_value_end) {
+    LogInfo("Parse port error\n");
+    request->error_status = 400;
     return 0;
   }
 
-  size_t port_size = port_end - port_start;
+  size_t port_size = host_value_end - port_start;
   strncpy(request->port = Malloc(port_size+1), port_start, port_size);
   request->port[port_size] = '\0';
   return 1;
@@ -216,12 +470,8 @@ void FreeHTTPRequest(HTTPRequest *ptr) {
   if (ptr->host) free(ptr->host);
   if (ptr->port) free(ptr->port);
   if (ptr->connection) free(ptr->connection);
-}
-
-void DispHTTPRequestStruct(const HTTPRequest *request) {
-  fprintf(stdout, "path=%s\n", request->path);
-  fprintf(stdout, "host=%s\n", request->host);
-  fprintf(stdout, "port=%s\n", request->port);
+  if (ptr->range) free(ptr->range);
+  if (ptr->if_range) free(ptr->if_range);
 }
 
 void InitHTTPRequest(HTTPRequest *ptr) {
@@ -229,44 +479,57 @@ void InitHTTPRequest(HTTPRequest *ptr) {
   ptr->host = NULL;
   ptr->port = NULL;
   ptr->connection = NULL;
+  ptr->range = NULL;
+  ptr->if_range = NULL;
+  ptr->buffer_size = 0;
+  ptr->error_status = 0;
 }
 
-char *GetBroswerRequest(int sock_fd, size_t *rec_size, HTTPRequest *request) {
-  InitHTTPRequest(request);
-
-  size_t req_buf_size = 1000;
-  char *request_buf = Malloc(req_buf_size);
-  char *read_buf = Malloc(1000);
-  *rec_size = 0;
-  int finish = 0;
-  while (!finish) {
-    size_t size = 1000;
-    if (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0) == -1) {
-      DebugStr("GetBroswerRequest: broswer closed socket.\n");
-      Free(read_buf);
-      Free(request_buf);
-      return NULL;
-    }
-    if (*rec_size + size >= req_buf_size) {
-      req_buf_size = *rec_size + size + 1000;
-      request_buf = Realloc(request_buf, req_buf_size);
-    }
-    strncpy(request_buf + *rec_size, read_buf, size);
-    *rec_size += size;
-    if (strstr(request_buf, "\r\n\r\n")) { // end of request
-      request_buf[*rec_size] = '\0';
-      Free(read_buf);
-      finish = 1;
+int ReadBroswerRequest(rio_view_t *view, size_t *size, HTTPRequest *request) {
+  int first = view->end == 0;
+  const char *data;
+  ssize_t n = rio_viewpeekuntil(view, "\r\n\r\n", 4, &data);
+  int again = n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK);
+  int too_large = n < 0 && errno == ENOBUFS;
+  if (first && view->end) {
+    Trace(view->fd, TRACE_REQUEST_BYTE);
+  }
+  // the view may have grown
+  if (view->size > request->buffer_size) {
+    if (!LimiterTryAcquire(&buffered_limit,
+                           view->size - request->buffer_size)) {
+      LogDebug("ReadBroswerRequest: buffered bytes limit reached\n");
+      request->error_status = 503;
+      return -1;
     }
+    request->buffer_size = view->size;
   }
-
-  if (!HTTPRequestParser(request_buf, request)) {
-    app_error("Parse HTTP Request Error.\n");
-    Free(request_buf);
-    return NULL;
+  if (again) {
+    return 0;
+  }
+  if (too_large) {
+    LogInfo("Request header too large\n");
+    request->error_status = 400;
+    return -1;
   }
+  if (n <= 0) {
+    LogDebug("ReadBroswerRequest: broswer closed socket.\n");
+    return -1;
+  }
+  Trace(view->fd, TRACE_REQUEST_HEADER);
+  *size = n;
+  // the header is followed by the NUL ending the data of the view
+  if (!HTTPRequestParser(data, request)) {
+    LogInfo("Parse HTTP Request Error.\n");
+    return -1;
+  }
+  return 1;
+}
 
-  return request_buf;
+void FreeRequestView(rio_view_t *view, HTTPRequest *request) {
+  rio_viewdeinit(view);
+  LimiterRelease(&buffered_limit, request->buffer_size);
+  request->buffer_size = 0;
 }
 
 int ForwardBroswerRequest(int sock_fd, const char *request, size_t size) {
@@ -280,159 +543,227 @@ void InitHTTPResponse(HTTPResponse *response) {
   response->status = NULL;
   response->date = NULL;
   response->size = NULL;
+  response->status_code = 0;
+  response->header_size = 0;
+  response->buffer_size = 0;
+  response->error_status = 0;
+  response->buf = NULL;
+  response->buf_offset = 0;
+  response->rec_size = 0;
+  response->total_size = 0;
+  response->chunk_pos = 0;
+  response->state = WAIT_FOR_HEADER;
 }
 
-char *GetHostResponse(int sock_fd, size_t *rec_size, HTTPResponse *response) {
-  InitHTTPResponse(response);
+// Append data to the response buffer, growing it within the buffered-bytes
+// limit. The buffer doubles, so a large body is not copied once per read,
+// but never past the length of the response when it is known.
+// return 1 on success, -1 on failure with response->error_status set
+static int AppendResponseData(HTTPResponse *response, const char *data,
+                              size_t size) {
+  size_t used = response->rec_size - response->buf_offset;
+  if (used + size >= response->buffer_size) {
+    size_t need = used + size + 1;
+    size_t new_size = 2 * response->buffer_size;
+    if (new_size < need + 1000) {
+      new_size = need + 1000;
+    }
+    if (response->total_size &&
+        new_size > response->total_size - response->buf_offset + 1) {
+      new_size = response->total_size - response->buf_offset + 1;
+      new_size = new_size < need ? need : new_size;
+    }
+    char *new_buf = response->buf ?
+      BufferGrow(response->buf, response->buffer_size, new_size) :
+      BufferAlloc(new_size);
+    if (!new_buf) {
+      LogDebug("GetHostResponse: buffered bytes limit reached\n");
+      response->error_status = 503;
+      return -1;
+    }
+    response->buf = new_buf;
+    response->buffer_size = new_size;
+  }
+  // Copy the newly received data
+  memcpy(response->buf + used, data, size);
+  response->rec_size += size;
+  response->buf[used + size] = '\0';
+  return 1;
+}
 
-  size_t response_buf_size = 5000;
-  char *response_buf = Malloc(response_buf_size);
-  char *read_buf = Malloc(1000);
-  *rec_size = 0;
-
-  typedef enum {
-    WAIT_FOR_HEADER = 0,
-    PROCESS_HEADER = 1,
-    KNOW_CONTENT_LENGTH = 2,
-    CHUNKED_TRANS = 3
-  }State;
-
-  State state = WAIT_FOR_HEADER;
-  const char *header_tail = NULL;
-  size_t header_size = 0;
-  size_t content_size = 0;
-  size_t total_size = 0;
-  int finish = 0;
-  while (!finish) {
-    if (state == WAIT_FOR_HEADER) {
-      size_t size = 1000;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 30000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for header timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-
-        case -1:
-          DebugStr("GetHostResponse: Host close socket\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
+void DropResponseData(HTTPResponse *response, size_t offset) {
+  if (offset <= response->buf_offset) {
+    return;
+  }
+  size_t dropped = offset - response->buf_offset;
+  // the terminating NUL moves with the data
+  memmove(response->buf, response->buf + dropped,
+          response->rec_size - offset + 1);
+  response->buf_offset = offset;
+}
 
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      // Copy the newly received data
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-      response_buf[*rec_size] = '\0';
-      if ((header_tail = strstr(response_buf, "\r\n\r\n"))) {
-        header_tail += 2;
-        header_size = header_tail - response_buf;
-        state = PROCESS_HEADER;
-      }
-    } else if (state == PROCESS_HEADER) {
-      const char *content_size_b = strstr(response_buf, "Content-Length: ");
-      const char *trans_encoding_b = strstr(response_buf, "Transfer-Encoding: ");
-      if (!trans_encoding_b && !content_size_b) {
-        DebugStr("GetHostResponse: No Content-Length and Transfer-Encoding\n");
-        Free(read_buf);
-        Free(response_buf);
-        ClientError();
-        return NULL;
-      }
-      if (trans_encoding_b) {
-        state = CHUNKED_TRANS;
-      } else {
-        state = KNOW_CONTENT_LENGTH;
-        const char *content_size_e = strpbrk(content_size_b, "\r\n\0");
-        size_t content_size_sz = content_size_e - content_size_b;
-        strncpy(response->size = Malloc(content_size_sz + 1),
-                content_size_b, content_size_sz);
-        content_size = strtoul(response->size, NULL, 10);
-        total_size = header_size + 2 + content_size;
-      }
-    } else if (state == KNOW_CONTENT_LENGTH) {
-      size_t left = total_size - *rec_size;
-      if (!left) {
-        finish = 1;
-        continue;
-      }
-      size_t size = left > 1000 ? 1000 : left;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for content timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-        case -1:
-          DebugStr("GetHostResponse: Host close socket.\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-    } else if (state == CHUNKED_TRANS) {
-
-      // Need a parser
-      if (IsTransferEnd(header_tail + 2, response_buf + *rec_size)) {
-        finish = 1;
-        continue;
-      }
-      size_t size = 1000;
-      switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, 3000, 0)) {
-        case 0:
-          DebugStr("GetHostResponse: Wait for content timeout\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-        case -1:
-          DebugStr("GetHostResponse: Host close socket.\n");
-          Free(read_buf);
-          Free(response_buf);
-          ClientError();
-          return NULL;
-      }
-      if (*rec_size + size >= response_buf_size) {
-        response_buf_size = *rec_size + size + 1000;
-        response_buf = Realloc(response_buf, response_buf_size);
-      }
-      strncpy(response_buf + *rec_size, read_buf, size);
-      *rec_size += size;
-    }
+int ReserveResponse(HTTPResponse *response) {
+  size_t new_size = response->total_size - response->buf_offset + 1;
+  if (new_size <= response->buffer_size) {
+    return 1;
+  }
+  char *new_buf = BufferGrow(response->buf, response->buffer_size, new_size);
+  if (!new_buf) {
+    return 0;
+  }
+  response->buf = new_buf;
+  response->buffer_size = new_size;
+  return 1;
+}
+
+// Receive at most want bytes from the host and append them to the response
+// return 1 on success, 0 on timeout, -1 on failure with
+// response->error_status set
+static int RecvResponseData(int sock_fd, char *read_buf, size_t want,
+                            int timeout, HTTPResponse *response) {
+  size_t size = want;
+  switch (SocketRecv(sock_fd, read_buf, &size, DONT_WAIT_ALL_DATA, timeout, 0)) {
+    case 0:
+      return 0;
+
+    case -1:
+      LogDebug("GetHostResponse: Host close socket\n");
+      response->error_status = 502;
+      return -1;
+  }
+  return AppendResponseData(response, read_buf, size);
+}
+
+// Parse the status line and the framing headers once the header is complete
+// return 1 on success, 0 if the length of the body cannot be known
+static int ProcessResponseHeader(HTTPResponse *response) {
+  const char *response_buf = response->buf;
+  size_t content_size_sz;
+  const char *content_size_b =
+    FindHeader(response_buf, "Content-Length", &content_size_sz);
+  const char *trans_encoding_b =
+    FindHeader(response_buf, "Transfer-Encoding", NULL);
+  if (!trans_encoding_b && !content_size_b) {
+    LogDebug("GetHostResponse: No Content-Length and Transfer-Encoding\n");
+    return 0;
   }
 
   // Get status
-  const char *status_end = strpbrk(response_buf, "\r\n\0");
-  size_t status_line_len = status_end - (const char*)response_buf;
+  const char *status_end = strpbrk(response_buf, "\r\n");
+  size_t status_line_len = status_end - response_buf;
   strncpy(response->status = Malloc(status_line_len + 1),
           response_buf, status_line_len);
   response->status[status_line_len] = '\0';
+  sscanf(response->status, "%*s %d", &response->status_code);
 
   // Get Date
-  const char *date_start = strstr(response_buf, "Date: ");
+  size_t date_size;
+  const char *date_start = FindHeader(response_buf, "Date", &date_size);
   if (date_start) {
-    date_start += 6;
-    const char *date_end = strpbrk(date_start, "\r\n\0");
-    size_t date_size = date_end - date_start;
     strncpy(response->date = Malloc(date_size + 1), date_start, date_size);
     response->date[date_size] = '\0';
   }
 
-  Free(read_buf);
-  return response_buf;
+  if (trans_encoding_b) {
+    response->state = CHUNKED_TRANS;
+    response->chunk_pos = response->header_size;
+  } else {
+    response->state = KNOW_CONTENT_LENGTH;
+    strncpy(response->size = Malloc(content_size_sz + 1),
+            content_size_b, content_size_sz);
+    response->size[content_size_sz] = '\0';
+    response->total_size =
+      response->header_size + strtoul(response->size, NULL, 10);
+  }
+  return 1;
+}
+
+int RecvHostResponse(int sock_fd, char *read_buf, size_t max_bytes, int timeout,
+                     HTTPResponse *response) {
+  size_t want = max_bytes;
+  if (response->state == KNOW_CONTENT_LENGTH &&
+      response->total_size - response->rec_size < want) {
+    want = response->total_size - response->rec_size;
+  }
+  if (want) {
+    int ret = RecvResponseData(sock_fd, read_buf, want, timeout, response);
+    if (ret <= 0) {
+      return ret;
+    }
+  }
+  return AdvanceResponse(response);
+}
+
+int FeedHostResponse(HTTPResponse *response, const char *data, size_t size) {
+  if (size && AppendResponseData(response, data, size) < 0) {
+    return -1;
+  }
+  return response->buf ? AdvanceResponse(response) : 1;
+}
+
+// Move the receiving state past the bytes appended to the response
+// return 1 on success, -1 on a malformed response with
+// response->error_status set
+static int AdvanceResponse(HTTPResponse *response) {
+  if (response->state == WAIT_FOR_HEADER) {
+    const char *header_tail = strstr(response->buf, "\r\n\r\n");
+    if (!header_tail) {
+      return 1;
+    }
+    response->header_size = header_tail + 4 - response->buf;
+    response->state = PROCESS_HEADER;
+  }
+  if (response->state == PROCESS_HEADER &&
+      !ProcessResponseHeader(response)) {
+    response->error_status = 502;
+    return -1;
+  }
+  if (response->state == KNOW_CONTENT_LENGTH &&
+      response->rec_size >= response->total_size) {
+    response->state = RESPONSE_DONE;
+  } else if (response->state == CHUNKED_TRANS &&
+             response->chunk_pos <= response->rec_size) {
+    int done;
+    const char *start = response->buf + response->chunk_pos -
+      response->buf_offset;
+    size_t walked = ParseChunks(start, response->buf + response->rec_size -
+                                response->buf_offset, &done);
+    if (done < 0) {
+      LogDebug("GetHostResponse: Malformed chunk\n");
+      response->error_status = 502;
+      return -1;
+    }
+    response->chunk_pos += walked;
+    if (done) {
+      response->state = RESPONSE_DONE;
+    }
+  }
+  return 1;
+}
+
+char *GetHostResponse(int sock_fd, char *read_buf, size_t *rec_size,
+                      HTTPResponse *response) {
+  InitHTTPResponse(response);
+  while (response->state != RESPONSE_DONE) {
+    int timeout =
+      response->state == WAIT_FOR_HEADER ? HEADER_TIMEOUT : DATA_TIMEOUT;
+    int ret = RecvHostResponse(sock_fd, read_buf, READ_BUF_SIZE, timeout,
+                               response);
+    if (ret == 0) {
+      LogDebug("GetHostResponse: Wait for response timeout\n");
+      response->error_status = 504;
+    }
+    if (ret <= 0) {
+      if (response->buf) {
+        BufferFree(response->buf, response->buffer_size);
+      }
+      response->buf = NULL;
+      response->buffer_size = 0;
+      return NULL;
+    }
+  }
+  *rec_size = response->rec_size;
+  return response->buf;
 }
 
 int ForwardHostResponse(int sock_fd, const char *response, size_t size) {
@@ -442,35 +773,90 @@ int ForwardHostResponse(int sock_fd, const char *response, size_t size) {
   return 1;
 }
 
-void ClientError(void) {
-  assert(NULL);
+// Answer the browser with a short error page instead of dropping it
+void ClientError(int sock_fd, int status) {
+  const char *reason;
+  switch (status) {
+    case 400: reason = "Bad Request"; break;
+    case 501: reason = "Not Implemented"; break;
+    case 502: reason = "Bad Gateway"; break;
+    case 503: reason = "Service Unavailable"; break;
+    case 504: reason = "Gateway Timeout"; break;
+    default: status = 500; reason = "Internal Server Error"; break;
+  }
+  char body[MAXLINE], buf[MAXLINE];
+  int body_size = snprintf(body, MAXLINE,
+                           "<html><title>Proxy Error</title><body>"
+                           "%d %s</body></html>\r\n", status, reason);
+  size_t size = snprintf(buf, MAXLINE, "HTTP/1.0 %d %s\r\n"
+                         "Content-Type: text/html\r\n"
+                         "Content-Length: %d\r\n"
+                         "Connection: close\r\n%s\r\n%s",
+                         status, reason, body_size,
+                         status == 503 ? "Retry-After: 1\r\n" : "", body);
+  // never wait on a browser that does not read
+  SocketSend(sock_fd, buf, &size, 100, 0);
 }
 
 int HexToNum(char ch) {
   if (ch >= '0' && ch <= '9') {
     return ch - '0';
   }
-  return ch - 'A' + 10;
+  return tolower(ch) - 'a' + 10;
 }
-// ptr_beg is the begin pointer of content
-// ptr_end is the end pointer of buffer
-int IsTransferEnd(const char *ptr_beg, const char *ptr_end) {
+
+// Walk the chunks of a chunked body received so far
+// 1. Input:
+//  <1> ptr_beg : start of a chunk-size line
+//  <2> ptr_end : end of the received data
+// 2. Output:
+//  <1> done
+//    - 1 the last chunk and the trailer have been received
+//    - 0 more data is needed
+//    - -1 malformed chunk-size line
+//  <2> ret : bytes from ptr_beg to the next chunk-size line to resume from.
+//      Once the size line of a chunk is received its data is skipped without
+//      being seen, so the offset is past ptr_end while that data arrives.
+static size_t ParseChunks(const char *ptr_beg, const char *ptr_end,
+                          int *done) {
+  const char *start = ptr_beg;
+  *done = 0;
   while (ptr_beg < ptr_end) {
     const char *line_end = strstr(ptr_beg, "\r\n");
     if (!line_end) {
       break;
     }
-    size_t sz_size = line_end - ptr_beg;
     size_t chunk_size = 0;
-    for (int i = 0; i < sz_size; ++i) {
-      chunk_size = chunk_size * 16 + HexToNum(*(ptr_beg + i));
+    const char *p = ptr_beg;
+    while (p < line_end && isxdigit(*p)) {
+      chunk_size = chunk_size * 16 + HexToNum(*p++);
+    }
+    // more digits could overflow chunk_size
+    if (p == ptr_beg || p - ptr_beg > MAX_CHUNK_DIGITS) {
+      *done = -1;
+      break;
     }
     if (chunk_size == 0) {
-      return 1;
+      // the trailer fields end with an empty line
+      const char *field = line_end + 2;
+      const char *field_end;
+      while ((field_end = strstr(field, "\r\n"))) {
+        if (field_end == field) {
+          *done = 1;
+          return field_end + 2 - start;
+        }
+        field = field_end + 2;
+      }
+      break;
     }
-    ptr_beg += chunk_size;
+    // chunk-size line, chunk-data and its CRLF, compared as sizes so a
+    // large chunk cannot wrap the pointer around
+    if (chunk_size + 4 > (size_t)(ptr_end - line_end)) {
+      return line_end + 2 - start + chunk_size + 2;
+    }
+    ptr_beg = line_end + 2 + chunk_size + 2;
   }
-  return 0;
+  return ptr_beg - start;
 }
 
 void FreeHTTPREsponse(HTTPResponse *ptr) {
@@ -478,4 +864,409 @@ void FreeHTTPREsponse(HTTPResponse *ptr) {
   if (ptr->status) free(ptr->status);
   if (ptr->date) free(ptr->date);
   if (ptr->size) free(ptr->size);
-}
\ No newline at end of file
+}
+// Find a header in a NUL terminated request or response. Only the header
+// block is searched and header names are case-insensitive.
+// return the header value, and its length in *value_size, NULL if not found
+const char *FindHeader(const char *buffer, const char *name, size_t *value_size) {
+  size_t name_size = strlen(name);
+  const char *line = strstr(buffer, "\r\n"); // skip request/status line
+  while (line) {
+    line += 2;
+    const char *line_end = strstr(line, "\r\n");
+    if (!line_end || line_end == line) { // end of header
+      break;
+    }
+    if (!strncasecmp(line, name, name_size) && line[name_size] == ':') {
+      const char *value = line + name_size + 1;
+      while (value < line_end && (*value == ' ' || *value == '\t')) {
+        ++value;
+      }
+      if (value_size) {
+        *value_size = line_end - value;
+      }
+      return value;
+    }
+    line = line_end;
+  }
+  return NULL;
+}
+
+// A 200 response whose whole Content-Length body has been received
+int IsCompleteResponse(const HTTPResponse *response, size_t size) {
+  return response->status_code == 200 && response->size &&
+    response->header_size + strtoul(response->size, NULL, 10) == size;
+}
+
+// Find a directive of the Cache-Control fields of a message
+// 1. Input:
+//  <1> block
+//  <2> name : e.g. "max-age"
+// 2. Output:
+//  <1> seconds : its delta-seconds argument, -1 if it has none
+//  <2> ret : 1 if the directive is there, 0 otherwise
+static int FindDirective(const HeaderBlock *block, const char *name,
+                         long *seconds) {
+  size_t name_size = strlen(name);
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *span = &block->headers[i];
+    if (span->name_size != 13 || strncasecmp(span->line, "Cache-Control", 13)) {
+      continue;
+    }
+    const char *p = span->value;
+    const char *end = p + span->value_size;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+      const char *item = p;
+      while (p < end && *p != ',' && *p != '=' && *p != ' ' && *p != '\t') ++p;
+      int found = p - item == (long)name_size &&
+        !strncasecmp(item, name, name_size);
+      long value = -1;
+      if (p < end && *p == '=') {
+        // a quoted argument, e.g. no-cache="Set-Cookie", may hold commas
+        if (++p < end && *p == '"') {
+          const char *quote = memchr(p + 1, '"', end - p - 1);
+          p = quote ? quote + 1 : end;
+        } else if (p < end && isdigit(*p)) {
+          for (value = 0; p < end && isdigit(*p); ++p) {
+            value = value < LONG_MAX / 10 ? value * 10 + (*p - '0') : LONG_MAX;
+          }
+        }
+      }
+      while (p < end && *p != ',') ++p;
+      if (found) {
+        if (seconds) {
+          *seconds = value;
+        }
+        return 1;
+      }
+    }
+  }
+  return 0;
+}
+
+// Parse an HTTP date: IMF-fixdate, or the obsolete RFC 850 and asctime forms
+// return the time, -1 if the value is not a date
+static time_t ParseHTTPDate(const char *value, size_t size) {
+  static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+  char date[64], month[4];
+  if (size >= sizeof(date)) {
+    return -1;
+  }
+  memcpy(date, value, size);
+  date[size] = '\0';
+  struct tm tm;
+  memset(&tm, 0, sizeof(tm));
+  int end = 0;
+  // IMF-fixdate, then the obsolete RFC 850 and asctime forms
+  if (sscanf(date, "%*[A-Za-z], %d %3s %d %d:%d:%d GMT%n", &tm.tm_mday, month,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &end) < 6 &&
+      sscanf(date, "%*[A-Za-z], %d-%3s-%d %d:%d:%d GMT%n", &tm.tm_mday, month,
+             &tm.tm_year, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &end) < 6 &&
+      sscanf(date, "%*[A-Za-z] %3s %d %d:%d:%d %d%n", month, &tm.tm_mday,
+             &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &tm.tm_year, &end) < 6) {
+    return -1;
+  }
+  while (tm.tm_mon < 12 && strncasecmp(months + 3 * tm.tm_mon, month, 3)) {
+    ++tm.tm_mon;
+  }
+  if (!end || date[end] || strlen(month) != 3 || tm.tm_mon == 12) {
+    return -1;
+  }
+  // a two digit year of RFC 850 is taken in 1970..2069
+  tm.tm_year += tm.tm_year < 70 ? 100 : tm.tm_year < 100 ? 0 : -1900;
+  return timegm(&tm);
+}
+
+// The date of a field of a response header, -1 if absent or malformed
+static time_t FindDate(const HeaderBlock *block, const char *name) {
+  const HeaderSpan *span = FindHeaderSpan(block, name);
+  return span ? ParseHTTPDate(span->value, span->value_size) : -1;
+}
+
+// Freshness of a response received at now, RFC 9111 4.2 for a shared cache:
+// its lifetime from s-maxage, max-age, Expires, or else the heuristic of a
+// tenth of the time since Last-Modified, less the age it arrived with
+// return the time it turns stale, at most now if it is stale already
+static time_t FreshUntil(const HeaderBlock *block, time_t now) {
+  time_t date = FindDate(block, "Date");
+  if (date < 0 || date > now) {
+    date = now;
+  }
+  long lifetime;
+  time_t expires;
+  time_t modified;
+  if (FindDirective(block, "s-maxage", &lifetime) ||
+      FindDirective(block, "max-age", &lifetime)) {
+    if (lifetime < 0) {
+      return now;  // an argument that is not a number
+    }
+  } else if (FindHeaderSpan(block, "Expires")) {
+    // an invalid date, e.g. 0, means already expired
+    expires = FindDate(block, "Expires");
+    lifetime = expires > date ? expires - date : 0;
+  } else if ((modified = FindDate(block, "Last-Modified")) >= 0) {
+    lifetime = modified < date ? (date - modified) / 10 : 0;
+    if (lifetime > HEURISTIC_MAX_TTL) {
+      lifetime = HEURISTIC_MAX_TTL;
+    }
+  } else {
+    lifetime = DEFAULT_TTL;
+  }
+  long age = now - date;
+  const HeaderSpan *age_span = FindHeaderSpan(block, "Age");
+  if (age_span) {
+    long age_value = strtol(age_span->value, NULL, 10);
+    age = age_value > age ? age_value : age;
+  }
+  return lifetime > age ? now + (lifetime - age) : now;
+}
+
+// Whether the Vary fields of a response name no field but Accept-Encoding,
+// the identity response of a URL is then answered to every browser
+static int VariesByEncodingOnly(const HeaderBlock *block) {
+  for (int i = 0; i < block->nheaders; ++i) {
+    const HeaderSpan *span = &block->headers[i];
+    if (span->name_size != 4 || strncasecmp(span->line, "Vary", 4)) {
+      continue;
+    }
+    const char *p = span->value;
+    const char *end = p + span->value_size;
+    while (p < end) {
+      while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) ++p;
+      const char *item = p;
+      while (p < end && *p != ',' && *p != ' ' && *p != '\t') ++p;
+      if (p > item && !(p - item == 15 &&
+                        !strncasecmp(item, "Accept-Encoding", 15))) {
+        return 0;
+      }
+    }
+  }
+  return 1;
+}
+
+int IsStorable(const char *response_buf, const HTTPResponse *response,
+               int credentials) {
+  HeaderBlock block;
+  if (response->status_code != 200 || !response->size ||
+      !ParseHeaderBlock(response_buf, response->header_size, &block)) {
+    return 0;
+  }
+  // stale answers are never revalidated, a response to revalidate on every
+  // use is fetched again instead
+  if (FindDirective(&block, "no-store", NULL) ||
+      FindDirective(&block, "private", NULL) ||
+      FindDirective(&block, "no-cache", NULL) ||
+      !VariesByEncodingOnly(&block)) {
+    return 0;
+  }
+  // the origin coded the body for the Accept-Encoding of this browser, the
+  // key of the response is answered to every browser
+  const HeaderSpan *encoding = FindHeaderSpan(&block, "Content-Encoding");
+  if (encoding && !(encoding->value_size == 8 &&
+                    !strncasecmp(encoding->value, "identity", 8))) {
+    return 0;
+  }
+  // the answer to a user, or one setting a cookie, is only shared when the
+  // origin says it may be
+  if ((credentials || FindHeaderSpan(&block, "Set-Cookie")) &&
+      !FindDirective(&block, "public", NULL) &&
+      !FindDirective(&block, "s-maxage", NULL)) {
+    return 0;
+  }
+  time_t now = time(NULL);
+  return FreshUntil(&block, now) > now;
+}
+
+int IsCacheable(const char *response_buf, const HTTPResponse *response,
+                size_t size, int credentials) {
+  return IsCompleteResponse(response, size) &&
+    IsStorable(response_buf, response, credentials);
+}
+
+time_t ResponseExpires(const char *response_buf, size_t header_size) {
+  HeaderBlock block;
+  time_t now = time(NULL);
+  if (!ParseHeaderBlock(response_buf, header_size, &block)) {
+    return now;
+  }
+  return FreshUntil(&block, now);
+}
+
+// Parse the value of a Range header against an entity of length bytes
+// 1. Input:
+//  <1> spec : e.g. "bytes=0-499,1000-,-200"
+//  <2> length : entity length
+//  <3> ranges : receives the satisfiable ranges, clamped to the entity
+//  <4> max_ranges : capacity of ranges
+// 2. Output:
+//  <1> ret
+//    - > 0 number of satisfiable ranges
+//    - 0 no range is satisfiable
+//    - -1 the header must be ignored (other unit, malformed e.g. with no
+//      range or a trailing comma, too many ranges)
+int ParseRange(const char *spec, size_t length, ByteRange *ranges, int max_ranges) {
+  if (strncasecmp(spec, "bytes=", 6)) {
+    return -1;
+  }
+  const char *p = spec + 6;
+  char *end;
+  int n = 0;
+  // at least one range-spec, every comma is followed by another one
+  while (1) {
+    while (*p == ' ' || *p == '\t') ++p;
+    size_t first, last;
+    if (*p == '-') { // suffix range: last N bytes
+      if (!isdigit(p[1])) return -1;
+      size_t suffix = strtoull(p + 1, &end, 10);
+      if (!suffix || !length) goto next;
+      first = suffix >= length ? 0 : length - suffix;
+      last = length - 1;
+    } else if (isdigit(*p)) {
+      first = strtoull(p, &end, 10);
+      if (*end != '-') return -1;
+      if (isdigit(end[1])) {
+        last = strtoull(end + 1, &end, 10);
+        if (last < first) return -1;
+      } else {
+        last = length - 1;
+        ++end;
+      }
+      if (first >= length) goto next;
+      if (last >= length) last = length - 1;
+    } else {
+      return -1;
+    }
+    if (n == max_ranges) return -1;
+    ranges[n].first = first;
+    ranges[n].last = last;
+    ++n;
+next:
+    p = end;
+    while (*p == ' ' || *p == '\t') ++p;
+    if (*p != ',') {
+      break;
+    }
+    ++p;
+  }
+  return *p ? -1 : n;
+}
+
+// Whether the If-Range of a request names the response of block: a strong
+// entity tag equal to its ETag, or a date equal to its Last-Modified
+static int IfRangeMatches(const HeaderBlock *block, const char *if_range) {
+  size_t size = strlen(if_range);
+  // a weak tag starts with W/, here or from the origin, so it never matches
+  const HeaderSpan *validator = FindHeaderSpan(block,
+    if_range[0] == '"' ? "ETag" : "Last-Modified");
+  return validator && validator->value_size == size &&
+    !memcmp(validator->value, if_range, size);
+}
+
+int BuildRangeResponse(const char *response, size_t size, size_t header_size,
+                       const char *range, const char *if_range, int keep_alive,
+                       struct iovec *iov, int *iovcnt, char **owned) {
+  size_t length = size - header_size;
+  const char *body = response + header_size;
+  *iovcnt = 0;
+  *owned = NULL;
+  HeaderBlock block;
+  if (!ParseHeaderBlock(response, header_size, &block)) {
+    return 0;
+  }
+  ByteRange ranges[MAX_RANGES];
+  int n = if_range && !IfRangeMatches(&block, if_range) ? -1 :
+    ParseRange(range, length, ranges, MAX_RANGES);
+  if (n < 0) {
+    // the full response goes out as it is cached, the identity answer
+    *iovcnt = BuildClientHeader(&block, keep_alive,
+                                NeedsEncodingVary(&block, length), iov);
+    iov[*iovcnt].iov_base = (char *)body;
+    iov[*iovcnt].iov_len = length;
+    ++*iovcnt;
+    return 1;
+  }
+
+  const HeaderSpan *type = FindHeaderSpan(&block, "Content-Type");
+  size_t type_size = type ? type->value_size : 0;
+  const char *connection = keep_alive ? "keep-alive" : "close";
+  // the answer header, then the part headers and the closing boundary
+  size_t part_header_max = type_size + 128;
+  char *header = *owned =
+    Malloc(header_size + MAXLINE + n * part_header_max + 64);
+  size_t hsize = 0;
+  if (n == 0) {
+    hsize = sprintf(header, "HTTP/1.1 416 Range Not Satisfiable\r\n"
+                    "Content-Range: bytes */%zu\r\n"
+                    "Content-Length: 0\r\n%sConnection: %s\r\n\r\n",
+                    length, ViaLine(&block), connection);
+    iov[0].iov_base = header;
+    iov[0].iov_len = hsize;
+    *iovcnt = 1;
+    return 1;
+  }
+
+  // keep the end-to-end origin headers except the ones describing the full
+  // entity
+  hsize = sprintf(header, "HTTP/1.1 206 Partial Content\r\n");
+  for (int i = 0; i < block.nheaders; ++i) {
+    const HeaderSpan *field = &block.headers[i];
+    if (!IsHopByHop(&block, field) &&
+        strncasecmp(field->line, "Content-Length:", 15) &&
+        strncasecmp(field->line, "Content-Range:", 14) &&
+        (n == 1 || strncasecmp(field->line, "Content-Type:", 13))) {
+      memcpy(header + hsize, field->line, field->line_size);
+      hsize += field->line_size;
+    }
+  }
+  hsize += sprintf(header + hsize, "%sConnection: %s\r\n", ViaLine(&block),
+                   connection);
+
+  if (n == 1) {
+    size_t part_size = ranges[0].last - ranges[0].first + 1;
+    hsize += sprintf(header + hsize, "Content-Range: bytes %zu-%zu/%zu\r\n"
+                     "Content-Length: %zu\r\n\r\n",
+                     ranges[0].first, ranges[0].last, length, part_size);
+    iov[0].iov_base = header;
+    iov[0].iov_len = hsize;
+    iov[1].iov_base = (char *)body + ranges[0].first;
+    iov[1].iov_len = part_size;
+    *iovcnt = 2;
+    return 1;
+  }
+
+  // multipart/byteranges: format every part header first to get the length
+  char boundary[40];
+  snprintf(boundary, sizeof(boundary), "%08lx%08lx",
+           (unsigned long)time(NULL), (unsigned long)random());
+  char *part = header + header_size + MAXLINE;
+  size_t content_size = 0;
+  for (int i = 0; i < n; ++i) {
+    size_t part_size = sprintf(part, "\r\n--%s\r\n", boundary);
+    if (type) {
+      part_size += sprintf(part + part_size, "Content-Type: %.*s\r\n",
+                           (int)type_size, type->value);
+    }
+    part_size += sprintf(part + part_size,
+                         "Content-Range: bytes %zu-%zu/%zu\r\n\r\n",
+                         ranges[i].first, ranges[i].last, length);
+    iov[1 + 2 * i].iov_base = part;
+    iov[1 + 2 * i].iov_len = part_size;
+    iov[2 + 2 * i].iov_base = (char *)body + ranges[i].first;
+    iov[2 + 2 * i].iov_len = ranges[i].last - ranges[i].first + 1;
+    content_size += part_size + iov[2 + 2 * i].iov_len;
+    part += part_size;
+  }
+  size_t trailer_size = sprintf(part, "\r\n--%s--\r\n", boundary);
+  iov[1 + 2 * n].iov_base = part;
+  iov[1 + 2 * n].iov_len = trailer_size;
+  content_size += trailer_size;
+
+  hsize += sprintf(header + hsize,
+                   "Content-Type: multipart/byteranges; boundary=%s\r\n"
+                   "Content-Length: %zu\r\n\r\n", boundary, content_size);
+  iov[0].iov_base = header;
+  iov[0].iov_len = hsize;
+  *iovcnt = 2 + 2 * n;
+  return 1;
+}
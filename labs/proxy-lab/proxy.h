@@ -0,0 +1,235 @@
+#ifndef __PROXY_H__
+#define __PROXY_H__
+#include "xnix_helper.h"
+#include "cache.h"
+#include "sbuf.h"
+#include "limit.h"
+#include <strings.h>
+#include <sys/uio.h>
+
+#define MAXLINE 8192
+#define MAX_RANGES 16
+#define MAX_HEADERS 64                // fields of a header block, see header.h
+// segments of a rewritten header and its body, or of a multipart/byteranges
+// answer
+#define MAX_IOV (MAX_HEADERS + 2 * MAX_RANGES + 8)
+#define READ_BUF_SIZE 16384
+#define MAX_REQUEST_SIZE 65536        // bytes of a request header
+#define MAX_CHUNK_DIGITS 15           // hex digits of a chunk size
+#define MAX_CPUS 1024
+#define HEADER_TIMEOUT 30000          // ms to wait for a response header
+#define DATA_TIMEOUT 3000             // ms to wait for more request/response data
+#define CONNECT_TIMEOUT 3000          // ms to connect to an origin address
+
+typedef struct {
+  char *path;
+  char *host;
+  char *port;
+  char *connection;
+  char *range;
+  char *if_range;
+  size_t buffer_size;     // bytes charged to the buffered-bytes limit
+  int error_status;       // status to answer with when parsing fails
+}HTTPRequest;
+
+// Receiving state of a response, see RecvHostResponse()
+typedef enum {
+  WAIT_FOR_HEADER = 0,
+  PROCESS_HEADER = 1,
+  KNOW_CONTENT_LENGTH = 2,
+  CHUNKED_TRANS = 3,
+  RESPONSE_DONE = 4
+}ResponseState;
+
+typedef struct {
+  char *status;
+  char *date;
+  char *size;
+  int status_code;
+  size_t header_size;     // status line + headers + blank line
+  size_t buffer_size;     // bytes charged to the buffered-bytes limit
+  int error_status;       // status to answer with when receiving fails
+  char *buf;              // raw response received so far, NUL terminated
+  size_t buf_offset;      // response bytes dropped before buf[0]
+  size_t rec_size;        // bytes of the response received
+  size_t total_size;      // header + Content-Length, 0 if not known
+  size_t chunk_pos;       // offset of the next chunk-size line, past rec_size
+                          // while the data of a chunk is received
+  ResponseState state;
+}HTTPResponse;
+
+typedef struct {
+  size_t first;
+  size_t last;
+}ByteRange;
+
+// Admission control, a limit of 0 means unlimited except for max_conns
+typedef struct {
+  int threads;            // worker threads
+  size_t max_conns;       // browser connections being served or queued
+  size_t max_origin;      // requests in flight to origin servers
+  size_t max_buffered;    // bytes of request/response buffers
+  int reject_overload;    // answer 503 instead of delaying accept()
+  const char *cpu_list;   // pin worker i to the i-th CPU of the list
+  size_t quantum;         // bytes a relay may send per scheduling round
+  size_t client_rate;     // bytes per second per client address, 0 = unlimited
+  int prefetch_threads;   // pages prefetched concurrently, 0 = no prefetch
+  size_t prefetch_budget; // bytes prefetched per HTML page
+  int upstream_minor;     // requests to origins are HTTP/1.upstream_minor,
+                          // HTTP/1.0 for an HTTP/1.0 browser
+  const char *restart_path; // control socket for hot restart, NULL = none
+  const char *log_path;   // object log persisting the cache, NULL = none
+  const char *trace_path; // trace dump written on SIGUSR1, NULL = no tracing
+  int log_level;          // LOG_ERROR to LOG_DEBUG, see xnix_helper.h
+  int compress_threads;   // responses gzipped concurrently, 0 = no compression
+  long request_timeout;   // ms from a request to its response header
+}ProxyConfig;
+
+struct Relay;
+struct IdleConn;
+
+// A worker owns the connections dispatched to it until they are closed, so
+// a pinned worker keeps its connections on one core. Its read buffer and
+// the objects it caches are first touched after pinning and so live on the
+// NUMA node of that core.
+typedef struct {
+  int cpu;                // -1 if not pinned
+  Cache *cache;           // cache shard of its NUMA node
+  sbuf_t queue;           // connections dispatched to this worker
+  int wake_fd[2];         // a byte is written to wake_fd[1] on dispatch
+  int nconns;             // queued and active connections
+  char *read_buf;         // READ_BUF_SIZE bytes
+  struct Relay *relays;   // responses being relayed, in round-robin order
+  struct IdleConn *idle;  // connections waiting for their next request
+}WorkerCtx;
+
+extern ProxyConfig config;
+extern Limiter conn_limit;
+extern Limiter origin_limit;
+extern Limiter buffered_limit;
+extern volatile int draining; // handed off to a new proxy, finish and exit
+extern struct ObjLog *object_log; // NULL if the cache is not persisted
+
+void InitHTTPRequest(HTTPRequest *ptr);
+void FreeHTTPRequest(HTTPRequest *ptr);
+int HTTPRequestParser(const char *buffer, HTTPRequest *request);
+
+void InitHTTPResponse(HTTPResponse *ptr);
+void FreeHTTPREsponse(HTTPResponse *ptr);
+
+// Read the header of a browser request into a view and parse it in place.
+// Only what the socket holds is read, so a non-blocking socket never
+// blocks. The view buffer is charged to the buffered-bytes limit in
+// request->buffer_size, both are handed back with FreeRequestView().
+// 1. Input:
+//  <1> view : of the browser socket, growing up to MAX_REQUEST_SIZE
+//  <2> request : set up with InitHTTPRequest() before the first call
+// 2. Output:
+//  <1> size : bytes of the request header, which rio_viewpeek() points to
+//  <2> ret
+//    - 1 the header is complete and parsed
+//    - 0 more data is needed
+//    - -1 failure, request->error_status is set if the browser is answered
+int ReadBroswerRequest(rio_view_t *view, size_t *size, HTTPRequest *request);
+// Free the view a request was read into and its buffered bytes
+void FreeRequestView(rio_view_t *view, HTTPRequest *request);
+int ForwardBroswerRequest(int sock_fd, const char *request, size_t size);
+
+// Receive the next part of a response, without blocking longer than timeout.
+// The response must have been set up with InitHTTPResponse(); the data is
+// appended to response->buf and response->state reaches RESPONSE_DONE once
+// the whole response has been received.
+// 1. Input:
+//  <1> sock_fd
+//  <2> read_buf : scratch buffer of at least max_bytes
+//  <3> max_bytes : receive at most max_bytes
+//  <4> timeout : in ms, same as SocketRecv()
+//  <5> response
+// 2. Output:
+//  <1> ret
+//    - 1 some data was received
+//    - 0 timeout
+//    - -1 failure, response->error_status is set
+int RecvHostResponse(int sock_fd, char *read_buf, size_t max_bytes, int timeout,
+                     HTTPResponse *response);
+// Same as RecvHostResponse() on bytes already received, e.g. from a buffer
+// 1. Input:
+//  <1> response
+//  <2> data, size : the next bytes of the response
+// 2. Output:
+//  <1> ret : 1 on success, -1 on failure with response->error_status set
+int FeedHostResponse(HTTPResponse *response, const char *data, size_t size);
+// Drop the received bytes before offset from response->buf, once they have
+// been relayed and the response is not kept whole. Offsets into the response
+// are unchanged, buf then starts at response->buf_offset.
+// 1. Input:
+//  <1> response : its header must have been received
+//  <2> offset : at most response->rec_size, and not past chunk_pos for a
+//      chunked body that is still being received
+void DropResponseData(HTTPResponse *response, size_t offset);
+// Grow the buffer of a response to its whole length at once, so a response
+// that is kept whole never fails for memory once its body is received
+// 1. Input:
+//  <1> response : its header must have been received, with a Content-Length
+// 2. Output:
+//  <1> ret : 1 on success, 0 if the buffered-bytes limit would be exceeded
+int ReserveResponse(HTTPResponse *response);
+// Receive a whole response, blocking
+// return response->buf, NULL on failure with response->error_status set
+char *GetHostResponse(int sock_fd, char *read_buf, size_t *rec_size,
+                      HTTPResponse *response);
+int ForwardHostResponse(int sock_fd, const char *response, size_t size);
+
+const char *FindHeader(const char *buffer, const char *name, size_t *value_size);
+int IsCompleteResponse(const HTTPResponse *response, size_t size);
+// A 200 response with a Content-Length that the cache may store once it is
+// complete, known from its header alone. It is not stored if:
+//  - Cache-Control has no-store, private or no-cache, stale objects are
+//    dropped rather than revalidated
+//  - Vary names a field other than Accept-Encoding
+//  - the origin content-coded the body
+//  - the request carried credentials, or the response sets a cookie, and
+//    Cache-Control has neither public nor s-maxage
+//  - it is stale already, see ResponseExpires()
+// 1. Input:
+//  <1> response_buf, response : the response, its header received
+//  <2> credentials : the request carried Authorization or Cookie
+int IsStorable(const char *response_buf, const HTTPResponse *response,
+               int credentials);
+int IsCacheable(const char *response_buf, const HTTPResponse *response,
+                size_t size, int credentials);
+
+// When a response received now turns stale: its lifetime from s-maxage,
+// max-age or Expires, else a tenth of the time since Last-Modified up to
+// HEURISTIC_MAX_TTL, else DEFAULT_TTL, less the age it arrived with
+// return the time, at most now for a stale or malformed response
+time_t ResponseExpires(const char *response_buf, size_t header_size);
+int ParseRange(const char *spec, size_t length, ByteRange *ranges, int max_ranges);
+
+// Build the answer to a Range request from a complete 200 response.
+// A single range is sent as a 206 with Content-Range, several ranges as a
+// multipart/byteranges body. Unsatisfiable ranges get a 416, and a Range
+// header that cannot be used, or an If-Range that does not match, falls
+// back to the full response. If-Range matches a strong ETag of the
+// response, or its Last-Modified date exactly. The origin header is
+// rewritten as BuildClientHeader() does.
+// 1. Input:
+//  <1> response, size, header_size : the complete response
+//  <2> range : value of the Range header
+//  <3> if_range : value of the If-Range header, NULL if none
+//  <4> keep_alive : whether the browser connection is reused
+// 2. Output:
+//  <1> iov, iovcnt : at most MAX_IOV segments to send, pointing into
+//      response and *owned
+//  <2> owned : headers built for the answer, the caller frees it
+//  <3> ret : 1 on success, 0 if the origin header cannot be parsed
+int BuildRangeResponse(const char *response, size_t size, size_t header_size,
+                       const char *range, const char *if_range, int keep_alive,
+                       struct iovec *iov, int *iovcnt, char **owned);
+
+char *BufferAlloc(size_t size);
+char *BufferGrow(char *buf, size_t old_size, size_t new_size);
+void BufferFree(char *buf, size_t size);
+
+void ClientError(int sock_fd, int status);
+#endif
@@ -0,0 +1,1060 @@
+#include "relay.h"
+#include "affinity.h"
+#include "prefetch.h"
+#include "header.h"
+#include "objlog.h"
+#include "compress.h"
+#include "trace.h"
+#include "breaker.h"
+#include "resolve.h"
+
+#define IDLE_TIMEOUT 3000   // ms a keep-alive connection may wait for a request
+#define SEND_TIMEOUT 30000  // ms a browser may stop reading a response
+#define RELAY_WINDOW 4      // quanta received ahead of the browser
+
+// Bandwidth limit shared by the connections of one browser address
+typedef struct ClientRate {
+  char addr[INET6_ADDRSTRLEN];
+  TokenBucket bucket;
+  int refcnt;                 // relays using the limit
+  struct ClientRate *next;
+} ClientRate;
+
+// Keep-alive connection waiting for its next request
+typedef struct IdleConn {
+  int fd;
+  int slot;                   // entry of the poll set, -1 if not watched
+  long deadline;
+  struct IdleConn *next;
+} IdleConn;
+
+// Stages of a relay, none of them blocks the worker
+typedef enum {
+  RELAY_READ_REQUEST,   // the request header is read from the browser
+  RELAY_RESOLVE,        // the origin name is looked up by a resolver thread
+  RELAY_CONNECT,        // connecting to an origin address
+  RELAY_SEND_REQUEST,   // the request header is sent to the origin
+  RELAY_RESPONSE        // the response is relayed to the browser
+} RelayStage;
+
+// A request of a browser and the response relayed to it. The request
+// header is read into a view and forwarded from there, the view is freed
+// once the request is answered from the cache or forwarded.
+// A response from the origin is
+// streamed to the browser while it is received, unless it must be complete
+// to answer a Range request. Such a request asks the origin for the whole
+// object to cache it and cut the ranges; when the header shows the object
+// cannot be cached, the ranges are asked for again with the Range of the
+// browser and the answer is streamed. The answer is sent as segments pointing into
+// the received response or the cache object: the rewritten header, then the
+// body, which is response.buf past sent when streaming. A streamed response
+// that cannot be cached is only buffered up to the browser: the bytes it was
+// sent are dropped from response.buf.
+typedef struct Relay {
+  RelayStage stage;
+  int broswer_fd;
+  int host_fd;                // -1 once the whole response is received
+  int origin_held;            // an origin_limit slot is held
+  rio_view_t view;            // the request header until it is forwarded
+  size_t request_size;        // bytes of the request header in view
+  ResolveJob *resolve;        // lookup of the origin while resolving
+  struct addrinfo *addrs;     // origin addresses
+  struct addrinfo *addr;      // address being connected to
+  struct iovec request_iov[MAX_HEADER_IOV]; // request header to send
+  int request_iovcnt;
+  char *scratch;              // lines added to the request header
+  HTTPRequest request;
+  HTTPResponse response;
+  char *cache_key;            // NULL on cache hit
+  int http11;                 // the browser speaks HTTP/1.1
+  int keep_alive;             // the browser connection is reused afterwards
+  int streaming;              // send response.buf while it is received
+  int keep_body;              // keep the whole response in response.buf
+  int forward_range;          // Range goes to the origin, nothing is cached
+  int credentials;            // the request has Authorization or Cookie
+  size_t sent;                // bytes of response.buf sent when streaming
+  char *header_buf;           // response.buf the header segments point into
+  CacheObject *obj;           // cache object the segments point into
+  struct iovec iov[MAX_IOV];  // segments to send
+  int iovcnt;
+  int iov_index;              // first segment not completely sent
+  char *owned;                // headers built for a Range answer
+  size_t deficit;             // DRR deficit counter in bytes
+  size_t bytes_out;           // bytes sent to the browser
+  ClientRate *rate;           // NULL if the browser is not rate limited
+  long deadline;              // fail the relay if it makes no progress
+  long request_deadline;      // the response header must be received by then
+  int responded;              // the origin sent a response header
+  int error_status;           // status to answer with when the relay fails
+  int host_slot;              // entries of this round's poll set, -1 if the
+  int broswer_slot;           // descriptor is not watched
+  struct Relay *next;
+} Relay;
+
+static ClientRate *client_rates = NULL;
+static pthread_mutex_t client_rates_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void AddIdle(WorkerCtx *ctx, int fd);
+static void CloseConnection(WorkerCtx *ctx, int fd);
+static int PeerAddress(int fd, char *name, size_t size);
+static ClientRate *GetClientRate(int fd);
+static void PutClientRate(ClientRate *rate);
+static void StartRelay(WorkerCtx *ctx, int broswer_fd, int slot);
+static int ReadRequest(WorkerCtx *ctx, Relay *relay, long now);
+static int StartRequest(WorkerCtx *ctx, Relay *relay);
+static int Resolved(WorkerCtx *ctx, Relay *relay, long now);
+static int ConnectOrigin(Relay *relay, long now);
+static int Connected(Relay *relay, long now);
+static int BuildRequest(Relay *relay);
+static int SendRequest(Relay *relay);
+static int CheckRangeOrigin(WorkerCtx *ctx, Relay *relay, long now);
+static int RefetchRange(Relay *relay, long now);
+static void AddRelay(WorkerCtx *ctx, Relay *relay);
+static void EndRelay(WorkerCtx *ctx, Relay *relay, int keep_alive);
+static void FailRelay(WorkerCtx *ctx, Relay *relay);
+static long HeaderDeadline(const Relay *relay, long now);
+static int ClientKeepAlive(const HeaderBlock *block, int *http11);
+static int SkipsCache(const HeaderBlock *block);
+static int BuildAnswer(Relay *relay, const char *data, size_t header_size,
+                       size_t size);
+static int HostDone(WorkerCtx *ctx, Relay *relay);
+static int StartStreaming(Relay *relay);
+static int HasPending(const Relay *relay);
+static void DropSent(Relay *relay);
+static ssize_t RelaySend(Relay *relay, size_t budget);
+static int WatchFd(struct pollfd *fds, nfds_t *nfds, int fd, short events);
+static int IsReady(const struct pollfd *fds, int slot);
+static int RunRelay(WorkerCtx *ctx, Relay *relay, const struct pollfd *fds,
+                    long now);
+
+void *Worker(void *vargp) {
+  WorkerCtx *ctx = vargp;
+  pthread_detach(pthread_self());
+  if (ctx->cpu >= 0 && PinThreadToCpu(ctx->cpu) < 0) {
+    LogWarn("Worker: cannot pin to cpu %d\n", ctx->cpu);
+  }
+  // allocated and touched after pinning, so the pages are node-local
+  ctx->read_buf = Malloc(READ_BUF_SIZE);
+  memset(ctx->read_buf, 0, READ_BUF_SIZE);
+
+  struct pollfd *fds = NULL;  // poll set, grown with the connections
+  size_t max_fds = 0;
+  while (1) {
+    size_t need = 1;
+    for (IdleConn *conn = ctx->idle; conn; conn = conn->next) {
+      ++need;
+    }
+    for (Relay *relay = ctx->relays; relay; relay = relay->next) {
+      need += 2;
+    }
+    if (need > max_fds) {
+      max_fds = 2 * need;
+      fds = Realloc(fds, max_fds * sizeof(struct pollfd));
+    }
+
+    nfds_t nfds = 0;
+    int wake_slot = WatchFd(fds, &nfds, ctx->wake_fd[0], POLLIN);
+    long now = NowMs();
+    long wake = -1; // earliest deadline, -1 if none
+
+    for (IdleConn *conn = ctx->idle; conn; conn = conn->next) {
+      conn->slot = WatchFd(fds, &nfds, conn->fd, POLLIN);
+      wake = wake < 0 || conn->deadline < wake ? conn->deadline : wake;
+    }
+    for (Relay *relay = ctx->relays; relay; relay = relay->next) {
+      relay->host_slot = relay->broswer_slot = -1;
+      wake = wake < 0 || relay->deadline < wake ? relay->deadline : wake;
+      if (relay->stage == RELAY_READ_REQUEST) {
+        relay->broswer_slot = WatchFd(fds, &nfds, relay->broswer_fd, POLLIN);
+        continue;
+      } else if (relay->stage == RELAY_RESOLVE) {
+        continue;  // the resolver writes to the wake pipe
+      } else if (relay->stage != RELAY_RESPONSE) {
+        relay->host_slot = WatchFd(fds, &nfds, relay->host_fd, POLLOUT);
+        continue;
+      }
+      // a streamed response is received at most RELAY_WINDOW quanta ahead
+      // of the browser, a slow browser slows down its origin only
+      if (relay->host_fd >= 0 && (!relay->streaming ||
+          relay->response.rec_size - relay->sent < RELAY_WINDOW * config.quantum)) {
+        relay->host_slot = WatchFd(fds, &nfds, relay->host_fd, POLLIN);
+      }
+      if (HasPending(relay)) {
+        long wait = relay->rate ? TokenBucketWait(&relay->rate->bucket) : 0;
+        if (wait) {
+          wake = wake < 0 || now + wait < wake ? now + wait : wake;
+        } else {
+          relay->broswer_slot =
+            WatchFd(fds, &nfds, relay->broswer_fd, POLLOUT);
+        }
+      }
+    }
+
+    int timeout = -1;
+    if (wake >= 0) {
+      timeout = wake > now ? wake - now : 0;
+    }
+    if (poll(fds, nfds, timeout) < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      unix_error("Worker: poll");
+    }
+    now = NowMs();
+
+    IdleConn **conn_ptr = &ctx->idle;
+    while (*conn_ptr) {
+      IdleConn *conn = *conn_ptr;
+      if (IsReady(fds, conn->slot)) {
+        *conn_ptr = conn->next;
+        StartRelay(ctx, conn->fd, conn->slot);
+        Free(conn);
+      } else if (draining || now >= conn->deadline) {
+        LogDebug("Worker: keep-alive connection timeout\n");
+        *conn_ptr = conn->next;
+        CloseConnection(ctx, conn->fd);
+        Free(conn);
+      } else {
+        conn_ptr = &conn->next;
+      }
+    }
+
+    // one DRR round: every relay that can make progress gets one quantum
+    Relay **relay_ptr = &ctx->relays;
+    while (*relay_ptr) {
+      Relay *relay = *relay_ptr;
+      int ret = RunRelay(ctx, relay, fds, now);
+      if (ret == 1) {
+        relay_ptr = &relay->next;
+        continue;
+      }
+      *relay_ptr = relay->next;
+      if (ret == 0) {
+        Trace(relay->broswer_fd, TRACE_LAST_BYTE);
+        EndRelay(ctx, relay, relay->keep_alive && !draining);
+      } else {
+        FailRelay(ctx, relay);
+      }
+    }
+    // the next round starts with the next relay
+    if (ctx->relays && ctx->relays->next) {
+      Relay *first = ctx->relays;
+      ctx->relays = first->next;
+      first->next = NULL;
+      AddRelay(ctx, first);
+    }
+
+    // new connections last, their descriptors are not in this round's set
+    if (IsReady(fds, wake_slot)) {
+      char drain[64];
+      if (read(ctx->wake_fd[0], drain, sizeof(drain)) < 0) {
+        unix_error("Worker: read wake pipe");
+      }
+      int fd;
+      while (sbuf_tryremove(&ctx->queue, &fd)) {
+        SetSockNonBlocking(fd);
+        AddIdle(ctx, fd);
+      }
+    }
+  }
+  return NULL;
+}
+
+// Add a descriptor to the poll set of the round
+// return its slot
+static int WatchFd(struct pollfd *fds, nfds_t *nfds, int fd, short events) {
+  fds[*nfds].fd = fd;
+  fds[*nfds].events = events;
+  fds[*nfds].revents = 0;
+  return (*nfds)++;
+}
+
+// Whether the descriptor of a slot is ready, or in error
+static int IsReady(const struct pollfd *fds, int slot) {
+  return slot >= 0 && fds[slot].revents;
+}
+
+static void AddIdle(WorkerCtx *ctx, int fd) {
+  IdleConn *conn = Malloc(sizeof(IdleConn));
+  conn->fd = fd;
+  conn->slot = -1;
+  conn->deadline = NowMs() + IDLE_TIMEOUT;
+  conn->next = ctx->idle;
+  ctx->idle = conn;
+}
+
+static void CloseConnection(WorkerCtx *ctx, int fd) {
+  Trace(fd, TRACE_CLOSE);
+  Close(fd);
+  __sync_fetch_and_sub(&ctx->nconns, 1);
+  LimiterRelease(&conn_limit, 1);
+}
+
+// Format the address of the peer of a socket
+// return 0 on success, -1 on failure
+static int PeerAddress(int fd, char *name, size_t size) {
+  struct sockaddr_storage addr;
+  socklen_t addr_len = sizeof(addr);
+  if (getpeername(fd, (struct sockaddr *)&addr, &addr_len) < 0) {
+    return -1;
+  }
+  const void *in_addr = addr.ss_family == AF_INET6 ?
+    (void *)&((struct sockaddr_in6 *)&addr)->sin6_addr :
+    (void *)&((struct sockaddr_in *)&addr)->sin_addr;
+  return inet_ntop(addr.ss_family, in_addr, name, size) ? 0 : -1;
+}
+
+// Find or create the bandwidth limit of the address of a browser
+// return NULL if the bandwidth is not limited
+static ClientRate *GetClientRate(int fd) {
+  if (!config.client_rate) {
+    return NULL;
+  }
+  char name[INET6_ADDRSTRLEN];
+  if (PeerAddress(fd, name, sizeof(name)) < 0) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&client_rates_lock);
+  ClientRate *rate = client_rates;
+  while (rate && strcmp(rate->addr, name)) {
+    rate = rate->next;
+  }
+  if (!rate) {
+    rate = Malloc(sizeof(ClientRate));
+    strcpy(rate->addr, name);
+    // one second of traffic may be sent at once
+    TokenBucketInit(&rate->bucket, config.client_rate, config.client_rate);
+    rate->refcnt = 0;
+    rate->next = client_rates;
+    client_rates = rate;
+  }
+  ++rate->refcnt;
+  pthread_mutex_unlock(&client_rates_lock);
+  return rate;
+}
+
+static void PutClientRate(ClientRate *rate) {
+  pthread_mutex_lock(&client_rates_lock);
+  if (--rate->refcnt == 0) {
+    ClientRate **pp = &client_rates;
+    while (*pp != rate) {
+      pp = &(*pp)->next;
+    }
+    *pp = rate->next;
+    TokenBucketDeinit(&rate->bucket);
+    Free(rate);
+  }
+  pthread_mutex_unlock(&client_rates_lock);
+}
+
+// Whether the browser connection is kept open after the response: by
+// default with HTTP/1.1, only if asked for with HTTP/1.0
+static int ClientKeepAlive(const HeaderBlock *block, int *http11) {
+  *http11 = block->start_line_size >= 8 &&
+    !strncmp(block->start_line + block->start_line_size - 8, "HTTP/1.1", 8);
+  const HeaderSpan *connection = FindHeaderSpan(block, "Connection");
+  if (!connection) { // sent by old browsers instead
+    connection = FindHeaderSpan(block, "Proxy-Connection");
+  }
+  if (connection && HeaderHasToken(connection, "close")) {
+    return 0;
+  }
+  return *http11 || (connection && HeaderHasToken(connection, "keep-alive"));
+}
+
+// Whether a browser request asks for an answer from the origin: Cache-Control
+// no-cache, or the Pragma of HTTP/1.0
+static int SkipsCache(const HeaderBlock *block) {
+  const HeaderSpan *cc = FindHeaderSpan(block, "Cache-Control");
+  const HeaderSpan *pragma = FindHeaderSpan(block, "Pragma");
+  return (cc && HeaderHasToken(cc, "no-cache")) ||
+    (!cc && pragma && HeaderHasToken(pragma, "no-cache"));
+}
+
+// Set the segments of the answer: the rewritten header of data, then its
+// body up to size
+// return 1 on success, 0 if the header cannot be parsed
+static int BuildAnswer(Relay *relay, const char *data, size_t header_size,
+                       size_t size) {
+  HeaderBlock block;
+  if (!ParseHeaderBlock(data, header_size, &block)) {
+    LogDebug("Relay: malformed response header\n");
+    return 0;
+  }
+  // a streamed answer is built before its body came, its Content-Length
+  // gives the size. The value is followed by its line break.
+  const HeaderSpan *length = FindHeaderSpan(&block, "Content-Length");
+  size_t body_size = length ? strtoul(length->value, NULL, 10) : 0;
+  relay->iovcnt = BuildClientHeader(&block, relay->keep_alive,
+                                    NeedsEncodingVary(&block, body_size),
+                                    relay->iov);
+  relay->iov_index = 0;
+  if (size > header_size) {
+    relay->iov[relay->iovcnt].iov_base = (char *)data + header_size;
+    relay->iov[relay->iovcnt].iov_len = size - header_size;
+    ++relay->iovcnt;
+  }
+  return 1;
+}
+
+// Start reading the next request of a browser, its relay goes in this
+// round with the poll set entry of the browser, known to be readable
+static void StartRelay(WorkerCtx *ctx, int broswer_fd, int slot) {
+  LogDebug("Waiting for broswer request...\n");
+  long now = NowMs();
+  Relay *relay = Calloc(1, sizeof(Relay));
+  relay->stage = RELAY_READ_REQUEST;
+  relay->broswer_fd = broswer_fd;
+  relay->host_fd = -1;
+  relay->host_slot = -1;
+  relay->broswer_slot = slot;
+  rio_viewinit(&relay->view, broswer_fd, MAX_REQUEST_SIZE);
+  InitHTTPRequest(&relay->request);
+  InitHTTPResponse(&relay->response);
+  relay->request_deadline = now + config.request_timeout;
+  relay->deadline = now + DATA_TIMEOUT;
+  relay->rate = GetClientRate(broswer_fd);
+  AddRelay(ctx, relay);
+}
+
+// Read what the browser sent of its request header
+// return 1 if the relay goes on, -1 if it failed
+static int ReadRequest(WorkerCtx *ctx, Relay *relay, long now) {
+  switch (ReadBroswerRequest(&relay->view, &relay->request_size,
+                             &relay->request)) {
+    case 0:
+      relay->deadline = now + DATA_TIMEOUT;
+      return 1;
+
+    case -1:
+      relay->error_status = relay->request.error_status;
+      return -1;
+  }
+  LogDebug("Request: host=%s port=%s path=%s\n", relay->request.host,
+           relay->request.port, relay->request.path);
+  return StartRequest(ctx, relay);
+}
+
+// The request header is complete: answer it from the cache, or start
+// looking up its origin
+// return 1 if the relay goes on, -1 if it failed
+static int StartRequest(WorkerCtx *ctx, Relay *relay) {
+  HTTPRequest *request = &relay->request;
+  const char *request_buf;
+  size_t data_size = rio_viewpeek(&relay->view, &request_buf);
+  HeaderBlock block;
+  if (!ParseHeaderBlock(request_buf, relay->request_size, &block)) {
+    relay->error_status = 400;
+    return -1;
+  }
+  relay->keep_alive = ClientKeepAlive(&block, &relay->http11) && !draining;
+  // pipelined requests are not relayed, the connection ends after this one
+  if (data_size > relay->request_size) {
+    relay->keep_alive = 0;
+  }
+
+  relay->credentials = FindHeaderSpan(&block, "Authorization") ||
+    FindHeaderSpan(&block, "Cookie");
+  // the response of a bypassing request still replaces the cached one
+  int lookup = !SkipsCache(&block);
+
+  char cache_key[MAXLINE];
+  MakeCacheKey(cache_key, MAXLINE, request->host, request->port, request->path);
+  CacheObject *obj = NULL;
+  // a range is always cut from the identity response
+  if (lookup && !request->range && AcceptsGzip(&block)) {
+    char gzip_key[MAXLINE];
+    MakeGzipKey(gzip_key, MAXLINE, cache_key);
+    obj = CacheLookup(ctx->cache, gzip_key);
+  }
+  if (lookup && !obj) {
+    obj = CacheLookup(ctx->cache, cache_key);
+  }
+  if (lookup && !obj && object_log) {
+    // logged by this proxy or a previous one, paged in on first use
+    obj = ObjLogLoad(object_log, ctx->cache, cache_key);
+    // its gzip variant is not logged, it is made again
+    if (obj) {
+      CompressCached(ctx->cache, cache_key);
+    }
+  }
+  relay->obj = obj;
+  if (obj) {
+    LogDebug("Cache hit: %s\n", cache_key);
+    Trace(relay->broswer_fd, TRACE_CACHE_HIT);
+    FreeRequestView(&relay->view, request);
+    int built = request->range ?
+      BuildRangeResponse(obj->data, obj->size, obj->header_size, request->range,
+                         request->if_range, relay->keep_alive, relay->iov,
+                         &relay->iovcnt, &relay->owned) :
+      BuildAnswer(relay, obj->data, obj->header_size, obj->size);
+    if (!built) {
+      relay->error_status = 502;
+      return -1;
+    }
+    relay->stage = RELAY_RESPONSE;
+    relay->deadline = NowMs() + SEND_TIMEOUT;
+    return 1;
+  }
+  strcpy(relay->cache_key = Malloc(strlen(cache_key) + 1), cache_key);
+  relay->forward_range =
+    request->range && CacheIsUncacheable(ctx->cache, cache_key);
+
+  // a dark origin fails fast instead of holding an origin slot
+  if (!BreakerAllow(request->host, request->port)) {
+    LogDebug("Breaker open, reject %s\n", cache_key);
+    relay->error_status = 503;
+    return -1;
+  }
+  if (!LimiterTryAcquire(&origin_limit, 1)) {
+    LogInfo("Too many origin requests, reject %s\n", cache_key);
+    relay->error_status = 503;
+    return -1;
+  }
+  relay->origin_held = 1;
+
+  LogDebug("Trying to resolve host...\n");
+  relay->resolve = ResolveStart(request->host, request->port, ctx->wake_fd[1]);
+  relay->stage = RELAY_RESOLVE;
+  relay->deadline = relay->request_deadline;
+  return 1;
+}
+
+// Start connecting to the origin once its name is resolved
+// return 1 if the relay goes on, -1 if it failed
+static int Resolved(WorkerCtx *ctx, Relay *relay, long now) {
+  struct addrinfo *server_info;
+  if (!ResolveTake(relay->resolve, &server_info)) {
+    return 1;
+  }
+  relay->resolve = NULL;
+  if (!server_info) {
+    BreakerFailure(relay->request.host, relay->request.port);
+    relay->error_status = 502;
+    return -1;
+  }
+  // resolved and connected in two steps, so a trace tells them apart
+  Trace(relay->broswer_fd, TRACE_DNS_DONE);
+  relay->addrs = relay->addr = server_info;
+  return ConnectOrigin(relay, now);
+}
+
+// Start a non-blocking connect to relay->addr, or to the next address that
+// does not fail at once. Every address gets CONNECT_TIMEOUT, within the
+// deadline of the request.
+// return 1 if the relay goes on, -1 if no address is left
+static int ConnectOrigin(Relay *relay, long now) {
+  LogDebug("Trying to connect to host...\n");
+  for (; relay->addr; relay->addr = relay->addr->ai_next) {
+    const struct addrinfo *p = relay->addr;
+    int host_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol);
+    if (host_fd < 0) {
+      perror("ConnectOrigin: socket");
+      continue;
+    }
+    SetSockNonBlocking(host_fd);
+    if (connect(host_fd, p->ai_addr, p->ai_addrlen) == 0 ||
+        errno == EINPROGRESS) {
+      relay->host_fd = host_fd;
+      relay->stage = RELAY_CONNECT;
+      long deadline = now + CONNECT_TIMEOUT;
+      relay->deadline = deadline < relay->request_deadline ? deadline :
+        relay->request_deadline;
+      return 1;
+    }
+    LogDebug("ConnectOrigin: %s\n", strerror(errno));
+    Close(host_fd);
+  }
+  BreakerFailure(relay->request.host, relay->request.port);
+  relay->error_status = 502;
+  return -1;
+}
+
+// The origin socket became writable: the connect is done, start sending
+// the request if it succeeded, try the next address otherwise
+// return 1 if the relay goes on, -1 if it failed
+static int Connected(Relay *relay, long now) {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(relay->host_fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0) {
+    error = errno;
+  }
+  if (error) {
+    LogDebug("Connected: %s\n", strerror(error));
+    Close(relay->host_fd);
+    relay->host_fd = -1;
+    relay->addr = relay->addr->ai_next;
+    return ConnectOrigin(relay, now);
+  }
+  Trace(relay->broswer_fd, TRACE_CONNECT_DONE);
+  if (!BuildRequest(relay)) {
+    relay->error_status = 400;
+    return -1;
+  }
+  relay->stage = RELAY_SEND_REQUEST;
+  relay->deadline = relay->request_deadline;
+  return SendRequest(relay);
+}
+
+// Rewrite the request header for the origin into relay->request_iov
+// return 1 on success, 0 if it cannot be rewritten
+static int BuildRequest(Relay *relay) {
+  const char *request_buf;
+  rio_viewpeek(&relay->view, &request_buf);
+  // parsed before, the spans point into the view
+  HeaderBlock block;
+  ParseHeaderBlock(request_buf, relay->request_size, &block);
+  // a Range request fetches the whole object once, later ranges are served
+  // from the cache, unless it cannot be cached
+  char client_addr[INET6_ADDRSTRLEN] = "unknown";
+  PeerAddress(relay->broswer_fd, client_addr, sizeof(client_addr));
+  // an HTTP/1.0 browser cannot take a chunked body, its origin must not
+  // send one
+  relay->scratch = Malloc(MAXLINE);
+  relay->request_iovcnt =
+    BuildUpstreamRequest(&block, relay->http11 ? config.upstream_minor : 0,
+                         client_addr,
+                         relay->request.range && !relay->forward_range,
+                         relay->request_iov, relay->scratch);
+  return relay->request_iovcnt > 0;
+}
+
+// Send what the origin socket takes of the request header, then wait for
+// the response. The header is freed, unless a whole object is fetched for
+// a Range request: its Range may be sent after all.
+// return 1 if the relay goes on, -1 if it failed
+static int SendRequest(Relay *relay) {
+  LogDebug("Trying to forward broswer request...\n");
+  size_t size = 0;
+  switch (SocketSendv(relay->host_fd, relay->request_iov,
+                      relay->request_iovcnt, &size, 0, 0)) {
+    case 0:
+      return 1;
+
+    case -1:
+      LogDebug("Forward broswer error...\n");
+      BreakerFailure(relay->request.host, relay->request.port);
+      relay->error_status = 502;
+      return -1;
+  }
+  relay->streaming = !relay->request.range || relay->forward_range;
+  if (relay->streaming) {
+    FreeRequestView(&relay->view, &relay->request);
+  }
+  Free(relay->scratch);
+  relay->scratch = NULL;
+  relay->stage = RELAY_RESPONSE;
+  relay->deadline = HeaderDeadline(relay, NowMs());
+  return 1;
+}
+
+// The header of a whole object fetched for a Range request is known. An
+// object the cache may keep is received whole to cut the ranges from, a
+// status other than 200 is relayed as it is, and a 200 the cache cannot
+// keep is asked for again with the Range of the browser, as is an object
+// that does not fit in the buffered bytes left.
+// return 1 if the response is relayed, 0 if it is asked for again, -1 if
+// the relay failed
+static int CheckRangeOrigin(WorkerCtx *ctx, Relay *relay, long now) {
+  HTTPResponse *response = &relay->response;
+  if (response->status_code == 200 &&
+      (!IsStorable(response->buf, response, relay->credentials) ||
+       response->total_size > ctx->cache->max_object_size)) {
+    LogDebug("Range of uncacheable %s goes to the origin\n", relay->cache_key);
+    CacheMarkUncacheable(ctx->cache, relay->cache_key);
+    return RefetchRange(relay, now) < 0 ? -1 : 0;
+  }
+  if (response->status_code != 200) {
+    // the same response as with the Range, which it does not depend on
+    FreeRequestView(&relay->view, &relay->request);
+    relay->streaming = 1;
+    return 1;
+  }
+  if (!ReserveResponse(response)) {
+    LogDebug("Range of %s goes to the origin, out of buffers\n",
+             relay->cache_key);
+    return RefetchRange(relay, now) < 0 ? -1 : 0;
+  }
+  return 1;
+}
+
+// Drop the response of the whole object and send the request again on a
+// new origin connection, Range included
+// return 1 if the relay goes on, -1 if no address is left
+static int RefetchRange(Relay *relay, long now) {
+  Close(relay->host_fd);
+  relay->host_fd = -1;
+  if (relay->response.buf) {
+    BufferFree(relay->response.buf, relay->response.buffer_size);
+  }
+  FreeHTTPREsponse(&relay->response);
+  InitHTTPResponse(&relay->response);
+  relay->responded = 0;
+  relay->forward_range = 1;
+  relay->addr = relay->addrs;
+  return ConnectOrigin(relay, now);
+}
+
+// Deadline of a relay waiting for a response header, bounded by the deadline
+// of the whole request
+static long HeaderDeadline(const Relay *relay, long now) {
+  long deadline = now + HEADER_TIMEOUT;
+  return deadline < relay->request_deadline ? deadline :
+    relay->request_deadline;
+}
+
+// Append a relay to the round-robin order
+static void AddRelay(WorkerCtx *ctx, Relay *relay) {
+  Relay **pp = &ctx->relays;
+  while (*pp) {
+    pp = &(*pp)->next;
+  }
+  relay->next = NULL;
+  *pp = relay;
+}
+
+// Free a relay unlinked from the worker, the browser connection waits for
+// its next request if keep_alive is set and is closed otherwise
+static void EndRelay(WorkerCtx *ctx, Relay *relay, int keep_alive) {
+  if (relay->resolve) {
+    ResolveCancel(relay->resolve);
+  }
+  if (relay->host_fd >= 0) {
+    Close(relay->host_fd);
+  }
+  if (relay->origin_held) {
+    LimiterRelease(&origin_limit, 1);
+  }
+  if (relay->view.buf) {
+    FreeRequestView(&relay->view, &relay->request);
+  }
+  if (relay->addrs) {
+    freeaddrinfo(relay->addrs);
+  }
+  Free(relay->scratch);
+  if (relay->obj) {
+    CacheRelease(ctx->cache, relay->obj);
+  }
+  if (relay->response.buf) {
+    BufferFree(relay->response.buf, relay->response.buffer_size);
+  }
+  Free(relay->owned);
+  Free(relay->cache_key);
+  FreeHTTPRequest(&relay->request);
+  FreeHTTPREsponse(&relay->response);
+  if (relay->rate) {
+    PutClientRate(relay->rate);
+  }
+  if (keep_alive) {
+    AddIdle(ctx, relay->broswer_fd);
+  } else {
+    CloseConnection(ctx, relay->broswer_fd);
+  }
+  Free(relay);
+}
+
+// Answer with relay->error_status if nothing has been sent yet, then close
+static void FailRelay(WorkerCtx *ctx, Relay *relay) {
+  Trace(relay->broswer_fd, TRACE_FAIL);
+  if (!relay->bytes_out && relay->error_status) {
+    ClientError(relay->broswer_fd, relay->error_status);
+  }
+  EndRelay(ctx, relay, 0);
+}
+
+// The whole response has been received: give the origin connection back,
+// cache the response, queue an HTML page for prefetch and prepare the
+// answer if it was not streamed
+// return 1 on success, 0 if the answer cannot be built
+static int HostDone(WorkerCtx *ctx, Relay *relay) {
+  Close(relay->host_fd);
+  relay->host_fd = -1;
+  LimiterRelease(&origin_limit, 1);
+  relay->origin_held = 0;
+  if (relay->view.buf) { // the request is not sent again
+    FreeRequestView(&relay->view, &relay->request);
+  }
+
+  HTTPResponse *response = &relay->response;
+  int cached = relay->keep_body &&
+    IsCacheable(response->buf, response, response->rec_size,
+                relay->credentials) &&
+    CacheInsert(ctx->cache, relay->cache_key, response->buf,
+                response->rec_size, response->header_size,
+                ResponseExpires(response->buf, response->header_size));
+  if (cached && object_log) {
+    // written by the writer of the log from the cached copy
+    CacheObject *obj = CacheLookup(ctx->cache, relay->cache_key);
+    if (obj) {
+      ObjLogAppend(object_log, ctx->cache, obj);
+    }
+  }
+  if (cached) {
+    CompressCached(ctx->cache, relay->cache_key);
+  }
+  // prefetches are anonymous: the resources of a page seen with credentials
+  // could differ from what that browser would get
+  if (cached && !relay->credentials && IsHTMLResponse(response->buf)) {
+    // scan the page in the background, the cached copy stays valid for it
+    CacheObject *page = CacheLookup(ctx->cache, relay->cache_key);
+    if (page) {
+      PrefetchPage(ctx->cache, page, relay->request.host, relay->request.port,
+                   relay->request.path);
+    }
+  }
+  if (relay->streaming) {
+    return 1;
+  }
+  if (relay->request.range && IsCompleteResponse(response, response->rec_size)) {
+    return BuildRangeResponse(response->buf, response->rec_size,
+                              response->header_size, relay->request.range,
+                              relay->request.if_range, relay->keep_alive,
+                              relay->iov, &relay->iovcnt, &relay->owned);
+  }
+  return BuildAnswer(relay, response->buf, response->header_size,
+                     response->rec_size);
+}
+
+// The header of a streamed response has been checked: send it rewritten,
+// the body follows from response.buf as it is received
+// return 1 on success, 0 if the header cannot be parsed or the body cannot
+// be framed for the browser
+static int StartStreaming(Relay *relay) {
+  HTTPResponse *response = &relay->response;
+  // only an HTTP/1.1 browser can take a chunked body, the origin broke the
+  // protocol by sending one to the HTTP/1.0 request
+  if (!response->size && !relay->http11) {
+    LogDebug("Relay: chunked response to an HTTP/1.0 request\n");
+    return 0;
+  }
+  if (!BuildAnswer(relay, response->buf, response->header_size,
+                   response->header_size)) {
+    return 0;
+  }
+  relay->header_buf = response->buf;
+  relay->sent = response->header_size;
+  return 1;
+}
+
+// Whether the relay has bytes ready for the browser. A streamed response is
+// only sent once its header has been checked.
+static int HasPending(const Relay *relay) {
+  if (relay->iov_index < relay->iovcnt) {
+    return 1;
+  }
+  return relay->streaming && relay->sent &&
+    relay->sent < relay->response.rec_size;
+}
+
+// Drop the streamed bytes the browser was sent, once they are at least as
+// many as the bytes still buffered so every byte is moved at most once
+static void DropSent(Relay *relay) {
+  HTTPResponse *response = &relay->response;
+  size_t offset = relay->sent;
+  // a chunked body is parsed from its next chunk-size line
+  if (response->state == CHUNKED_TRANS && response->chunk_pos < offset) {
+    offset = response->chunk_pos;
+  }
+  if (offset > response->buf_offset &&
+      offset - response->buf_offset >= response->rec_size - offset) {
+    DropResponseData(response, offset);
+  }
+}
+
+// Send at most budget bytes to the browser without blocking, the pending
+// segments and the streamed body go in one gather-write
+// return bytes sent, -1 if the browser closed the connection
+static ssize_t RelaySend(Relay *relay, size_t budget) {
+  HTTPResponse *response = &relay->response;
+  if (relay->header_buf && relay->header_buf != response->buf) {
+    // response.buf moved as it grew, so did the header segments
+    uintptr_t old = (uintptr_t)relay->header_buf;
+    for (int i = relay->iov_index; i < relay->iovcnt; ++i) {
+      uintptr_t base = (uintptr_t)relay->iov[i].iov_base;
+      if (base >= old && base < old + response->header_size) {
+        relay->iov[i].iov_base = response->buf + (base - old);
+      }
+    }
+    relay->header_buf = response->buf;
+  }
+
+  struct iovec iov[MAX_IOV + 1];
+  int iovcnt = 0;
+  size_t size = 0;
+  for (int i = relay->iov_index; i < relay->iovcnt && size < budget; ++i) {
+    iov[iovcnt] = relay->iov[i];
+    size += iov[iovcnt++].iov_len;
+  }
+  if (relay->streaming && relay->sent && size < budget) {
+    iov[iovcnt].iov_base = response->buf + relay->sent - response->buf_offset;
+    iov[iovcnt].iov_len = response->rec_size - relay->sent;
+    size += iov[iovcnt++].iov_len;
+  }
+  if (size > budget) {
+    iov[iovcnt - 1].iov_len -= size - budget;
+  }
+  if (SocketSendv(relay->broswer_fd, iov, iovcnt, &size, 0, 0) < 0) {
+    return -1;
+  }
+
+  // the segments sent first, the rest is body
+  size_t left = size;
+  while (relay->iov_index < relay->iovcnt) {
+    struct iovec *seg = &relay->iov[relay->iov_index];
+    if (seg->iov_len > left) {
+      seg->iov_base = (char *)seg->iov_base + left;
+      seg->iov_len -= left;
+      left = 0;
+      break;
+    }
+    left -= seg->iov_len;
+    ++relay->iov_index;
+  }
+  relay->sent += left;
+  return size;
+}
+
+// Give a relay its turn of the DRR round
+// return 1 if the relay goes on, 0 if it is complete, -1 if it failed
+static int RunRelay(WorkerCtx *ctx, Relay *relay, const struct pollfd *fds,
+                    long now) {
+  if (relay->stage == RELAY_READ_REQUEST &&
+      IsReady(fds, relay->broswer_slot) && ReadRequest(ctx, relay, now) < 0) {
+    return -1;
+  }
+  if (relay->stage == RELAY_RESOLVE && Resolved(ctx, relay, now) < 0) {
+    return -1;
+  }
+  if (relay->stage == RELAY_CONNECT && IsReady(fds, relay->host_slot) &&
+      Connected(relay, now) < 0) {
+    return -1;
+  }
+  if (relay->stage == RELAY_SEND_REQUEST && IsReady(fds, relay->host_slot) &&
+      SendRequest(relay) < 0) {
+    return -1;
+  }
+  if (relay->stage != RELAY_RESPONSE) {
+    if (now < relay->deadline) {
+      return 1;
+    }
+    if (relay->stage == RELAY_CONNECT && now < relay->request_deadline) {
+      // the address does not answer, the next one may
+      LogDebug("Relay: connect timeout\n");
+      Close(relay->host_fd);
+      relay->host_fd = -1;
+      relay->addr = relay->addr->ai_next;
+      return ConnectOrigin(relay, now);
+    }
+    LogDebug("Relay: timeout\n");
+    // a browser that does not finish its request is not answered
+    if (relay->stage != RELAY_READ_REQUEST) {
+      BreakerFailure(relay->request.host, relay->request.port);
+      relay->error_status = 504;
+    }
+    return -1;
+  }
+
+  int progress = 0;
+  if (relay->host_fd >= 0 && IsReady(fds, relay->host_slot)) {
+    size_t want = config.quantum < READ_BUF_SIZE ? config.quantum : READ_BUF_SIZE;
+    size_t received = relay->response.rec_size;
+    switch (RecvHostResponse(relay->host_fd, ctx->read_buf, want, 0,
+                             &relay->response)) {
+      case -1:
+        // a malformed response still comes from a live origin
+        if (relay->response.state == WAIT_FOR_HEADER) {
+          BreakerFailure(relay->request.host, relay->request.port);
+        }
+        relay->error_status = relay->response.error_status;
+        return -1;
+
+      case 1:
+        progress = 1;
+        if (!relay->responded &&
+            relay->response.state >= KNOW_CONTENT_LENGTH) {
+          relay->responded = 1;
+          BreakerSuccess(relay->request.host, relay->request.port);
+          if (!relay->streaming) {
+            int ret = CheckRangeOrigin(ctx, relay, now);
+            if (ret <= 0) {
+              return ret < 0 ? -1 : 1;
+            }
+          }
+          // only a response that may be cached is kept once relayed, and
+          // only if the buffered bytes hold it whole: it is relayed anyway
+          relay->keep_body = !relay->streaming ||
+            (IsStorable(relay->response.buf, &relay->response,
+                        relay->credentials) &&
+             relay->response.total_size <= ctx->cache->max_object_size &&
+             ReserveResponse(&relay->response));
+        }
+        if (!received && relay->response.rec_size) {
+          Trace(relay->broswer_fd, TRACE_ORIGIN_BYTE);
+        }
+        if (relay->streaming && !relay->sent &&
+            relay->response.state >= KNOW_CONTENT_LENGTH &&
+            !StartStreaming(relay)) {
+          relay->error_status = 502;
+          return -1;
+        }
+        if (relay->response.state == RESPONSE_DONE && !HostDone(ctx, relay)) {
+          relay->error_status = 502;
+          return -1;
+        }
+        break;
+    }
+  }
+
+  if (HasPending(relay) && IsReady(fds, relay->broswer_slot)) {
+    // unused credit is carried to the next round, at most one quantum of it
+    if (relay->deficit > config.quantum) {
+      relay->deficit = config.quantum;
+    }
+    relay->deficit += config.quantum;
+    size_t budget = relay->deficit;
+    if (relay->rate) {
+      budget = TokenBucketTake(&relay->rate->bucket, budget);
+    }
+    ssize_t n = RelaySend(relay, budget);
+    if (n < 0) {
+      LogDebug("Forward Host response error...\n");
+      relay->error_status = 0;
+      return -1;
+    }
+    if (relay->rate) {
+      TokenBucketGive(&relay->rate->bucket, budget - n);
+    }
+    relay->deficit -= n;
+    relay->bytes_out += n;
+    progress |= n > 0;
+    if (!relay->keep_body && relay->sent &&
+        relay->iov_index == relay->iovcnt) {
+      DropSent(relay);
+    }
+  }
+  if (!HasPending(relay)) {
+    // DRR: a relay with nothing to send keeps no credit
+    relay->deficit = 0;
+  }
+
+  if (relay->host_fd < 0 && !HasPending(relay)) {
+    return 0;
+  }
+  if (progress) {
+    if (HasPending(relay)) {
+      relay->deadline = now + SEND_TIMEOUT;
+    } else {
+      relay->deadline = relay->response.state == WAIT_FOR_HEADER ?
+        HeaderDeadline(relay, now) : now + DATA_TIMEOUT;
+    }
+  } else if (now >= relay->deadline) {
+    LogDebug("Relay: timeout\n");
+    if (relay->host_fd >= 0 && !relay->responded) {
+      BreakerFailure(relay->request.host, relay->request.port);
+    }
+    relay->error_status = HasPending(relay) ? 0 : 504;
+    return -1;
+  }
+  return 1;
+}
@@ -0,0 +1,17 @@
+#ifndef __RELAY_H__
+#define __RELAY_H__
+#include "proxy.h"
+
+// Worker event loop
+// A worker multiplexes all the connections dispatched to it with poll().
+// Requests are read as their bytes arrive and origin names are looked up
+// by the resolver threads, so no connection waits on another.
+// Responses are relayed to the browsers in quanta of config.quantum bytes by
+// a deficit round-robin scheduler, so a bulk download only gets its share of
+// the worker and small responses are not queued behind it. The bandwidth of
+// every browser address can also be limited to config.client_rate bytes per
+// second.
+// 1. Input:
+//  <1> vargp : the WorkerCtx of the worker
+void *Worker(void *vargp);
+#endif
@@ -0,0 +1,108 @@
+#include "resolve.h"
+
+// Owner of a job: the worker until the lookup is done, then whoever frees it
+typedef enum {
+  RESOLVE_PENDING = 0,    // the lookup runs, the worker waits for it
+  RESOLVE_DONE = 1,       // the result waits for the worker
+  RESOLVE_ABANDONED = 2   // the worker left, the resolver frees the job
+} ResolveState;
+
+struct ResolveJob {
+  char *host;
+  char *port;
+  int wake_fd;
+  struct addrinfo *result;
+  int state;              // ResolveState, changed atomically
+  struct ResolveJob *next;
+};
+
+static ResolveJob *queue_head = NULL;
+static ResolveJob *queue_tail = NULL;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+
+static void *ResolveThread(void *vargp);
+static void FreeJob(ResolveJob *job);
+
+void ResolveInit(int nthreads) {
+  for (int i = 0; i < nthreads; ++i) {
+    pthread_t tid;
+    pthread_create(&tid, NULL, ResolveThread, NULL);
+  }
+}
+
+ResolveJob *ResolveStart(const char *host, const char *port, int wake_fd) {
+  ResolveJob *job = Calloc(1, sizeof(ResolveJob));
+  strcpy(job->host = Malloc(strlen(host) + 1), host);
+  strcpy(job->port = Malloc(strlen(port) + 1), port);
+  job->wake_fd = wake_fd;
+  job->state = RESOLVE_PENDING;
+
+  // the jobs are bounded by the origin request limit, the queue is not
+  pthread_mutex_lock(&queue_lock);
+  if (queue_tail) queue_tail->next = job;
+  else queue_head = job;
+  queue_tail = job;
+  pthread_cond_signal(&queue_not_empty);
+  pthread_mutex_unlock(&queue_lock);
+  return job;
+}
+
+int ResolveTake(ResolveJob *job, struct addrinfo **result) {
+  if (__sync_fetch_and_add(&job->state, 0) != RESOLVE_DONE) {
+    return 0;
+  }
+  *result = job->result;
+  job->result = NULL;
+  FreeJob(job);
+  return 1;
+}
+
+void ResolveCancel(ResolveJob *job) {
+  // a finished job is freed here, a running one by its resolver thread
+  if (__sync_val_compare_and_swap(&job->state, RESOLVE_PENDING,
+                                  RESOLVE_ABANDONED) == RESOLVE_DONE) {
+    FreeJob(job);
+  }
+}
+
+static void *ResolveThread(void *vargp) {
+  pthread_detach(pthread_self());
+  while (1) {
+    pthread_mutex_lock(&queue_lock);
+    while (!queue_head) {
+      pthread_cond_wait(&queue_not_empty, &queue_lock);
+    }
+    ResolveJob *job = queue_head;
+    if (!(queue_head = job->next)) {
+      queue_tail = NULL;
+    }
+    pthread_mutex_unlock(&queue_lock);
+
+    // a job left while queued is not looked up
+    struct addrinfo *result =
+      __sync_fetch_and_add(&job->state, 0) == RESOLVE_ABANDONED ? NULL :
+      ResolveHost(job->host, job->port);
+    job->result = result;
+    int wake_fd = job->wake_fd;  // the job may be freed once it is done
+    if (__sync_val_compare_and_swap(&job->state, RESOLVE_PENDING,
+                                    RESOLVE_DONE) == RESOLVE_PENDING) {
+      char wake = 0;
+      if (write(wake_fd, &wake, 1) < 0 && errno != EAGAIN) {
+        perror("ResolveThread: wake");
+      }
+    } else {
+      FreeJob(job);
+    }
+  }
+  return NULL;
+}
+
+static void FreeJob(ResolveJob *job) {
+  if (job->result) {
+    freeaddrinfo(job->result);
+  }
+  Free(job->host);
+  Free(job->port);
+  Free(job);
+}
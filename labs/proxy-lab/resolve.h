@@ -0,0 +1,38 @@
+#ifndef __RESOLVE_H__
+#define __RESOLVE_H__
+#include "xnix_helper.h"
+
+// Name resolution off the workers
+// getaddrinfo() blocks for as long as the name server takes to answer, so
+// a worker hands the origin names it needs to the resolver threads and goes
+// on relaying. When a lookup is done, a byte is written to the wake pipe of
+// the worker that started it. A job left by its worker, e.g. on a timeout,
+// is freed by the resolver thread once its lookup returns.
+#define RESOLVE_THREADS 4   // lookups run concurrently
+
+typedef struct ResolveJob ResolveJob;
+
+// Start the resolver threads
+void ResolveInit(int nthreads);
+
+// Queue the lookup of an origin
+// 1. Input:
+//  <1> host
+//  <2> port
+//  <3> wake_fd : a byte is written to it when the lookup is done
+// 2. Output:
+//  <1> ret : the job, to pass to ResolveTake() or ResolveCancel()
+ResolveJob *ResolveStart(const char *host, const char *port, int wake_fd);
+
+// Take the result of a job if its lookup is done, the job is then freed
+// 1. Input:
+//  <1> job
+// 2. Output:
+//  <1> result : the address list to free with freeaddrinfo(), NULL if the
+//      name cannot be resolved
+//  <2> ret : 1 if done, 0 if the lookup is still running
+int ResolveTake(ResolveJob *job, struct addrinfo **result);
+
+// Leave a job whose result is no longer needed
+void ResolveCancel(ResolveJob *job);
+#endif
@@ -0,0 +1,128 @@
+#include "restart.h"
+
+static int FillAddress(struct sockaddr_un *addr, const char *path) {
+  if (strlen(path) >= sizeof(addr->sun_path)) {
+    app_error("Control socket path too long: %s\n", path);
+    return -1;
+  }
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  strcpy(addr->sun_path, path);
+  return 0;
+}
+
+int OpenControlSocket(const char *path) {
+  struct sockaddr_un addr;
+  if (FillAddress(&addr, path) < 0) {
+    return -1;
+  }
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock_fd < 0) {
+    perror("OpenControlSocket: socket");
+    return -1;
+  }
+  // the socket file of a proxy that did not exit cleanly
+  unlink(path);
+  if (bind(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+      listen(sock_fd, 1) < 0) {
+    perror("OpenControlSocket: bind");
+    close(sock_fd);
+    return -1;
+  }
+  return sock_fd;
+}
+
+int ConnectControlSocket(const char *path, long timeout) {
+  struct sockaddr_un addr;
+  if (FillAddress(&addr, path) < 0) {
+    return -1;
+  }
+  int sock_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (sock_fd < 0) {
+    perror("ConnectControlSocket: socket");
+    return -1;
+  }
+  // a Unix socket connect waits for room in the backlog up to the send
+  // timeout
+  struct timeval tv = {timeout / 1000, timeout % 1000 * 1000};
+  setsockopt(sock_fd, SOL_SOCKET, SO_SNDTIMEO, &tv, sizeof(tv));
+  if (connect(sock_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+    close(sock_fd);
+    return -1;
+  }
+  return sock_fd;
+}
+
+int SendFd(int sock_fd, int fd) {
+  // one byte of data carries the descriptor
+  char byte = 0;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  memset(&control, 0, sizeof(control));
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+  while (sendmsg(sock_fd, &msg, 0) < 0) {
+    if (errno != EINTR) {
+      perror("SendFd: sendmsg");
+      return -1;
+    }
+  }
+  return 1;
+}
+
+int RecvFd(int sock_fd, long timeout) {
+  char byte;
+  struct iovec iov = {&byte, 1};
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  struct msghdr msg;
+  memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct pollfd pfd = {sock_fd, POLLIN, 0};
+  long deadline = NowMs() + timeout;
+  int ready;
+  do {
+    long left = deadline - NowMs();
+    ready = poll(&pfd, 1, left > 0 ? left : 0);
+  } while (ready < 0 && errno == EINTR);
+  if (ready <= 0) {
+    app_error("RecvFd: no descriptor within %ld ms\n", timeout);
+    return -1;
+  }
+  ssize_t n;
+  while ((n = recvmsg(sock_fd, &msg, 0)) < 0) {
+    if (errno != EINTR) {
+      perror("RecvFd: recvmsg");
+      return -1;
+    }
+  }
+  struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+  if (n != 1 || !cmsg || cmsg->cmsg_level != SOL_SOCKET ||
+      cmsg->cmsg_type != SCM_RIGHTS ||
+      cmsg->cmsg_len != CMSG_LEN(sizeof(int))) {
+    app_error("RecvFd: no descriptor received\n");
+    return -1;
+  }
+  int fd;
+  memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+  return fd;
+}
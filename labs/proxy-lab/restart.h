@@ -0,0 +1,34 @@
+#ifndef __RESTART_H__
+#define __RESTART_H__
+#include "xnix_helper.h"
+#include <sys/un.h>
+
+// Hot restart
+// A proxy started with a control socket path listens on it for its
+// successor. A new proxy started with the same path connects to it: the
+// running proxy stops accepting, stops appending to the object log and
+// passes its listening socket over with SCM_RIGHTS. The new proxy opens the
+// object log and accepts on the inherited socket right away, while the old
+// one finishes its in-flight responses and exits.
+#define DRAIN_TIMEOUT 60000       // ms the old proxy may take to drain
+#define HANDOFF_TIMEOUT 5000      // ms the new proxy waits for the listener
+#define CONTROL_POLL 100          // ms between checks of the control socket
+                                  // while the proxy waits for a free slot
+
+// Listen for a successor on a Unix socket, replacing a stale socket file
+// return the listening socket, -1 on failure
+int OpenControlSocket(const char *path);
+
+// Connect to the proxy listening on a control socket, waiting at most
+// timeout ms while its backlog is full
+// return the connected socket, -1 if no proxy listens on path
+int ConnectControlSocket(const char *path, long timeout);
+
+// Pass a descriptor over a Unix socket
+// return 1 on success, -1 on failure
+int SendFd(int sock_fd, int fd);
+
+// Receive a descriptor passed with SendFd(), waiting at most timeout ms
+// return the descriptor, -1 on failure or timeout
+int RecvFd(int sock_fd, long timeout);
+#endif
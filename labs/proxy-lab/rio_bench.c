@@ -0,0 +1,193 @@
+// Microbenchmark of rio_readlineb() against the per-byte line reader it
+// replaced, and of the zero-copy rio_view_t reading the same lines in place.
+// The readers go over the same file of HTTP request headers, which stays in
+// the page cache between rounds.
+// Usage: ./rio_bench [megabytes] [rounds]
+#include "xnix_helper.h"
+
+#define LINE_SIZE 8192
+
+static const char *header_lines[] = {
+  "GET http://www.cmu.edu/hub/index.html HTTP/1.1\r\n",
+  "Host: www.cmu.edu\r\n",
+  "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:10.0.3) Gecko/20120305 Firefox/10.0.3\r\n",
+  "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,*/*;q=0.8\r\n",
+  "Accept-Language: en-US,en;q=0.5\r\n",
+  "Accept-Encoding: gzip, deflate\r\n",
+  "Cookie: session=8f3a9c0d2b7e4f61a5d8; theme=dark; tz=America/New_York\r\n",
+  "Connection: keep-alive\r\n",
+  "\r\n",
+};
+
+// The per-byte reader, kept as the baseline
+static ssize_t rio_read_bytewise(rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+  while (rp->rio_cnt <= 0) { // Refill if the buf is empty
+    rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFFER);
+
+    if (rp->rio_cnt < 0) { // Interup
+      if (errno != EINTR) return -1;
+    } else if (rp->rio_cnt == 0) { // EOF
+      return 0;
+    } else {
+      rp->rio_bufptr = rp->rio_buf;
+    }
+  }
+
+  // copy data from internal buffer to user buffer
+  cnt = n < rp->rio_cnt ? n : rp->rio_cnt;
+  memcpy(usrbuf, rp->rio_bufptr, cnt);
+  rp->rio_bufptr += cnt;
+  rp->rio_cnt -= cnt;
+  return cnt;
+}
+
+static ssize_t rio_readlineb_bytewise(rio_t *rp, void *usrbuf, size_t maxlen) {
+  int n, rc;
+  char c, *bufp = usrbuf;
+  // copy at most maxlen - 1 bytes, the left 1 byte for null terminate ch
+  for (n = 1; n < maxlen; ++n) {
+    if ((rc = rio_read_bytewise(rp, &c, 1)) == 1) {
+      *bufp++ = c;
+      if (c == '\n') {
+        break;
+      }
+    } else if (rc == 0) {
+      if (n == 1) return 0; // EOF, no data read
+      else break;
+    } else {
+      return -1;
+    }
+  }
+  *bufp = '\0';
+  return n;
+}
+
+typedef ssize_t (*LineReader)(rio_t *rp, void *usrbuf, size_t maxlen);
+
+typedef struct {
+  size_t lines;
+  size_t bytes;
+  uint32_t checksum;    // both readers must see the same lines
+} ReadResult;
+
+static double NowSec(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Read the whole file line by line
+// return the seconds spent
+static double ReadAll(int fd, LineReader reader, ReadResult *result) {
+  static char line[LINE_SIZE];
+  rio_t rio;
+  memset(result, 0, sizeof(*result));
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    unix_error("rio_bench: lseek");
+  }
+  rio_readinitb(&rio, fd);
+
+  double start = NowSec();
+  ssize_t n;
+  while ((n = reader(&rio, line, LINE_SIZE)) > 0) {
+    size_t size = strlen(line);
+    ++result->lines;
+    result->bytes += size;
+    result->checksum = result->checksum * 31 + (unsigned char)line[size - 1] +
+      (unsigned char)line[0];
+  }
+  if (n < 0) {
+    unix_error("rio_bench: read");
+  }
+  return NowSec() - start;
+}
+
+// Read the whole file line by line with views, no line is copied
+// return the seconds spent
+static double ReadAllView(int fd, ReadResult *result) {
+  rio_view_t view;
+  memset(result, 0, sizeof(*result));
+  if (lseek(fd, 0, SEEK_SET) < 0) {
+    unix_error("rio_bench: lseek");
+  }
+  rio_viewinit(&view, fd, LINE_SIZE);
+
+  double start = NowSec();
+  const char *line;
+  ssize_t n;
+  while ((n = rio_viewpeekuntil(&view, "\n", 1, &line)) > 0) {
+    ++result->lines;
+    result->bytes += n;
+    result->checksum = result->checksum * 31 + (unsigned char)line[n - 1] +
+      (unsigned char)line[0];
+    rio_viewconsume(&view, n);
+  }
+  if (n < 0) {
+    unix_error("rio_bench: read");
+  }
+  double seconds = NowSec() - start;
+  rio_viewdeinit(&view);
+  return seconds;
+}
+
+static void Report(const char *name, double seconds, const ReadResult *result) {
+  printf("%-10s %8.1f MB/s %8.1f ns/line\n", name,
+         result->bytes / seconds / (1 << 20),
+         seconds * 1e9 / result->lines);
+}
+
+int main(int argc, char **argv) {
+  size_t megabytes = argc > 1 ? strtoul(argv[1], NULL, 10) : 64;
+  int rounds = argc > 2 ? atoi(argv[2]) : 5;
+  if (!megabytes || rounds <= 0) {
+    fprintf(stderr, "Usage: %s [megabytes] [rounds]\n", argv[0]);
+    exit(0);
+  }
+
+  char path[] = "/tmp/rio_bench.XXXXXX";
+  int fd = mkstemp(path);
+  if (fd < 0) {
+    unix_error("rio_bench: mkstemp");
+  }
+  unlink(path);
+  size_t nlines = sizeof(header_lines) / sizeof(header_lines[0]);
+  for (size_t written = 0, i = 0; written < megabytes << 20; ++i) {
+    const char *line = header_lines[i % nlines];
+    size_t size = strlen(line);
+    if (rio_writen(fd, (void *)line, size) != size) {
+      unix_error("rio_bench: write");
+    }
+    written += size;
+  }
+
+  // best of rounds, alternating the readers
+  double best_bytewise = 0, best_memchr = 0, best_view = 0;
+  ReadResult bytewise, memchr_result, view;
+  for (int i = 0; i < rounds; ++i) {
+    double t = ReadAll(fd, rio_readlineb_bytewise, &bytewise);
+    best_bytewise = !i || t < best_bytewise ? t : best_bytewise;
+    t = ReadAll(fd, rio_readlineb, &memchr_result);
+    best_memchr = !i || t < best_memchr ? t : best_memchr;
+    t = ReadAllView(fd, &view);
+    best_view = !i || t < best_view ? t : best_view;
+  }
+  if (bytewise.lines != memchr_result.lines ||
+      bytewise.bytes != memchr_result.bytes ||
+      bytewise.checksum != memchr_result.checksum ||
+      view.lines != bytewise.lines || view.bytes != bytewise.bytes ||
+      view.checksum != bytewise.checksum) {
+    fprintf(stderr, "rio_bench: readers disagree\n");
+    exit(1);
+  }
+
+  printf("%zu MB, %zu lines, best of %d rounds\n", megabytes,
+         bytewise.lines, rounds);
+  Report("bytewise", best_bytewise, &bytewise);
+  Report("memchr", best_memchr, &memchr_result);
+  Report("view", best_view, &view);
+  printf("speedup    %8.2fx memchr, %.2fx view\n", best_bytewise / best_memchr,
+         best_bytewise / best_view);
+  Close(fd);
+  return 0;
+}
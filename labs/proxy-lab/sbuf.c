@@ -0,0 +1,67 @@
+#include "sbuf.h"
+
+void sbuf_init(sbuf_t *sp, int n) {
+  sp->buf = Calloc(n, sizeof(int));
+  sp->n = n;
+  sp->front = sp->rear = 0;
+  sp->count = 0;
+  pthread_mutex_init(&sp->lock, NULL);
+  pthread_cond_init(&sp->not_empty, NULL);
+  pthread_cond_init(&sp->not_full, NULL);
+}
+
+void sbuf_deinit(sbuf_t *sp) {
+  Free(sp->buf);
+  pthread_mutex_destroy(&sp->lock);
+  pthread_cond_destroy(&sp->not_empty);
+  pthread_cond_destroy(&sp->not_full);
+}
+
+void sbuf_insert(sbuf_t *sp, int item) {
+  pthread_mutex_lock(&sp->lock);
+  while (sp->count == sp->n) {
+    pthread_cond_wait(&sp->not_full, &sp->lock);
+  }
+  sp->buf[(++sp->rear) % (sp->n)] = item;
+  ++sp->count;
+  pthread_cond_signal(&sp->not_empty);
+  pthread_mutex_unlock(&sp->lock);
+}
+
+int sbuf_tryinsert(sbuf_t *sp, int item) {
+  int ret = 0;
+  pthread_mutex_lock(&sp->lock);
+  if (sp->count < sp->n) {
+    sp->buf[(++sp->rear) % (sp->n)] = item;
+    ++sp->count;
+    pthread_cond_signal(&sp->not_empty);
+    ret = 1;
+  }
+  pthread_mutex_unlock(&sp->lock);
+  return ret;
+}
+
+int sbuf_remove(sbuf_t *sp) {
+  pthread_mutex_lock(&sp->lock);
+  while (sp->count == 0) {
+    pthread_cond_wait(&sp->not_empty, &sp->lock);
+  }
+  int item = sp->buf[(++sp->front) % (sp->n)];
+  --sp->count;
+  pthread_cond_signal(&sp->not_full);
+  pthread_mutex_unlock(&sp->lock);
+  return item;
+}
+
+int sbuf_tryremove(sbuf_t *sp, int *item) {
+  int ret = 0;
+  pthread_mutex_lock(&sp->lock);
+  if (sp->count > 0) {
+    *item = sp->buf[(++sp->front) % (sp->n)];
+    --sp->count;
+    pthread_cond_signal(&sp->not_full);
+    ret = 1;
+  }
+  pthread_mutex_unlock(&sp->lock);
+  return ret;
+}
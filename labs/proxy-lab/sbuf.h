@@ -0,0 +1,32 @@
+#ifndef __SBUF_H__
+#define __SBUF_H__
+#include "xnix_helper.h"
+
+// Bounded FIFO of descriptors shared by the accept thread (producer) and
+// the worker threads (consumers)
+typedef struct {
+  int *buf;             // buffer array
+  int n;                // maximum number of slots
+  int front;            // buf[(front+1)%n] is the first item
+  int rear;             // buf[rear%n] is the last item
+  int count;            // number of items
+  pthread_mutex_t lock;
+  pthread_cond_t not_empty;
+  pthread_cond_t not_full;
+} sbuf_t;
+
+// create an empty, bounded, shared FIFO buffer with n slots
+void sbuf_init(sbuf_t *sp, int n);
+// clean up buffer sp
+void sbuf_deinit(sbuf_t *sp);
+// insert item onto the rear of shared buffer sp, block while it is full
+void sbuf_insert(sbuf_t *sp, int item);
+// insert item unless sp is full
+// return 1 if inserted, 0 if the buffer is full
+int sbuf_tryinsert(sbuf_t *sp, int item);
+// remove and return the first item from buffer sp, block while it is empty
+int sbuf_remove(sbuf_t *sp);
+// remove the first item from buffer sp into *item unless it is empty
+// return 1 if removed, 0 if the buffer is empty
+int sbuf_tryremove(sbuf_t *sp, int *item);
+#endif
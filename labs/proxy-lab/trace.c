@@ -0,0 +1,137 @@
+#include "trace.h"
+#include <sys/resource.h>
+
+typedef struct TraceRing {
+  uint32_t thread;
+  uint64_t next;                        // events recorded so far
+  TraceEvent events[TRACE_RING_EVENTS];
+  struct TraceRing *link;               // all rings, for the dump
+} TraceRing;
+
+int trace_enabled = 0;
+
+const char *trace_type_names[TRACE_NTYPES] = {
+  "accept", "request_byte", "request_header", "cache_hit", "dns_done",
+  "connect_done", "origin_byte", "last_byte", "fail", "close"
+};
+
+static const char *dump_path;
+#define MAX_TRACED_FDS (1 << 20) // fds past it are traced with connection id 0
+// connection id of every browser fd, sized to the descriptor limit
+static uint32_t *conn_ids = NULL;
+static size_t nconn_ids = 0;
+static uint32_t next_conn_id = 0;
+static TraceRing *rings = NULL;
+static uint32_t nrings = 0;
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread TraceRing *thread_ring = NULL;
+
+static TraceRing *GetRing(void) {
+  if (!thread_ring) {
+    TraceRing *ring = Calloc(1, sizeof(TraceRing));
+    pthread_mutex_lock(&rings_lock);
+    ring->thread = nrings++;
+    ring->link = rings;
+    rings = ring;
+    pthread_mutex_unlock(&rings_lock);
+    thread_ring = ring;
+  }
+  return thread_ring;
+}
+
+static uint64_t NowUs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Wait for SIGUSR1, blocked in every other thread, and dump the rings
+static void *DumpThread(void *vargp) {
+  pthread_detach(pthread_self());
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  while (1) {
+    int sig;
+    if (sigwait(&set, &sig) == 0) {
+      TraceDump();
+    }
+  }
+  return NULL;
+}
+
+void TraceInit(const char *path) {
+  dump_path = path;
+  struct rlimit limit;
+  nconn_ids = getrlimit(RLIMIT_NOFILE, &limit) == 0 &&
+    limit.rlim_cur < MAX_TRACED_FDS ? limit.rlim_cur : MAX_TRACED_FDS;
+  conn_ids = Calloc(nconn_ids, sizeof(uint32_t));
+  trace_enabled = 1;
+  // threads created from now on inherit the mask
+  sigset_t set;
+  sigemptyset(&set);
+  sigaddset(&set, SIGUSR1);
+  pthread_sigmask(SIG_BLOCK, &set, NULL);
+  pthread_t tid;
+  pthread_create(&tid, NULL, DumpThread, NULL);
+}
+
+void TraceAccept(int fd) {
+  if (fd >= 0 && (size_t)fd < nconn_ids) {
+    conn_ids[fd] = __sync_add_and_fetch(&next_conn_id, 1);
+  }
+  TraceRecord(fd, TRACE_ACCEPT);
+}
+
+void TraceRecord(int fd, TraceType type) {
+  TraceRing *ring = GetRing();
+  TraceEvent *event = &ring->events[ring->next & (TRACE_RING_EVENTS - 1)];
+  event->ts_us = NowUs();
+  event->conn_id = fd >= 0 && (size_t)fd < nconn_ids ? conn_ids[fd] : 0;
+  event->type = type;
+  event->thread = ring->thread;
+  // the event is complete before it is counted
+  __sync_synchronize();
+  ++ring->next;
+}
+
+// Rings are read while their threads go on recording, the newest events
+// of a busy thread may be missing or replaced in the dump
+void TraceDump(void) {
+  char *tmp = Malloc(strlen(dump_path) + 5);
+  sprintf(tmp, "%s.tmp", dump_path);
+  int fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0) {
+    perror("TraceDump: open");
+    Free(tmp);
+    return;
+  }
+  pthread_mutex_lock(&rings_lock);
+  TraceDumpHeader header = {TRACE_DUMP_MAGIC, nrings};
+  int ok = rio_writen(fd, &header, sizeof(header)) == sizeof(header);
+  for (TraceRing *ring = rings; ok && ring; ring = ring->link) {
+    uint64_t next = ring->next;
+    uint64_t n = next < TRACE_RING_EVENTS ? next : TRACE_RING_EVENTS;
+    TraceRingHeader ring_header = {ring->thread, n};
+    ok = rio_writen(fd, &ring_header, sizeof(ring_header)) ==
+      sizeof(ring_header);
+    // oldest first, the ring may wrap around once
+    size_t first = (next - n) & (TRACE_RING_EVENTS - 1);
+    size_t head = n < TRACE_RING_EVENTS - first ? n : TRACE_RING_EVENTS - first;
+    if (ok) {
+      ok = rio_writen(fd, &ring->events[first], head * sizeof(TraceEvent)) ==
+        (ssize_t)(head * sizeof(TraceEvent));
+    }
+    if (ok && n > head) {
+      ok = rio_writen(fd, ring->events, (n - head) * sizeof(TraceEvent)) ==
+        (ssize_t)((n - head) * sizeof(TraceEvent));
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+  close(fd);
+  if (!ok || rename(tmp, dump_path) < 0) {
+    perror("TraceDump: write");
+    unlink(tmp);
+  }
+  Free(tmp);
+}
@@ -0,0 +1,66 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+#include "xnix_helper.h"
+
+// Per-connection event tracing, off unless TraceInit() is called
+// Every thread records fixed-size binary events into its own ring, without
+// locks or I/O on the hot path; the oldest events are overwritten. The
+// rings are dumped to a file on SIGUSR1 and when a draining proxy exits,
+// and trace2json turns a dump into a Chrome trace (chrome://tracing).
+#define TRACE_RING_EVENTS 65536   // events kept per thread, a power of 2
+#define TRACE_DUMP_MAGIC 0x43525450u  // "PTRC"
+
+typedef enum {
+  TRACE_ACCEPT = 0,         // connection accepted
+  TRACE_REQUEST_BYTE,       // first byte of a request received
+  TRACE_REQUEST_HEADER,     // request header complete
+  TRACE_CACHE_HIT,          // answered from the cache
+  TRACE_DNS_DONE,           // origin name resolved
+  TRACE_CONNECT_DONE,       // origin connection established
+  TRACE_ORIGIN_BYTE,        // first byte of the origin response
+  TRACE_LAST_BYTE,          // last byte of the answer sent
+  TRACE_FAIL,               // relay failed
+  TRACE_CLOSE,              // connection closed
+  TRACE_NTYPES
+} TraceType;
+
+typedef struct {
+  uint64_t ts_us;           // CLOCK_MONOTONIC
+  uint32_t conn_id;         // unique per accepted connection
+  uint16_t type;            // TraceType
+  uint16_t thread;          // index of the recording thread
+} TraceEvent;
+
+// Dump file: a TraceDumpHeader, then per ring a TraceRingHeader and its
+// events, oldest first
+typedef struct {
+  uint32_t magic;
+  uint32_t nrings;
+} TraceDumpHeader;
+
+typedef struct {
+  uint32_t thread;
+  uint32_t nevents;
+} TraceRingHeader;
+
+extern int trace_enabled;
+
+// Turn tracing on, rings are dumped to path. Must be called before any
+// other thread is created, SIGUSR1 is then handled by a dump thread.
+void TraceInit(const char *path);
+
+// Give a newly accepted connection its id and record TRACE_ACCEPT
+void TraceAccept(int fd);
+
+// Record an event of the connection of fd
+void TraceRecord(int fd, TraceType type);
+
+// Write every ring to the dump file
+void TraceDump(void);
+
+// Names of the event types, for trace2json
+extern const char *trace_type_names[TRACE_NTYPES];
+
+// Record only if tracing is on, a predictable branch when it is off
+#define Trace(fd, type) do { if (trace_enabled) TraceRecord(fd, type); } while (0)
+#endif
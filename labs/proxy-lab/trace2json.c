@@ -0,0 +1,95 @@
+// Convert a trace dump of the proxy (-T) into the Chrome trace event format,
+// to be opened with chrome://tracing or https://ui.perfetto.dev.
+// Every connection is one row: its events are instant events, and the time
+// between two consecutive events is a slice named after both.
+// Usage: ./trace2json <dump> > trace.json
+#include "trace.h"
+
+static int CompareEvents(const void *a, const void *b) {
+  const TraceEvent *x = a, *y = b;
+  if (x->conn_id != y->conn_id) {
+    return x->conn_id < y->conn_id ? -1 : 1;
+  }
+  return x->ts_us < y->ts_us ? -1 : x->ts_us > y->ts_us;
+}
+
+// Read the events of every ring of a dump
+// return the events, their number in *n, NULL if the dump is malformed
+static TraceEvent *ReadDump(int fd, size_t *n) {
+  TraceDumpHeader header;
+  if (rio_readn(fd, &header, sizeof(header)) != sizeof(header) ||
+      header.magic != TRACE_DUMP_MAGIC) {
+    return NULL;
+  }
+  size_t capacity = 1024;
+  TraceEvent *events = Malloc(capacity * sizeof(TraceEvent));
+  *n = 0;
+  for (uint32_t i = 0; i < header.nrings; ++i) {
+    TraceRingHeader ring;
+    if (rio_readn(fd, &ring, sizeof(ring)) != sizeof(ring) ||
+        ring.nevents > TRACE_RING_EVENTS) {
+      Free(events);
+      return NULL;
+    }
+    while (*n + ring.nevents > capacity) {
+      capacity *= 2;
+    }
+    events = Realloc(events, capacity * sizeof(TraceEvent));
+    size_t size = ring.nevents * sizeof(TraceEvent);
+    if (rio_readn(fd, events + *n, size) != (ssize_t)size) {
+      Free(events);
+      return NULL;
+    }
+    *n += ring.nevents;
+  }
+  return events;
+}
+
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "Usage: %s <trace dump>\n", argv[0]);
+    exit(0);
+  }
+  int fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    unix_error("trace2json: open");
+  }
+  size_t n;
+  TraceEvent *events = ReadDump(fd, &n);
+  if (!events) {
+    fprintf(stderr, "trace2json: %s is not a trace dump\n", argv[1]);
+    exit(1);
+  }
+  close(fd);
+  qsort(events, n, sizeof(TraceEvent), CompareEvents);
+
+  printf("{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  const char *sep = "";
+  for (size_t i = 0; i < n; ++i) {
+    const TraceEvent *event = &events[i];
+    if (event->type >= TRACE_NTYPES) {
+      continue;
+    }
+    const char *name = trace_type_names[event->type];
+    if (!i || events[i - 1].conn_id != event->conn_id) {
+      printf("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%u,"
+             "\"args\":{\"name\":\"conn %u\"}}", sep, event->conn_id,
+             event->conn_id);
+      sep = ",\n";
+    }
+    printf("%s{\"name\":\"%s\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%llu,"
+           "\"pid\":1,\"tid\":%u,\"args\":{\"thread\":%u}}", sep, name,
+           (unsigned long long)event->ts_us, event->conn_id, event->thread);
+    const TraceEvent *next = i + 1 < n ? &events[i + 1] : NULL;
+    if (next && next->conn_id == event->conn_id &&
+        event->type != TRACE_CLOSE && next->type < TRACE_NTYPES) {
+      printf(",\n{\"name\":\"%s -> %s\",\"ph\":\"X\",\"ts\":%llu,"
+             "\"dur\":%llu,\"pid\":1,\"tid\":%u}", name,
+             trace_type_names[next->type], (unsigned long long)event->ts_us,
+             (unsigned long long)(next->ts_us - event->ts_us), event->conn_id);
+    }
+  }
+  printf("\n]}\n");
+  Free(events);
+  return 0;
+}
@@ -1,5 +1,7 @@
 #include "xnix_helper.h"
+#include <stdarg.h>
 static void* get_in_addr(struct sockaddr *sa);
+static ssize_t rio_fill(rio_t *rp);
 static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n);
 // Error Handling
 void unix_error(char *msg) {
@@ -21,6 +23,142 @@ void ai_error(int code) {
   fprintf(stderr, "%s\n", gai_strerror(code));
 }
 
+// Logging
+int log_level = LOG_WARN;
+static const char *log_level_names[] = {"ERROR", "WARN", "INFO", "DEBUG"};
+// lines are appended to log_buf, the writer thread swaps it with log_spare
+// and writes the spare out of the lock
+static char *log_buf = NULL, *log_spare = NULL;
+static size_t log_used = 0;
+static size_t log_dropped = 0;
+static int log_writing = 0;
+static pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t log_ready = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t log_written = PTHREAD_COND_INITIALIZER;
+
+static void log_write_all(const char *buf, size_t size) {
+  while (size) {
+    ssize_t n = write(STDERR_FILENO, buf, size);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return;
+    }
+    buf += n;
+    size -= n;
+  }
+}
+
+// Write the lines dropped count, called with log_lock held
+static void log_report_dropped(void) {
+  if (log_dropped) {
+    char line[64];
+    int n = snprintf(line, sizeof(line), "log: %zu line(s) dropped\n",
+                     log_dropped);
+    log_dropped = 0;
+    log_write_all(line, n);
+  }
+}
+
+static void *log_writer(void *vargp) {
+  pthread_detach(pthread_self());
+  pthread_mutex_lock(&log_lock);
+  while (1) {
+    while (!log_used) {
+      pthread_cond_wait(&log_ready, &log_lock);
+    }
+    char *buf = log_buf;
+    size_t size = log_used;
+    log_buf = log_spare;
+    log_spare = buf;
+    log_used = 0;
+    log_writing = 1;
+    pthread_mutex_unlock(&log_lock);
+    log_write_all(buf, size);
+    pthread_mutex_lock(&log_lock);
+    log_report_dropped();
+    log_writing = 0;
+    pthread_cond_broadcast(&log_written);
+  }
+  return NULL;
+}
+
+void LogInit(int level) {
+  log_level = level;
+  pthread_mutex_lock(&log_lock);
+  if (!log_buf) {
+    log_buf = Malloc(LOG_BUF_SIZE);
+    log_spare = Malloc(LOG_BUF_SIZE);
+    pthread_t tid;
+    if (pthread_create(&tid, NULL, log_writer, NULL) != 0) {
+      // stay synchronous
+      Free(log_buf);
+      Free(log_spare);
+      log_buf = log_spare = NULL;
+    } else {
+      atexit(LogFlush);
+    }
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+void LogWrite(int level, const char *format, ...) {
+  char line[LOG_LINE_SIZE];
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  int n = snprintf(line, sizeof(line), "[%ld.%03ld] %s ", (long)ts.tv_sec,
+                   ts.tv_nsec / 1000000, log_level_names[level]);
+  va_list ap;
+  va_start(ap, format);
+  n += vsnprintf(line + n, sizeof(line) - n, format, ap);
+  va_end(ap);
+  if (n >= (int)sizeof(line)) {
+    n = sizeof(line) - 1;
+    line[n - 1] = '\n';
+  }
+
+  pthread_mutex_lock(&log_lock);
+  if (!log_buf) {
+    log_write_all(line, n);
+  } else if (log_used + n > LOG_BUF_SIZE) {
+    ++log_dropped;
+  } else {
+    memcpy(log_buf + log_used, line, n);
+    // the writer only waits on an empty buffer
+    if (!log_used) {
+      pthread_cond_signal(&log_ready);
+    }
+    log_used += n;
+  }
+  pthread_mutex_unlock(&log_lock);
+}
+
+void LogFlush(void) {
+  pthread_mutex_lock(&log_lock);
+  // lines taken by the writer go out first
+  while (log_writing) {
+    pthread_cond_wait(&log_written, &log_lock);
+  }
+  if (log_buf) {
+    log_write_all(log_buf, log_used);
+    log_used = 0;
+  }
+  log_report_dropped();
+  pthread_mutex_unlock(&log_lock);
+}
+
+handler_t *Signal(int signum, handler_t *handler) {
+  struct sigaction action, old_action;
+  action.sa_handler = handler;
+  sigemptyset(&action.sa_mask);
+  action.sa_flags = SA_RESTART;
+  if (sigaction(signum, &action, &old_action) < 0) {
+    unix_error("Signal error");
+  }
+  return old_action.sa_handler;
+}
+
 void Close(int fd) {
   if (close(fd) < 0) {
     unix_error("Close error");
@@ -43,10 +181,24 @@ void *Realloc(void *ptr, size_t size) {
   return p;
 }
 
+void *Calloc(size_t nmemb, size_t size) {
+  void *p;
+  if ((p = calloc(nmemb, size)) == NULL) {
+    unix_error("Calloc error");
+  }
+  return p;
+}
+
 void Free(void *ptr) {
   free(ptr);
 }
 
+long NowMs(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000L + ts.tv_nsec / 1000000;
+}
+
 // RIO (Robust I/O)
 // Unbuffered input and output functions for reading and writting
 // binary data to and from network
@@ -96,10 +248,10 @@ ssize_t rio_writen(int fd, void *usrbuf, size_t n) {
   return n;
 }
 
+// Refill the internal buffer if it is empty
 // return value:
-// on success return the actaully bytes read, otherwise return -1
-static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
-  int cnt;
+// the number of unread bytes, 0 on EOF, -1 on error
+static ssize_t rio_fill(rio_t *rp) {
   while (rp->rio_cnt <= 0) { // Refill if the buf is empty
     rp->rio_cnt = read(rp->rio_fd, rp->rio_buf, RIO_BUFFER);
 
@@ -111,6 +263,17 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
       rp->rio_bufptr = rp->rio_buf;
     }
   }
+  return rp->rio_cnt;
+}
+
+// return value:
+// on success return the actaully bytes read, otherwise return -1
+static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
+  int cnt;
+  ssize_t rc = rio_fill(rp);
+  if (rc <= 0) {
+    return rc;
+  }
 
   // copy data from internal buffer to user buffer
   cnt = n < rp->rio_cnt ? n : rp->rio_cnt;
@@ -120,24 +283,48 @@ static ssize_t rio_read(rio_t *rp, char *usrbuf, size_t n) {
   return cnt;
 }
 
+void rio_readinitb(rio_t *rp, int fd) {
+  rp->rio_fd = fd;
+  rp->rio_cnt = 0;
+  rp->rio_bufptr = rp->rio_buf;
+}
+
+// The newline is searched with memchr() over the buffered bytes and the
+// line is copied with one memcpy() per refill instead of one rio_read()
+// call per byte.
+// return value:
+// the bytes copied including the newline, 0 on EOF, -1 on error
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen) {
-  int n, rc;
-  char c, *bufp = usrbuf;
+  char *bufp = usrbuf;
+  size_t n = 0;
+  if (!maxlen) {
+    return 0;
+  }
   // copy at most maxlen - 1 bytes, the left 1 byte for null terminate ch
-  for (n = 1; n < maxlen; ++n) {
-    if ((rc = rio_read(rp, &c, 1)) == 1) {
-      *bufp++ = c;
-      if (c == '\n') {
-        break;
-      }
-    } else if (rc == 0) {
-      if (n == 1) return 0; // EOF, no data read
-      else break;
-    } else {
+  while (n + 1 < maxlen) {
+    ssize_t rc = rio_fill(rp);
+    if (rc < 0) {
       return -1;
+    } else if (rc == 0) { // EOF
+      break;
+    }
+    size_t cnt = maxlen - 1 - n;
+    if (cnt > rp->rio_cnt) {
+      cnt = rp->rio_cnt;
+    }
+    char *newline = memchr(rp->rio_bufptr, '\n', cnt);
+    if (newline) {
+      cnt = newline - rp->rio_bufptr + 1;
+    }
+    memcpy(bufp + n, rp->rio_bufptr, cnt);
+    rp->rio_bufptr += cnt;
+    rp->rio_cnt -= cnt;
+    n += cnt;
+    if (newline) {
+      break;
     }
   }
-  *bufp = '\0';
+  bufp[n] = '\0';
   return n;
 }
 
@@ -159,6 +346,98 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n) {
   return (n - nleft);
 }
 
+// Zero-copy buffered input
+void rio_viewinit(rio_view_t *vp, int fd, size_t max_size) {
+  vp->fd = fd;
+  vp->size = RIO_BUFFER;
+  vp->max_size = max_size > RIO_BUFFER ? max_size : RIO_BUFFER;
+  vp->buf = Malloc(vp->size + 1);  // and the NUL after the data
+  vp->buf[0] = '\0';
+  vp->start = vp->end = vp->scan = 0;
+}
+
+void rio_viewdeinit(rio_view_t *vp) {
+  Free(vp->buf);
+  vp->buf = NULL;
+}
+
+// Make room after the data, first by moving the unconsumed bytes to the
+// front, then by growing the buffer
+// return 1 on success, 0 if the buffer is full of unconsumed bytes
+static int rio_viewreserve(rio_view_t *vp) {
+  if (vp->end < vp->size) {
+    return 1;
+  }
+  if (vp->start > 0) {
+    memmove(vp->buf, vp->buf + vp->start, vp->end - vp->start + 1);
+    vp->end -= vp->start;
+    vp->scan -= vp->start;
+    vp->start = 0;
+    return 1;
+  }
+  if (vp->size == vp->max_size) {
+    return 0;
+  }
+  vp->size = vp->size * 2 < vp->max_size ? vp->size * 2 : vp->max_size;
+  vp->buf = Realloc(vp->buf, vp->size + 1);
+  return 1;
+}
+
+ssize_t rio_viewfill(rio_view_t *vp) {
+  if (!rio_viewreserve(vp)) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  ssize_t n;
+  while ((n = read(vp->fd, vp->buf + vp->end, vp->size - vp->end)) < 0) {
+    if (errno != EINTR) { // Interrupted by signal handler return
+      return -1;
+    }
+  }
+  vp->end += n;
+  vp->buf[vp->end] = '\0';
+  return n;
+}
+
+size_t rio_viewpeek(const rio_view_t *vp, const char **ptr) {
+  *ptr = vp->buf + vp->start;
+  return vp->end - vp->start;
+}
+
+ssize_t rio_viewpeekuntil(rio_view_t *vp, const char *delim, size_t delim_size,
+                          const char **ptr) {
+  while (1) {
+    const char *p = vp->buf + vp->scan;
+    const char *data_end = vp->buf + vp->end;
+    while ((size_t)(data_end - p) >= delim_size &&
+           (p = memchr(p, delim[0], data_end - p - delim_size + 1))) {
+      if (!memcmp(p, delim, delim_size)) {
+        *ptr = vp->buf + vp->start;
+        return p + delim_size - *ptr;
+      }
+      ++p;
+    }
+    // a delimiter may still start in the last delim_size - 1 bytes
+    if (vp->end - vp->start >= delim_size) {
+      vp->scan = vp->end - delim_size + 1;
+    }
+    ssize_t n = rio_viewfill(vp);
+    if (n <= 0) {
+      return n;
+    }
+  }
+}
+
+void rio_viewconsume(rio_view_t *vp, size_t n) {
+  vp->start += n;
+  if (vp->start == vp->end) { // empty, restart at the front for free
+    vp->start = vp->end = vp->scan = 0;
+    vp->buf[0] = '\0';
+  } else if (vp->scan < vp->start) {
+    vp->scan = vp->start;
+  }
+}
+
 // Create a server socket and bind it to a specific port
 // 1. Input:
 //  <0> port
@@ -229,7 +508,7 @@ int CreateServerSocket(const char *port, int type, int backlog) {
 }
 
 // Try to accept a remote connection from client.
-// Implement based on accept() and select()
+// Implement based on accept() and poll()
 // 1. Input:
 //  <1> socket
 //  <2> timeout : in ms
@@ -240,21 +519,9 @@ int CreateServerSocket(const char *port, int type, int backlog) {
 //  <4> client_addr: a pointer to a str buffer, length at least 100
 // 2. Output:
 //  <1> client_addr : client ip address string
-//  <2> ret : client socket if success else -1
+//  <2> ret : client socket if success, 0 on timeout, else -1
 int Accept(int sock_fd, int timeout, int retry, char *client_addr) {
-  struct timeval tv, *tv_ptr;
-  if (timeout < 0) {
-    tv_ptr = NULL;
-  } else {
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = timeout % 1000;
-    tv_ptr = &tv;
-  }
-
-  fd_set read_fds;
-  FD_ZERO(&read_fds);
-  FD_SET(sock_fd, &read_fds);
-  switch(select(sock_fd + 1, &read_fds, NULL, NULL, tv_ptr)) {
+  switch(WaitFd(sock_fd, POLLIN, timeout)) {
     case 0: return 0; // timeout
     case -1: return -1; // error
   }
@@ -264,14 +531,15 @@ int Accept(int sock_fd, int timeout, int retry, char *client_addr) {
   int client_fd = accept(sock_fd, (struct sockaddr *)&addr, &addr_size);
 
   if (client_fd == -1) {
-    unix_error("Accpet:");
+    perror("Accept");
+    return -1;
   }
 
   const int MAXSIZE = 100;
   if (client_addr) {
     inet_ntop(addr.ss_family, get_in_addr((struct sockaddr *)&addr),
               client_addr, MAXSIZE);
-    DebugStr("Server: got connections from %s\n", client_addr);
+    LogDebug("Server: got connections from %s\n", client_addr);
   }
 
   return client_fd;
@@ -288,9 +556,22 @@ int Accept(int sock_fd, int timeout, int retry, char *client_addr) {
 // 2. Output
 //  <2> if success return sock_fd, else return -1
 int ConnectTo(const char* host, const char* port, int timeout, int retry) {
+  struct addrinfo *server_info = ResolveHost(host, port);
+  if (!server_info) {
+    return -1;
+  }
+  int sock_fd = ConnectToAddr(server_info, timeout, retry);
+  if (sock_fd < 0) {
+    LogDebug("failed to connect to (%s, %s)\n", host, port);
+  }
+  freeaddrinfo(server_info);
+  return sock_fd;
+}
+
+struct addrinfo *ResolveHost(const char* host, const char* port) {
   if (!host || !port) {
     app_error("server address or port cannot be empty!.\n");
-    return -1;
+    return NULL;
   }
 
   // given server address and port number, return the basic info about the
@@ -303,23 +584,15 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
   int ret;
   if ((ret = getaddrinfo(host, port, &hints, &server_info)) != 0) {
     ai_error(ret);
-    return -1;
-  }
-
-  // Timeout Settings
-  struct timeval tv, *tv_ptr;
-  if (timeout < 0) {
-    tv_ptr = NULL;
-  } else {
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = timeout % 1000;
-    tv_ptr = &tv;
+    return NULL;
   }
+  return server_info;
+}
 
+int ConnectToAddr(const struct addrinfo *server_info, int timeout, int retry) {
   // Loop through all the results and connect to the first we can
-  fd_set write_fds;
   int sock_fd;
-  struct addrinfo* p;
+  const struct addrinfo* p;
   for (p = server_info; p != NULL; p = p->ai_next) {
     if ((sock_fd = socket(p->ai_family, p->ai_socktype, p->ai_protocol)) == -1) {
       perror("client: socket");
@@ -333,16 +606,14 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
 
     if (connect(sock_fd, p->ai_addr, p->ai_addrlen) < 0) {
       if (errno == EINPROGRESS) {
-        FD_ZERO(&write_fds);
-        FD_SET(sock_fd, &write_fds);
-        switch (select(sock_fd + 1, NULL, &write_fds, NULL, tv_ptr)) {
+        switch (WaitFd(sock_fd, POLLOUT, timeout)) {
           case -1:
-            perror("ConnectTo: select:");
+            perror("ConnectTo: poll:");
             close(sock_fd);
             continue;
 
           case 0:
-          DebugStr("ConnectTo: select: timeout\n");
+          LogDebug("ConnectTo: poll: timeout\n");
             close(sock_fd);
             continue;
         }
@@ -357,13 +628,13 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
         }
 
         if (error) {
-          DebugStr("ConnectTo: %s\n", strerror(error));
+          LogDebug("ConnectTo: %s\n", strerror(error));
           close(sock_fd);
           continue;
         }
 
       } else {
-        DebugStr("ConnectTo: connect:");
+        LogDebug("ConnectTo: connect:");
         close(sock_fd);
         continue;
       }
@@ -372,10 +643,6 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
   }
 
   if (!p) {
-    DebugStr("failed to connect to (%s, %s)\n", host, port);
-    if (server_info) {
-      freeaddrinfo(server_info);
-    }
     return -1;
   }
 
@@ -389,14 +656,13 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
     char *str = Malloc(MAXSIZE);
     inet_ntop(p->ai_family, get_in_addr((struct sockaddr *)p->ai_addr),
               str, MAXSIZE);
-    DebugStr("connected to %s\n", str);
-    freeaddrinfo(server_info);
+    LogDebug("connected to %s\n", str);
     Free(str);
   }
   return sock_fd;
 }
 
-// Implement based on write() and select(). It supports block and non-block
+// Implement based on write() and poll(). It supports block and non-block
 // 1. Input:
 //  <1> sock_fd
 //  <2> buffer
@@ -419,35 +685,31 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry) {
 //  an error with errno set to EPIPE. Writting to such a connection a second time
 //  elicits a SIGPIPE signal whose default action is to terminate the process.
 //  <2> When some unix internal errors occur, SocketSend will terminate the program
+//  <3> The socket may be non-blocking, a full socket buffer is then waited
+//  for with poll() until timeout
 int SocketSend(int sock_fd, const char *buffer, size_t *size,
                int timeout, int retry) {
-  struct timeval tv, *tv_ptr;
-  if (timeout < 0) {
-    tv_ptr = NULL;
-  } else {
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = timeout % 1000;
-    tv_ptr = &tv;
-  }
-  fd_set write_fds;
   int cnt = 0;
   while (cnt < *size) {
-    FD_ZERO(&write_fds);
-    FD_SET(sock_fd, &write_fds);
-    switch(select(sock_fd + 1, NULL, &write_fds, NULL, tv_ptr)) {
+    switch(WaitFd(sock_fd, POLLOUT, timeout)) {
       case 0:
         *size = cnt;
         return 0;
       case -1:
         *size = cnt;
-        unix_error("SocketSend: select");
+        unix_error("SocketSend: poll");
         return -1;
     }
 
     int n = write(sock_fd, buffer + cnt, *size - cnt);
-    if (errno == EPIPE) {
-      return -1 ;
-    } else if (n < 0) {
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;
+      }
+      if (errno == EPIPE || errno == ECONNRESET) {
+        *size = cnt;
+        return -1;
+      }
       unix_error("SocketSend: write");
     }
     cnt += n;
@@ -456,8 +718,55 @@ int SocketSend(int sock_fd, const char *buffer, size_t *size,
   return 1;
 }
 
+int SocketSendv(int sock_fd, struct iovec *iov, int iovcnt, size_t *size,
+                int timeout, int retry) {
+  size_t cnt = 0;
+  while (iovcnt && !iov->iov_len) { // skip empty segments
+    ++iov;
+    --iovcnt;
+  }
+  while (iovcnt) {
+    switch(WaitFd(sock_fd, POLLOUT, timeout)) {
+      case 0:
+        *size = cnt;
+        return 0;
+      case -1:
+        *size = cnt;
+        unix_error("SocketSendv: poll");
+        return -1;
+    }
+
+    ssize_t n = writev(sock_fd, iov, iovcnt);
+    if (n < 0) {
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;
+      }
+      if (errno == EPIPE || errno == ECONNRESET) {
+        *size = cnt;
+        return -1;
+      }
+      unix_error("SocketSendv: writev");
+    }
+    cnt += n;
+    // advance past the bytes written, the last one may be partly written
+    while (iovcnt && (size_t)n >= iov->iov_len) {
+      n -= iov->iov_len;
+      iov->iov_base = (char *)iov->iov_base + iov->iov_len;
+      iov->iov_len = 0;
+      ++iov;
+      --iovcnt;
+    }
+    if (iovcnt) {
+      iov->iov_base = (char *)iov->iov_base + n;
+      iov->iov_len -= n;
+    }
+  }
+  *size = cnt;
+  return 1;
+}
+
 // Read data from socket stream.
-// Implement based on read() and select(). It supports block and non-block
+// Implement based on read() and poll(). It supports block and non-block
 // 1. Input:
 //  <1> sock_fd
 //  <2> buffer
@@ -479,30 +788,20 @@ int SocketSend(int sock_fd, const char *buffer, size_t *size,
 //      or some data are copied into socket buffer if flag = DONT_WAIT_ALL_DATA
 // 3. Note
 //  <1> When some unix internal errors occur, SocketRecv will terminate the program
+//  <2> The socket may be non-blocking, an empty socket buffer is then waited
+//  for with poll() until timeout
 int SocketRecv(int sock_fd, char *buffer, size_t *size, RecvFlag flag,
                int timeout, int retry) {
-  struct timeval tv, *tv_ptr;
-  if (timeout < 0) {
-    tv_ptr = NULL;
-  } else {
-    tv.tv_sec = timeout / 1000;
-    tv.tv_usec = timeout % 1000;
-    tv_ptr = &tv;
-  }
-
-  fd_set read_fds;
   int cnt = 0;
   while (cnt < *size) {
-    FD_ZERO(&read_fds);
-    FD_SET(sock_fd, &read_fds);
-    switch(select(sock_fd + 1, &read_fds, NULL, NULL, tv_ptr)) {
+    switch(WaitFd(sock_fd, POLLIN, timeout)) {
       case 0:   // timeout
         *size = cnt;
         return 0;
 
       case -1:  // internal error
         *size = cnt;
-        unix_error("SocketRecv: select");
+        unix_error("SocketRecv: poll");
 
       default:
         break;
@@ -511,7 +810,13 @@ int SocketRecv(int sock_fd, char *buffer, size_t *size, RecvFlag flag,
     int n = read(sock_fd, buffer + cnt, *size - cnt);
 
     if (n < 0) {
-      unix_error("SocketRecv: read");
+      if (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK) {
+        continue;
+      }
+      if (errno != ECONNRESET) {
+        unix_error("SocketRecv: read");
+      }
+      n = 0;  // a reset connection is handled as closed by the peer
     }
 
     cnt += n;
@@ -531,6 +836,14 @@ int SocketRecv(int sock_fd, char *buffer, size_t *size, RecvFlag flag,
   return 1;
 }
 
+int WaitFd(int fd, short events, int timeout) {
+  struct pollfd pfd = {fd, events, 0};
+  int ret;
+  while ((ret = poll(&pfd, 1, timeout)) < 0 && errno == EINTR) {
+  }
+  return ret;
+}
+
 // Set socket as block
 int SetSockBlocking(int sock_fd) {
   int flags;
@@ -9,6 +9,7 @@
 #include <setjmp.h>
 #include <signal.h>
 #include <sys/time.h>
+#include <time.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <sys/stat.h>
@@ -19,15 +20,60 @@
 #include <pthread.h>
 #include <semaphore.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
+#include <poll.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
 
-#define LOG_DEBUG_STR 1
-#if LOG_DEBUG_STR
-  #define DebugStr(args...) fprintf(stderr, args)
+// Leveled logging
+// A level above LOG_COMPILE_LEVEL compiles to nothing, the levels left are
+// checked against log_level at run time. Build with
+// CFLAGS+=-DLOG_COMPILE_LEVEL=3 to keep the debug messages.
+// After LogInit() a line is formatted by the caller and copied into a
+// buffer, a writer thread does the write(2) calls; before, it is written
+// at once. Lines are dropped, and counted, while the buffer is full.
+#define LOG_ERROR 0
+#define LOG_WARN 1
+#define LOG_INFO 2
+#define LOG_DEBUG 3
+#ifndef LOG_COMPILE_LEVEL
+  #define LOG_COMPILE_LEVEL LOG_INFO
+#endif
+#define LOG_BUF_SIZE (1 << 20)  // bytes buffered for the writer thread
+#define LOG_LINE_SIZE 1024      // longer lines are truncated
+
+extern int log_level;   // messages above it are skipped, LOG_WARN by default
+
+// Start the writer thread, buffered lines are flushed at exit()
+// 1. Input:
+//  <1> level : new log_level
+void LogInit(int level);
+
+// Format a line prefixed with the time and level, and queue or write it
+void LogWrite(int level, const char *format, ...)
+  __attribute__((format(printf, 2, 3)));
+
+// Write out every buffered line, for a process about to exit
+void LogFlush(void);
+
+#define LogAt(level, args...) \
+  do { if ((level) <= log_level) LogWrite(level, args); } while (0)
+#define LogError(args...) LogAt(LOG_ERROR, args)
+#if LOG_COMPILE_LEVEL >= LOG_WARN
+  #define LogWarn(args...) LogAt(LOG_WARN, args)
+#else
+  #define LogWarn(args...) do {} while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_INFO
+  #define LogInfo(args...) LogAt(LOG_INFO, args)
+#else
+  #define LogInfo(args...) do {} while (0)
+#endif
+#if LOG_COMPILE_LEVEL >= LOG_DEBUG
+  #define LogDebug(args...) LogAt(LOG_DEBUG, args)
 #else
-  #define DebugStr(args...)
+  #define LogDebug(args...) do {} while (0)
 #endif
 
 
@@ -38,7 +84,7 @@ void posix_error(int code, char *msg);
 void dns_error(char *msg);
 void ai_error(int code);
 void app_error(char *msg);
-#define app_error(args...) fprintf(stderr, args)
+#define app_error(args...) LogError(args)
 
 // Process control wrappers
 extern char **environ;  // defined by libc
@@ -86,6 +132,9 @@ void *Realloc(void *ptr, size_t size);
 void *Calloc(size_t nmemb, size_t size);
 void Free(void *ptr);
 
+// Milliseconds of a monotonic clock, for deadlines
+long NowMs(void);
+
 
 // RIO (Robust I/O)
 // Unbuffered input and output functions for reading and writting
@@ -106,11 +155,49 @@ typedef struct {
 
 // init the buffer
 void rio_readinitb(rio_t *rp, int fd);
-// read a line per call
+// read a line per call, at most maxlen - 1 bytes and a NUL
+// return the bytes read including the newline, 0 on EOF, -1 on error
 ssize_t rio_readlineb(rio_t *rp, void *usrbuf, size_t maxlen);
 // read n bytes per call
 ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 
+// Zero-copy buffered input
+// Instead of copying into a user buffer, rio_view_t hands out (pointer,
+// length) views into its own buffer, which the caller parses in place and
+// then consumes. The buffer grows up to max_size so a delimiter far away
+// (e.g. the end of a large header block) is still seen in one contiguous
+// view, and unread bytes are moved to the front only when the end of the
+// buffer is reached. A view is valid until the next call that reads. The
+// data read is always followed by a NUL byte, so parsers of C strings that
+// stop at their own delimiter can run on a view in place.
+typedef struct {
+  int fd;
+  char *buf;
+  size_t size;        // bytes of data the buffer holds, one more for the NUL
+  size_t max_size;    // the buffer never grows beyond
+  size_t start;       // first unconsumed byte
+  size_t end;         // end of the data read
+  size_t scan;        // delimiter search resumes here
+} rio_view_t;
+
+// init the view buffer of fd, growing up to max_size bytes
+void rio_viewinit(rio_view_t *vp, int fd, size_t max_size);
+// free the view buffer
+void rio_viewdeinit(rio_view_t *vp);
+// read more data after the unconsumed bytes
+// return the bytes read, 0 on EOF, -1 on error (ENOBUFS if the buffer is full)
+ssize_t rio_viewfill(rio_view_t *vp);
+// view of every unconsumed byte
+// return the length of the view, *ptr points to its first byte
+size_t rio_viewpeek(const rio_view_t *vp, const char **ptr);
+// view of the unconsumed bytes up to and including delim, reading as needed
+// return the length of the view, 0 on EOF before delim, -1 on error
+// (ENOBUFS if delim is not within max_size bytes)
+ssize_t rio_viewpeekuntil(rio_view_t *vp, const char *delim, size_t delim_size,
+                          const char **ptr);
+// mark the first n unconsumed bytes as consumed
+void rio_viewconsume(rio_view_t *vp, size_t n);
+
 // Network Wrapper
 // Create a server socket and bind it to a specific port
 // 1. Input:
@@ -124,7 +211,7 @@ ssize_t rio_readnb(rio_t *rp, void *usrbuf, size_t n);
 int CreateServerSocket(const char *port, int type, int backlog);
 
 // Try to accept a remote connection from client.
-// Implement based on accept() and select()
+// Implement based on accept() and poll()
 // 1. Input:
 //  <1> socket
 //  <2> timeout : in ms
@@ -135,7 +222,7 @@ int CreateServerSocket(const char *port, int type, int backlog);
 //  <4> client_addr: a pointer to a str buffer, length at least 100
 // 2. Output:
 //  <1> client_addr : client ip address string
-//  <2> ret : client socket if success else -1
+//  <2> ret : client socket if success, 0 on timeout, else -1
 int Accept(int sock_fd, int timeout, int retry, char *client_addr);
 
 // Try to connect to a remote sever using SOCK_STREAM
@@ -151,7 +238,14 @@ int Accept(int sock_fd, int timeout, int retry, char *client_addr);
 //  <2> if success return sock_fd, else return -1
 int ConnectTo(const char* host, const char* port, int timeout, int retry);
 
-// Implement based on write() and select(). It supports block and non-block
+// The two steps of ConnectTo(), to tell name resolution from connecting
+// Resolve a server address for SOCK_STREAM
+// return the address list to free with freeaddrinfo(), NULL on failure
+struct addrinfo *ResolveHost(const char* host, const char* port);
+// Connect to the first address of the list that accepts, same as ConnectTo()
+int ConnectToAddr(const struct addrinfo *server_info, int timeout, int retry);
+
+// Implement based on write() and poll(). It supports block and non-block
 // 1. Input:
 //  <1> sock_fd
 //  <2> buffer
@@ -167,17 +261,31 @@ int ConnectTo(const char* host, const char* port, int timeout, int retry);
 //  <1> size : return the actual bytes copy into the socket buffer
 //  <2> ret
 //    - 0 timeout
-//    - -1 peer close the socket
+//    - -1 peer close or reset the socket
 //    - 1 all data are copied into socket buffer
 // 3. Note
 //  <1> Writting to connection that has benn closed by the peer FIRST TIME elicits
 //  an error with errno set to EPIPE. Writting to such a connection a second time
 //  elicits a SIGPIPE signal whose default action is to terminate the process.
 //  <2> When some unix internal errors occur, SocketSend will terminate the program
+//  <3> The socket may be non-blocking, a full socket buffer is then waited
+//  for with poll() until timeout
 int SocketSend(int sock_fd, const char *buffer, size_t *size, int timeout, int retry);
 
+// Send the segments of iov with writev(), a gather-write of scattered data
+// 1. Input:
+//  <1> sock_fd
+//  <2> iov, iovcnt : segments to send in order, iovcnt <= IOV_MAX. The
+//      segments are advanced past the bytes sent.
+//  <3> size : receives the bytes sent
+//  <4> timeout, retry : same as SocketSend()
+// 2. Output:
+//  <1> ret : same as SocketSend()
+int SocketSendv(int sock_fd, struct iovec *iov, int iovcnt, size_t *size,
+                int timeout, int retry);
+
 // Read data from socket stream.
-// Implement based on read() and select(). It supports block and non-block
+// Implement based on read() and poll(). It supports block and non-block
 // 1. Input:
 //  <1> sock_fd
 //  <2> buffer
@@ -193,18 +301,29 @@ int SocketSend(int sock_fd, const char *buffer, size_t *size, int timeout, int r
 // 2. Output
 //  <1> size : *size the actual bytes copy from socket buffer
 //  <2> ret
-//    - -1 sender close the socket
+//    - -1 sender close or reset the socket
 //    - 0 timeout
 //    - 1 all data are copied into socket buffer if flag = WAIT_ALL_OR_TIMEOUT
 //      or some data are copied into socket buffer if flag = DONT_WAIT_ALL_DATA
 // 3. Note
 //  <1> When some unix internal errors occur, SocketRecv will terminate the program
+//  <2> The socket may be non-blocking, an empty socket buffer is then waited
+//  for with poll() until timeout
 typedef enum {
   WAIT_ALL_OR_TIMEOUT = 0,  // Wait all the data arrive or timeout
   DONT_WAIT_ALL_DATA = 1,   // Return immediately first time get the data
 }RecvFlag;
 int SocketRecv(int sock_fd, char *buffer, size_t *size, RecvFlag flag,
                int timeout, int retry);
+// Wait until a descriptor is ready with poll(), which unlike select() takes
+// descriptors of any value
+// 1. Input:
+//  <1> fd
+//  <2> events : POLLIN, POLLOUT
+//  <3> timeout : in ms, < 0 waits forever
+// 2. Output:
+//  <1> ret : 1 if ready or in error, 0 on timeout, -1 on failure
+int WaitFd(int fd, short events, int timeout);
 int SetSockBlocking(int sock_fd);
 int SetSockNonBlocking(int sock_fd);
 #endif
\ No newline at end of file